@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "input.h"
+#include "keys.c"
+#include "remap.c"
+
+// Bakes a config into a C header holding its remap table as static data, the
+// dispatch index included. Built with BAKED_CONFIG defined, dual-key-remap
+// includes the header (always named baked-config.h) and runs on that table:
+// no config file is read, parsed or watched and nothing is allocated for it.
+//
+// usage: bake <config> <header>
+//
+// The table has to stay writable as remap states live in it, everything it
+// points to is fixed. The header also keeps the config text itself, which
+// lets the tests check that a baked table behaves exactly like the parsed one.
+
+/* @return index in key_table, -1 if the key isn't in it */
+int key_table_index(KEY_DEF * key)
+{
+    int count = sizeof(key_table) / sizeof(key_table[0]);
+    int index = (int)(key - key_table);
+    if (index < 0 || index >= count) {
+        printf("Key '%s' isn't in the key table.\n", key->name);
+        return -1;
+    }
+    return index;
+}
+
+/* @return error */
+int print_key_ref(FILE * file, char * field, KEY_DEF * key)
+{
+    if (!key) return 0; // Left NULL
+    int index = key_table_index(key);
+    if (index < 0) return 1;
+    fprintf(file, "        .%s = &key_table[%d], // %s\n", field, index, key->name);
+    return 0;
+}
+
+/* @return index in the table's layer list */
+int layer_index(struct RemapTable * table, struct Layer * layer)
+{
+    int index = 0;
+    for (struct Layer * other = table->layer_list; other != layer; other = other->next) index++;
+    return index;
+}
+
+/* @return error */
+int print_layers(FILE * file, struct RemapTable * table)
+{
+    fprintf(file, "struct Layer g_baked_layers[] = {\n");
+    for (struct Layer * layer = table->layer_list; layer; layer = layer->next) {
+        fprintf(file, "    {\n        .keys = {\n");
+        for (int code = 0; code < VIRT_CODE_INDEX_LEN; code++) {
+            if (!layer->keys[code]) continue;
+            int index = key_table_index(layer->keys[code]);
+            if (index < 0) return 1;
+            fprintf(file, "            [0x%02x] = &key_table[%d], // %s\n", code, index, layer->keys[code]->name);
+        }
+        fprintf(file, "        },\n");
+        fprintf(file, "        .name = \"%s\",\n", layer->name);
+        fprintf(file, "        .is_defined = 1,\n");
+        fprintf(file, "        .first_use_line = %d,\n", layer->first_use_line);
+        if (layer->next) {
+            fprintf(file, "        .next = &g_baked_layers[%d],\n", layer_index(table, layer->next));
+        }
+        fprintf(file, "    },\n");
+    }
+    fprintf(file, "};\n\n");
+    return 0;
+}
+
+void print_config_string(FILE * file, const char * data, size_t len)
+{
+    fprintf(file, "char g_baked_config[] =\n    \"");
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = data[i];
+        if (c == '\n') {
+            fprintf(file, i + 1 < len ? "\\n\"\n    \"" : "\\n");
+        } else if (c == '\\' || c == '"') {
+            fprintf(file, "\\%c", c);
+        } else if (c < ' ' || c > '~') {
+            fprintf(file, "\\%03o", c);
+        } else {
+            fputc(c, file);
+        }
+    }
+    fprintf(file, "\";\n\n");
+}
+
+/* @return error */
+int print_chords(FILE * file, struct RemapTable * table)
+{
+    fprintf(file, "    .chords_by_virt_code = {");
+    int first = 1;
+    for (int code = 0; code < VIRT_CODE_INDEX_LEN; code++) {
+        if (!table->chords_by_virt_code[code]) continue;
+        fprintf(file, "%s[0x%02x] = 0x%x", first ? "" : ", ", code, table->chords_by_virt_code[code]);
+        first = 0;
+    }
+    fprintf(file, "},\n");
+    fprintf(file, "    .chords = {\n");
+    for (int i = 0; i < table->chord_count; i++) {
+        struct Chord * chord = &table->chords[i];
+        fprintf(file, "        {.keys = {");
+        for (int k = 0; k < chord->key_count; k++) {
+            int index = key_table_index(chord->keys[k]);
+            if (index < 0) return 1;
+            fprintf(file, "%s&key_table[%d]", k ? ", " : "", index);
+        }
+        int to = key_table_index(chord->to);
+        if (to < 0) return 1;
+        fprintf(file, "}, .key_count = %d, .to = &key_table[%d]}, // %s\n", chord->key_count, to, chord->to->name);
+    }
+    fprintf(file, "    },\n");
+    fprintf(file, "    .chord_count = %d,\n", table->chord_count);
+    fprintf(file, "    .chord_window_ms = %d,\n", table->chord_window_ms);
+    return 0;
+}
+
+// Macro events are already what gets sent, so they are baked as numbers
+void print_macro_events(FILE * file, struct RemapTable * table)
+{
+    fprintf(file, "struct MacroEvent g_baked_macro_events[] = {\n");
+    for (int i = 0; i < table->macro_event_count; i++) {
+        struct MacroEvent * event = &table->macro_events[i];
+        fprintf(file, "    {0x%02x, 0x%02x, %s, %d},\n", event->scan_code, event->virt_code,
+            event->direction == DOWN ? "DOWN" : "UP", event->flags);
+    }
+    fprintf(file, "};\n\n");
+}
+
+void print_macro(FILE * file, char * field, struct Macro * macro)
+{
+    if (!macro->count) return;
+    fprintf(file, "        .%s = {%d, %d},\n", field, macro->first, macro->count);
+}
+
+/* @return error */
+int print_baked_table(FILE * file, struct RemapTable * table, char * config_path, const char * data, size_t len)
+{
+    fprintf(file, "// Generated by bake from %s, do not edit. See bake.c.\n\n", config_path);
+    fprintf(file, "#ifndef BAKED_CONFIG_H\n#define BAKED_CONFIG_H\n\n");
+    print_config_string(file, data, len);
+    fprintf(file, "extern struct RemapTable g_baked_table;\n\n");
+
+    if (table->layer_list && print_layers(file, table)) return 1;
+    if (table->macro_event_count) print_macro_events(file, table);
+    if (table->remap_count) {
+        fprintf(file, "struct Remap g_baked_remaps[] = {\n");
+        for (int i = 0; i < table->remap_count; i++) {
+            struct Remap * remap = table->remaps[i];
+            fprintf(file, "    {\n");
+            if (print_key_ref(file, "from", remap->from) ||
+                print_key_ref(file, "to_when_alone", remap->to_when_alone) ||
+                print_key_ref(file, "to_with_other", remap->to_with_other) ||
+                print_key_ref(file, "to_double_tap", remap->to_double_tap)) {
+                return 1;
+            }
+            print_macro(file, "when_alone_macro", &remap->when_alone_macro);
+            print_macro(file, "with_other_macro", &remap->with_other_macro);
+            if (remap->layer) {
+                fprintf(file, "        .layer = &g_baked_layers[%d], // %s\n", layer_index(table, remap->layer),
+                    remap->layer->name);
+            }
+            fprintf(file, "        .hold_timeout_ms = %d,\n", remap->hold_timeout_ms);
+            fprintf(file, "        .tap_timeout_ms = %d,\n", remap->tap_timeout_ms);
+            fprintf(file, "        .double_tap_ms = %d,\n", remap->double_tap_ms);
+            fprintf(file, "        .slot = %d,\n", remap->slot);
+            fprintf(file, "        .table = &g_baked_table,\n");
+            fprintf(file, "        .hold_timer = {.on_expire = on_hold_timeout},\n");
+            fprintf(file, "        .double_tap_timer = {.on_expire = on_double_tap_timeout},\n");
+            if (i + 1 < table->remap_count) {
+                fprintf(file, "        .next = &g_baked_remaps[%d],\n", i + 1);
+            }
+            fprintf(file, "    },\n");
+        }
+        fprintf(file, "};\n\n");
+
+        fprintf(file, "struct Remap * g_baked_remap_order[] = {");
+        for (int i = 0; i < table->remap_count; i++) {
+            fprintf(file, "%s&g_baked_remaps[%d]", i ? ", " : "", i);
+        }
+        fprintf(file, "};\n\n");
+    }
+
+    fprintf(file, "struct RemapTable g_baked_table = {\n");
+    fprintf(file, "    .slot_by_virt_code = {");
+    int first = 1;
+    for (int code = 0; code < VIRT_CODE_INDEX_LEN; code++) {
+        if (!table->slot_by_virt_code[code]) continue;
+        fprintf(file, "%s[0x%02x] = %d", first ? "" : ", ", code, table->slot_by_virt_code[code]);
+        first = 0;
+    }
+    fprintf(file, "},\n");
+    if (table->chord_count && print_chords(file, table)) return 1;
+    fprintf(file, "    .remap_slot_count = %d,\n", table->remap_slot_count);
+    if (table->remap_count) {
+        // Slots are handed out in registration order, skipping shadowed remaps
+        fprintf(file, "    .remap_slots = {");
+        for (int slot = 0; slot < table->remap_slot_count; slot++) {
+            struct Remap * remap = table->remap_slots[slot];
+            int index = 0;
+            while (table->remaps[index] != remap) index++;
+            fprintf(file, "%s&g_baked_remaps[%d]", slot ? ", " : "", index);
+        }
+        fprintf(file, "},\n");
+        fprintf(file, "    .remap_by_scan_code = {");
+        first = 1;
+        for (int index = 0; index < KEY_SCAN_CODE_INDEX_LEN; index++) {
+            if (!table->remap_by_scan_code[index]) continue;
+            fprintf(file, "%s[0x%03x] = %d", first ? "" : ", ", index, table->remap_by_scan_code[index]);
+            first = 0;
+        }
+        fprintf(file, "},\n");
+        fprintf(file, "    .remaps = g_baked_remap_order,\n");
+        fprintf(file, "    .remap_count = %d,\n", table->remap_count);
+        fprintf(file, "    .remap_capacity = %d,\n", table->remap_count);
+        fprintf(file, "    .remap_list = &g_baked_remaps[0],\n");
+        fprintf(file, "    .remap_tail = &g_baked_remaps[%d],\n", table->remap_count - 1);
+    }
+    if (table->layer_list) {
+        fprintf(file, "    .layer_list = &g_baked_layers[0],\n");
+    }
+    if (table->macro_event_count) {
+        fprintf(file, "    .macro_events = g_baked_macro_events,\n");
+        fprintf(file, "    .macro_event_count = %d,\n", table->macro_event_count);
+        fprintf(file, "    .macro_event_capacity = %d,\n", table->macro_event_count);
+    }
+    fprintf(file, "    .debug = %d,\n", table->debug);
+    fprintf(file, "};\n\n#endif\n");
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc != 3) {
+        printf("usage: bake <config> <header>\n");
+        return 2;
+    }
+    FILE * file = fopen(argv[1], "rb");
+    if (!file) {
+        printf("Cannot open configuration file '%s'.\n", argv[1]);
+        return 1;
+    }
+    size_t len = 0;
+    size_t capacity = 4096;
+    char * data = malloc(capacity);
+    size_t read;
+    while ((read = fread(data + len, 1, capacity - len, file)) > 0) {
+        len += read;
+        if (len == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
+    fclose(file);
+
+    init_keys();
+    struct Engine * engine = new_engine(NULL, NULL);
+    if (load_config_buffer(engine, data, len)) return 1;
+
+    FILE * header = fopen(argv[2], "w");
+    if (!header) {
+        printf("Cannot write '%s'.\n", argv[2]);
+        return 1;
+    }
+    int err = print_baked_table(header, engine->table, argv[1], data, len);
+    fclose(header);
+    if (err) remove(argv[2]);
+    free(data);
+    free_engine(engine);
+    return err;
+}
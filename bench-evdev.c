@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include "evdev.c"
+#include "timing.c"
+
+// Throughput of the Linux backend with several keyboards at once, each one a
+// thread typing into a socketpair as fast as it can. Compares every device on
+// the one shared engine and loop (-s) with an engine per device on its own
+// thread (the default, see Sharding in evdev.c). The output goes to another
+// socketpair read by a thread of its own, so a round only ends once all of it
+// arrived. Run an optimized build (`make bench-evdev-linux`), numbers are only
+// meaningful relative to each other on the same machine.
+//
+// usage: bench-evdev [devices] [rounds per device]
+
+#define BENCH_CONFIG "config.example.txt"
+#define MAX_BENCH_DEVICES EVDEV_MAX_DEVICES
+#define EVENTS_PER_ROUND 8
+
+struct Feeder
+{
+    int fd;
+    int rounds;
+    Thread thread;
+};
+
+// CAPS+J over and over, which comes out as Ctrl+J
+void feeder_main(void * arg)
+{
+    struct Feeder * feeder = arg;
+    int codes[4] = {KEY_CAPSLOCK, KEY_J, KEY_J, KEY_CAPSLOCK};
+    int values[4] = {1, 1, 0, 0};
+    struct input_event round[EVENTS_PER_ROUND] = {0};
+    for (int i = 0; i < 4; i++) {
+        round[2 * i].type = EV_KEY;
+        round[2 * i].code = codes[i];
+        round[2 * i].value = values[i];
+        round[2 * i + 1].type = EV_SYN;
+    }
+    for (int i = 0; i < feeder->rounds; i++) {
+        assert(0 == write_evdev_events(feeder->fd, round, EVENTS_PER_ROUND));
+    }
+    close(feeder->fd);
+}
+
+struct Counter
+{
+    int fd;
+    long long bytes;
+};
+
+void counter_main(void * arg)
+{
+    struct Counter * counter = arg;
+    char buffer[65536];
+    ssize_t len;
+    while ((len = read(counter->fd, buffer, sizeof(buffer))) > 0) {
+        counter->bytes += len;
+    }
+}
+
+/* @return nanoseconds taken */
+long long bench_devices(int shared, int devices, int rounds, long long * output_events)
+{
+    int output[2];
+    assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, output));
+    struct Counter counter = {output[0], 0};
+    Thread counter_thread;
+    assert(0 == start_thread(&counter_thread, counter_main, &counter));
+
+    struct Feeder feeders[MAX_BENCH_DEVICES];
+    int device_fds[MAX_BENCH_DEVICES];
+    for (int i = 0; i < devices; i++) {
+        int pair[2];
+        assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+        device_fds[i] = pair[0];
+        feeders[i].fd = pair[1];
+        feeders[i].rounds = rounds;
+    }
+
+    long long start = now_ns();
+    struct EvdevLoop loop;
+    struct Engine * engine = NULL;
+    struct EvdevShards shards;
+    if (shared) {
+        g_evdev_output.fd = output[1];
+        engine = new_engine(send_evdev_batch, &g_evdev_output);
+        assert(0 == load_config_file(engine, BENCH_CONFIG));
+        assert(0 == init_evdev_loop(&loop, engine));
+    } else {
+        assert(0 == init_evdev_shards(&shards, output[1], BENCH_CONFIG));
+        assert(0 == init_evdev_loop(&loop, NULL));
+        assert(0 == attach_evdev_shards(&loop, &shards));
+    }
+    for (int i = 0; i < devices; i++) {
+        assert(0 == add_evdev_device(&loop, device_fds[i]));
+        assert(0 == start_thread(&feeders[i].thread, feeder_main, &feeders[i]));
+    }
+    assert(0 == run_evdev_loop(&loop));
+    if (!shared) stop_evdev_shards(&shards);
+    close(output[1]);
+    join_thread(counter_thread);
+    long long elapsed = now_ns() - start;
+
+    for (int i = 0; i < devices; i++) {
+        join_thread(feeders[i].thread);
+    }
+    if (engine) free_engine(engine);
+    close(loop.epoll_fd);
+    close(loop.timer_fd);
+    close(output[0]);
+    *output_events = counter.bytes / sizeof(struct input_event);
+    return elapsed;
+}
+
+int main(int argc, char ** argv)
+{
+    int devices = argc > 1 ? atoi(argv[1]) : 8;
+    int rounds = argc > 2 ? atoi(argv[2]) : 50000;
+    if (devices < 1 || devices > MAX_BENCH_DEVICES || rounds < 1) {
+        printf("usage: bench-evdev [devices] [rounds per device]\n");
+        return 2;
+    }
+    init_keys();
+    init_evdev_keys();
+
+    long long input_events = (long long)devices * rounds * EVENTS_PER_ROUND;
+    printf("%d devices, %lld input events, %d cpus\n", devices, input_events, cpu_count());
+    for (int shared = 1; shared >= 0; shared--) {
+        long long output_events;
+        long long elapsed = bench_devices(shared, devices, rounds, &output_events);
+        printf("%-18s %8.2f M events/s (%lld output events)\n", shared ? "Shared engine:" : "Engine per device:",
+            input_events * 1e3 / elapsed, output_events);
+        // A shared engine turns CAPS held on one device into Ctrl for the
+        // others, so only separate engines are sure to send every round as is
+        if (!shared) assert(("every event written", output_events == input_events));
+    }
+    return 0;
+}
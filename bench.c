@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "input.h"
+#include "keys.c"
+#include "remap.c"
+#include "timing.c"
+
+// Micro benchmarks for the hot paths of the remap engine. Numbers are only
+// meaningful relative to each other on the same machine; run an optimized
+// build (e.g. `cl /O2 bench.c`).
+
+int g_sent = 0;
+struct Engine * g_engine;
+
+// Mock sending input, we only care about the engine's own cost here
+void send_input_batch(struct Engine * engine, struct InputBatch * batch)
+{
+    g_sent += batch->count;
+}
+
+void SECTION(char * msg) {
+    printf("\n%s\n----------------------------------------------\n", msg);
+}
+
+// Synthetic keys so we can configure more remaps than there are named keys.
+// Virtual codes wrap before MOUSE_DUMMY_VK so mouse input is never remapped,
+// scan codes cycle through the plain and 0xE0 prefixed ones.
+KEY_DEF * bench_key(int i)
+{
+    static struct KeyDef keys[1024];
+    keys[i].name = "BENCH";
+    keys[i].scan_code = (i & 0x100 ? 0xE000 : 0) | (i & 0xFF);
+    keys[i].virt_code = i % MOUSE_DUMMY_VK;
+    return &keys[i];
+}
+
+void configure_remaps(int count)
+{
+    reset_config(g_engine);
+    for (int i = 0; i < count; i++) {
+        register_remap(g_engine, new_remap(bench_key(i), ESC, CTRL));
+    }
+}
+
+#define OTHER_INPUT_ITERATIONS 1000000
+
+void bench_other_input()
+{
+    SECTION("Other input (mouse) with nothing held");
+    for (int count = 1; count <= 256; count *= 2) {
+        configure_remaps(count);
+        long long start = now_ns();
+        for (int i = 0; i < OTHER_INPUT_ITERATIONS; i++) {
+            handle_input(g_engine, 0, MOUSE_DUMMY_VK, DOWN, 0);
+            flush_output(g_engine);
+        }
+        long long elapsed = now_ns() - start;
+        printf("%4d remaps: %6.2f ns/event\n", count, (double)elapsed / OTHER_INPUT_ITERATIONS);
+    }
+}
+
+void bench_held_cycle()
+{
+    SECTION("Hold remap, other input, release");
+    for (int count = 1; count <= 256; count *= 2) {
+        configure_remaps(count);
+        KEY_DEF * held = bench_key(count - 1);
+        long long start = now_ns();
+        for (int i = 0; i < OTHER_INPUT_ITERATIONS; i++) {
+            handle_input(g_engine, held->scan_code, held->virt_code, DOWN, 0);
+            flush_output(g_engine);
+            handle_input(g_engine, 0, MOUSE_DUMMY_VK, DOWN, 0);
+            flush_output(g_engine);
+            handle_input(g_engine, held->scan_code, held->virt_code, UP, 0);
+            flush_output(g_engine);
+        }
+        long long elapsed = now_ns() - start;
+        printf("%4d remaps: %6.2f ns/cycle\n", count, (double)elapsed / OTHER_INPUT_ITERATIONS);
+    }
+}
+
+// One second of scrolling at 100k events/s, each stamped 10us apart. Nothing
+// held should leave the mouse hook with next to nothing to do, which shows as
+// a small fraction of what the same storm costs with a remap held.
+#define WHEEL_STORM_EVENTS 100000
+
+// What the mouse hooks do with a wheel tick
+int mouse_hook(uint32_t time)
+{
+    if (!is_engine_armed(g_engine)) return 0;
+    int block_input = handle_input(g_engine, 0, MOUSE_DUMMY_VK, DOWN, time);
+    flush_output(g_engine);
+    return block_input;
+}
+
+double wheel_storm()
+{
+    long long start = now_ns();
+    for (int i = 0; i < WHEEL_STORM_EVENTS; i++) {
+        mouse_hook(i / 100);
+    }
+    return (double)(now_ns() - start) / WHEEL_STORM_EVENTS;
+}
+
+void bench_wheel_storm()
+{
+    SECTION("Wheel storm, 100k events at 100k/s");
+    configure_remaps(64);
+    KEY_DEF * held = bench_key(0);
+    double idle = wheel_storm();
+    handle_input(g_engine, held->scan_code, held->virt_code, DOWN, 0);
+    flush_output(g_engine);
+    double armed = wheel_storm();
+    handle_input(g_engine, held->scan_code, held->virt_code, UP, 0);
+    flush_output(g_engine);
+    printf("nothing held: %6.2f ns/event (%.0f%% of held)\n", idle, armed > 0 ? 100 * idle / armed : 0);
+    printf("remap held:   %6.2f ns/event\n", armed);
+    if (idle >= armed) printf("WARNING: nothing held is no cheaper than a remap held\n");
+}
+
+// How remaps used to be found, kept as a baseline
+struct Remap * find_remap_in_list(struct Remap * remap, int scan_code)
+{
+    for (; remap; remap = remap->next) {
+        if (remap->from->scan_code == scan_code) return remap;
+    }
+    return NULL;
+}
+
+#define REMAP_LOOKUP_ITERATIONS 1000000
+
+void bench_remap_lookup()
+{
+    SECTION("Remap lookup (last registered key)");
+    for (int count = 4; count <= 1024; count *= 16) {
+        configure_remaps(count);
+        struct RemapTable * table = g_engine->table;
+        KEY_DEF * key = bench_key(count - 1);
+        // Volatile so the lookups aren't hoisted out of the loops
+        volatile int scan_code = key->scan_code;
+        volatile int virt_code = key->virt_code;
+        int found = 0;
+
+        long long start = now_ns();
+        for (int i = 0; i < REMAP_LOOKUP_ITERATIONS; i++) {
+            found += find_remap_in_list(table->remap_list, scan_code) != NULL;
+        }
+        long long list = now_ns() - start;
+        start = now_ns();
+        for (int i = 0; i < REMAP_LOOKUP_ITERATIONS; i++) {
+            found += find_remap_for_scan_code(g_engine, scan_code) != NULL;
+        }
+        long long scan = now_ns() - start;
+        start = now_ns();
+        for (int i = 0; i < REMAP_LOOKUP_ITERATIONS; i++) {
+            found += find_remap_for_virt_code(g_engine, virt_code) != NULL;
+        }
+        long long virt = now_ns() - start;
+
+        printf("%4d remaps: list %7.2f, scan code %5.2f, virtual code %5.2f ns/lookup\n", count,
+            (double)list / REMAP_LOOKUP_ITERATIONS, (double)scan / REMAP_LOOKUP_ITERATIONS,
+            (double)virt / REMAP_LOOKUP_ITERATIONS);
+        assert(found == 3 * REMAP_LOOKUP_ITERATIONS);
+    }
+}
+
+// The lookup find_key_def_by_name used to do, kept as a baseline
+KEY_DEF * find_key_def_by_name_linear(char * name)
+{
+    for (int i = 0; i < KEY_TABLE_LEN; ++i) {
+        if (strcmp(key_table[i].name, name) == 0) {
+            return &key_table[i];
+        }
+    }
+    return NULL;
+}
+
+#define NAME_LOOKUP_ITERATIONS 100000
+
+void bench_key_names()
+{
+    SECTION("Key name lookup");
+    int found = 0;
+    long long start = now_ns();
+    for (int i = 0; i < NAME_LOOKUP_ITERATIONS; i++) {
+        found += find_key_def_by_name_linear(key_table[i % KEY_TABLE_LEN].name) != NULL;
+    }
+    long long linear = now_ns() - start;
+    start = now_ns();
+    for (int i = 0; i < NAME_LOOKUP_ITERATIONS; i++) {
+        found += find_key_def_by_name(key_table[i % KEY_TABLE_LEN].name) != NULL;
+    }
+    long long sorted = now_ns() - start;
+    printf("linear scan:   %6.2f ns/lookup\n", (double)linear / NAME_LOOKUP_ITERATIONS);
+    printf("binary search: %6.2f ns/lookup\n", (double)sorted / NAME_LOOKUP_ITERATIONS);
+    assert(found == 2 * NAME_LOOKUP_ITERATIONS);
+}
+
+#define CONFIG_LINES 10000
+#define CONFIG_RUNS 20
+
+void bench_config()
+{
+    SECTION("Parse a 10k line config");
+    static char lines[CONFIG_LINES][64];
+    char * settings[] = {"remap_key", "when_alone", "with_other"};
+    for (int i = 0; i < CONFIG_LINES; i++) {
+        snprintf(lines[i], sizeof(lines[i]), "%s=%s\n", settings[i % 3], key_table[(i / 3) % KEY_TABLE_LEN].name);
+    }
+    long long start = now_ns();
+    for (int run = 0; run < CONFIG_RUNS; run++) {
+        reset_config(g_engine);
+        for (int i = 0; i < CONFIG_LINES; i++) {
+            int err = load_config_line(g_engine, lines[i], i + 1);
+            assert(!err);
+        }
+    }
+    long long elapsed = now_ns() - start;
+    printf("%d lines: %.3f ms\n", CONFIG_LINES, (double)elapsed / CONFIG_RUNS / 1000000);
+    reset_config(g_engine);
+}
+
+// Builds a config of roughly the given size in the shape users write them:
+// comments, blank lines and remaps spelled a few different ways
+char * generate_config(size_t size, size_t * len)
+{
+    char * data = malloc(size + 256);
+    *len = 0;
+    for (int i = 0; *len < size; i++) {
+        KEY_DEF * key = &key_table[i % KEY_TABLE_LEN];
+        *len += sprintf(data + *len,
+            "# remap %d\r\n"
+            "remap_key=%s\r\n"
+            "  when_alone = esc\r\n"
+            "with_other=LCtrl\r\n"
+            "\r\n",
+            i, key->name);
+    }
+    return data;
+}
+
+void bench_large_configs()
+{
+    SECTION("Parse multi-megabyte configs");
+    for (size_t mb = 1; mb <= 16; mb *= 4) {
+        size_t len;
+        char * data = generate_config(mb << 20, &len);
+        long long start = now_ns();
+        for (int run = 0; run < 5; run++) {
+            reset_config(g_engine);
+            int err = load_config_buffer(g_engine, data, len);
+            assert(!err);
+        }
+        double ms = (double)(now_ns() - start) / 5 / 1000000;
+        printf("%2d MB: %7.2f ms, %6.1f MB/s\n", (int)mb, ms, (double)len / (1 << 20) / (ms / 1000));
+        reset_config(g_engine);
+        free(data);
+    }
+}
+
+int main()
+{
+    init_keys();
+    g_engine = new_engine(send_input_batch, NULL);
+    bench_other_input();
+    bench_held_cycle();
+    bench_remap_lookup();
+    bench_wheel_storm();
+    bench_key_names();
+    bench_config();
+    bench_large_configs();
+    free_engine(g_engine);
+    printf("\n(sent %d inputs)\n", g_sent);
+    return 0;
+}
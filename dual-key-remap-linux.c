@@ -0,0 +1,190 @@
+#define VERSION "0.8"
+#define AUTHOR "ililim"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "input.h"
+#include "keys.c"
+#include "remap.c"
+#include "evdev.c"
+#ifdef BAKED_CONFIG
+#include "baked-config.h"
+#endif
+
+// usage: dual-key-remap-linux [-s] [-c config] [-o output device] [-r recording] [[-c config] input device...]
+//
+// Without input devices every keyboard under /dev/input is grabbed, including
+// ones plugged in later. The output defaults to /dev/uinput. Devices can be
+// '-' for stdin/stdout, which makes it easy to pipe recorded evdev events
+// through. The flight recording (see recorder.c) goes to
+// /var/tmp/dual-key-remap.rec unless given, read it with `flight`.
+//
+// Every device gets an engine of its own on its own thread (see Sharding in
+// evdev.c), so a key held on one keyboard doesn't change the keys of another.
+// A -c between devices sets the config of the devices after it, hotplugged
+// ones get the last. With -s all devices share one engine on one thread
+// instead, for those who want CapsLock on one keyboard to work with keys on
+// another.
+//
+// Built with BAKED_CONFIG the config is compiled in (see bake.c), -c is
+// ignored and devices always share the engine: the baked table holds the
+// state of its remaps.
+
+#define USAGE "usage: dual-key-remap-linux [-s] [-c config] [-o output device] [-r recording] [[-c config] input device...]\n"
+
+int open_device(char * path, int flags)
+{
+    if (strcmp(path, "-") == 0) {
+        return flags == O_RDONLY ? STDIN_FILENO : STDOUT_FILENO;
+    }
+    int fd = open(path, flags);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open '%s': %s\n", path, strerror(errno));
+    }
+    return fd;
+}
+
+/* @return error */
+int open_output(char * path)
+{
+    g_evdev_output.fd = open_device(path, O_WRONLY);
+    if (g_evdev_output.fd < 0) return 1;
+    if (create_uinput_device(g_evdev_output.fd)) return 1;
+    // Give the new device a moment so the key release that launched us
+    // is not lost before the grab
+    usleep(200000);
+    return 0;
+}
+
+void print_banner()
+{
+    fprintf(stderr, "== dual-key-remap (version: %s, author: %s) ==\n-- DEBUG MODE --\n", VERSION, AUTHOR);
+}
+
+#ifdef BAKED_CONFIG
+struct Engine g_baked_engine;
+#endif
+
+int run_shared_engine(char * config_path, char * output_path, char * recording_path, char ** devices, int device_count)
+{
+#ifdef BAKED_CONFIG
+    struct Engine * engine = &g_baked_engine;
+    init_engine(engine, &g_baked_table, send_evdev_batch, &g_evdev_output);
+#else
+    struct Engine * engine = new_engine(send_evdev_batch, &g_evdev_output);
+    if (load_config_file(engine, config_path)) return 1;
+#endif
+    engine->debug = engine->debug || getenv("DEBUG") != NULL;
+
+    // Nice to have, we run without it
+    struct FlightRecorder recorder;
+    if (!map_flight_file(&recorder, recording_path)) engine->recorder = &recorder;
+
+#ifndef BAKED_CONFIG
+    // Edits to the config apply live. Without the watch we simply keep
+    // running on the config we started with.
+    struct ConfigWatch watch;
+    start_config_watch(&watch, engine, config_path);
+#endif
+
+    if (open_output(output_path)) return 1;
+
+    struct EvdevLoop loop;
+    if (init_evdev_loop(&loop, engine)) return 1;
+    if (device_count == 0) {
+        if (watch_evdev_dir(&loop, "/dev/input")) return 1;
+    }
+    for (int i = 0; i < device_count; i++) {
+        if (strcmp(devices[i], "-c") == 0) {
+            fprintf(stderr, "A config per device needs an engine per device, leave out -s.\n");
+            return 2;
+        }
+        int fd = open_device(devices[i], O_RDONLY);
+        if (fd < 0 || add_evdev_device(&loop, fd)) return 1;
+    }
+
+    if (engine->debug) {
+        print_banner();
+        start_log_thread(engine);
+    }
+
+    if (run_evdev_loop(&loop)) {
+        fprintf(stderr, "Event loop error: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+int run_engine_per_device(char * config_path, char * output_path, char * recording_path, char ** devices,
+    int device_count)
+{
+    if (open_output(output_path)) return 1;
+
+    struct EvdevShards shards;
+    if (init_evdev_shards(&shards, g_evdev_output.fd, config_path)) return 1;
+    shards.recording_path = recording_path;
+    shards.debug = getenv("DEBUG") != NULL;
+    if (shards.debug) print_banner();
+
+    struct EvdevLoop loop;
+    if (init_evdev_loop(&loop, NULL) || attach_evdev_shards(&loop, &shards)) return 1;
+    if (device_count == 0) {
+        if (watch_evdev_dir(&loop, "/dev/input")) return 1;
+    }
+    for (int i = 0; i < device_count; i++) {
+        if (strcmp(devices[i], "-c") == 0 && i + 1 < device_count) {
+            shards.config_path = devices[++i];
+            continue;
+        }
+        int fd = open_device(devices[i], O_RDONLY);
+        if (fd < 0 || add_evdev_device(&loop, fd)) return 1;
+    }
+
+    // Watching /dev/input this only ever returns on error, otherwise once the
+    // last device is gone
+    if (run_evdev_loop(&loop)) {
+        fprintf(stderr, "Event loop error: %s\n", strerror(errno));
+        return 1;
+    }
+    stop_evdev_shards(&shards);
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    char * config_path = "config.txt";
+    char * output_path = "/dev/uinput";
+    char * recording_path = "/var/tmp/dual-key-remap.rec";
+    int shared = 0;
+    int first_device = argc;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            config_path = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            recording_path = argv[++i];
+        } else if (strcmp(argv[i], "-s") == 0) {
+            shared = 1;
+        } else if (argv[i][0] == '-' && argv[i][1]) {
+            fprintf(stderr, USAGE);
+            return 2;
+        } else {
+            first_device = i;
+            break;
+        }
+    }
+
+    init_keys();
+    init_evdev_keys();
+#ifdef BAKED_CONFIG
+    shared = 1;
+#endif
+    if (shared) {
+        return run_shared_engine(config_path, output_path, recording_path, argv + first_device, argc - first_device);
+    }
+    return run_engine_per_device(config_path, output_path, recording_path, argv + first_device, argc - first_device);
+}
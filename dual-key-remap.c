@@ -7,6 +7,10 @@
 #include "input.h"
 #include "keys.c"
 #include "remap.c"
+#include "trace.c"
+#ifdef BAKED_CONFIG
+#include "baked-config.h"
+#endif
 
 // Globals
 // ----------------
@@ -15,45 +19,86 @@
 // by Dual Key Remap. Ideally high to minimize chances of a collision
 // with a real pointer used by another application.
 // Note: This approach is what AHK used, we should a different key id
-// from them to avoid collisions.
-#define INJECTED_KEY_ID 0xFFC3CED7
+// from them to avoid collisions. The low bits carry the output's
+// sequence number, see Echoes in remap.c.
+#define INJECTED_KEY_ID 0xFFC30000
 
-struct Remap * g_remap_list;
+// Ctrl+Alt+Shift+F12 writes the engine stats to stats.txt (and the debug
+// console) and the flight recording to flight.txt
+#define STATS_HOTKEY_ID 1
+
+struct Engine * g_engine;
+#ifdef BAKED_CONFIG
+struct Engine g_baked_engine; // Baked builds allocate nothing for the config, see bake.c
+#endif
+struct FlightRecorder g_recorder;
+UINT_PTR g_engine_timer = 0;
 HHOOK g_keyboard_hook;
 HHOOK g_mouse_hook;
 
-void send_input(int scan_code, int virt_code, enum Direction direction)
+void send_input_batch(struct Engine * engine, struct InputBatch * batch)
+{
+    // Only clear what is sent, the batch is mostly empty space
+    INPUT inputs[INPUT_BATCH_CAPACITY];
+    memset(inputs, 0, batch->count * sizeof(INPUT));
+    for (int i = 0; i < batch->count; i++) {
+        struct InputEvent * event = &batch->events[i];
+        INPUT * input = &inputs[i];
+        input->type = INPUT_KEYBOARD;
+        input->ki.time = 0;
+        input->ki.dwExtraInfo = (ULONG_PTR)(INJECTED_KEY_ID | event->seq);
+
+        input->ki.wScan = event->scan_code;
+        input->ki.wVk = event->virt_code;
+        // Per MS Docs: https://learn.microsoft.com/en-us/windows/win32/api/winuser/nf-winuser-keybd_even
+        // we need to flag whether "the scan code was preceded by a prefix byte having the value 0xE0 (224)"
+        input->ki.dwFlags = (event->direction == UP ? KEYEVENTF_KEYUP : 0) |
+            (event->flags & INPUT_EXTENDED ? KEYEVENTF_EXTENDEDKEY : 0);
+    }
+
+    // A single call keeps our inputs from being interleaved with other input
+    SendInput(batch->count, inputs, sizeof(INPUT));
+}
+
+// Hook timestamps and WM_TIMER both run on GetTickCount, so the engine's
+// deadlines can be used as they are
+void schedule_engine_timer()
+{
+    uint32_t deadline;
+    if (!next_timer_deadline(g_engine, &deadline)) return;
+    int delay = (int)(deadline - GetTickCount());
+    g_engine_timer = SetTimer(NULL, g_engine_timer, delay > 0 ? delay : 0, NULL);
+}
+
+void run_engine_timers()
 {
-    INPUT input = {0};
-    input.type = INPUT_KEYBOARD;
-    input.ki.time = 0;
-    input.ki.dwExtraInfo = (ULONG_PTR)INJECTED_KEY_ID;
-
-    input.ki.wScan = scan_code;
-    input.ki.wVk = virt_code;
-    // Per MS Docs: https://learn.microsoft.com/en-us/windows/win32/api/winuser/nf-winuser-keybd_even
-    // we need to flag whether "the scan code was preceded by a prefix byte having the value 0xE0 (224)"
-    int is_extended_key = scan_code>>8 == 0xE0;
-    input.ki.dwFlags = (direction == UP ? KEYEVENTF_KEYUP : 0) |
-        (is_extended_key ? KEYEVENTF_EXTENDEDKEY : 0);
-
-    SendInput(1, &input, sizeof(INPUT));
+    KillTimer(NULL, g_engine_timer);
+    g_engine_timer = 0;
+    run_timers(g_engine, GetTickCount());
+    flush_output(g_engine);
+    schedule_engine_timer();
 }
 
 LRESULT CALLBACK mouse_callback(int msg_code, WPARAM w_param, LPARAM l_param) {
     int block_input = 0;
 
-    // Per MS docs we should only act for HC_ACTION's
-    if (msg_code == HC_ACTION) {
+    // Per MS docs we should only act for HC_ACTION's. Mouse input only matters
+    // while a remapped key is held.
+    if (msg_code == HC_ACTION && is_engine_armed(g_engine)) {
         switch (w_param) {
         case WM_MOUSEWHEEL:
         case WM_LBUTTONDOWN:
         case WM_RBUTTONDOWN:
         case WM_MBUTTONDOWN:
         case WM_NCXBUTTONDOWN:
-        case WM_XBUTTONDOWN:
+        case WM_XBUTTONDOWN: {
             // Since no key corresponds to the mouse inputs; use a dummy input
-            block_input = handle_input(0, MOUSE_DUMMY_VK, 0, 0);
+            DWORD time = ((MSLLHOOKSTRUCT *)l_param)->time;
+            log_trace_input(g_engine, 0, MOUSE_DUMMY_VK, DOWN, time);
+            block_input = handle_input(g_engine, 0, MOUSE_DUMMY_VK, DOWN, time);
+            flush_output(g_engine);
+            schedule_engine_timer();
+        }
         }
     }
 
@@ -67,16 +112,24 @@ LRESULT CALLBACK keyboard_callback(int msg_code, WPARAM w_param, LPARAM l_param)
     // Per MS docs we should only act for HC_ACTION's
     if (msg_code == HC_ACTION) {
         KBDLLHOOKSTRUCT * data = (KBDLLHOOKSTRUCT *)l_param;
+        // Our own output is let through untouched
+        if ((data->dwExtraInfo & ~(ULONG_PTR)ECHO_SEQ_MASK) == INJECTED_KEY_ID) {
+            consume_echo(g_engine, (uint32_t)(data->dwExtraInfo & ECHO_SEQ_MASK));
+            return CallNextHookEx(g_keyboard_hook, msg_code, w_param, l_param);
+        }
         enum Direction direction = (w_param == WM_KEYDOWN || w_param == WM_SYSKEYDOWN)
             ? DOWN
             : UP;
-        int is_injected = data->dwExtraInfo == INJECTED_KEY_ID;
+        log_trace_input(g_engine, data->scanCode, data->vkCode, direction, data->time);
         block_input = handle_input(
+            g_engine,
             data->scanCode,
             data->vkCode,
             direction,
-            is_injected
+            data->time
         );
+        flush_output(g_engine);
+        schedule_engine_timer();
     }
 
     return (block_input) ? 1 : CallNextHookEx(g_mouse_hook, msg_code, w_param, l_param);
@@ -98,34 +151,142 @@ void destroy_console()
     FreeConsole();
 }
 
-int load_config_file(wchar_t * path)
+// The whole config is read with a single ReadFile and parsed in place. Pass
+// load_config_buffer at startup and reload_config_buffer afterwards.
+/* @return error */
+int load_config_file(wchar_t * path, ConfigLoader load)
 {
-    FILE * file;
-    char line[255];
-
-    if (_wfopen_s(&file, path, L"r") > 0) {
+    HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size)) {
         printf("Cannot open configuration file '%ws'. Make sure it is in the same directory as 'dual-key-remap.exe'.\n",
             path);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
         return 1;
     }
 
-    int linenum = 1;
-    while (fgets(line, 255, file)) {
-        if (load_config_line((char *)&line, linenum++)) {
-            fclose(file);
-            return 1;
-        }
-    };
-    fclose(file);
-    return 0;
+    DWORD len = 0;
+    char * data = malloc(size.QuadPart ? (size_t)size.QuadPart : 1);
+    int err = !ReadFile(file, data, (DWORD)size.QuadPart, &len, NULL);
+    CloseHandle(file);
+    if (err) {
+        printf("Cannot read configuration file '%ws'.\n", path);
+    } else {
+        err = load(g_engine, data, len);
+    }
+    free(data);
+    return err;
 }
 
-void put_config_path(wchar_t * path)
+// Files are kept next to the executable
+void put_app_file_path(wchar_t * path, wchar_t * filename)
 {
     HMODULE module = GetModuleHandleW(NULL);
     GetModuleFileNameW(module, path, MAX_PATH);
     path[wcslen(path) - strlen("dual-key-remap.exe")] = '\0';
-    wcscat(path, L"config.txt");
+    wcscat(path, filename);
+}
+
+void put_config_path(wchar_t * path)
+{
+    put_app_file_path(path, L"config.txt");
+}
+
+// Reloads the config whenever it changes. Parsing happens on this thread, the
+// hooks pick up the result on their next input. The read is overlapped so the
+// thread can also wake up to free the tables the hooks are done with.
+void config_watch_main(void * arg)
+{
+    wchar_t * config_path = arg;
+    wchar_t dir_path[MAX_PATH];
+    put_app_file_path(dir_path, L"");
+    HANDLE dir = CreateFileW(dir_path, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    OVERLAPPED overlapped = {0};
+    overlapped.hEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (dir == INVALID_HANDLE_VALUE || !overlapped.hEvent) {
+        printf("Cannot watch '%ws' for changes.\n", config_path);
+        if (dir != INVALID_HANDLE_VALUE) CloseHandle(dir);
+        if (overlapped.hEvent) CloseHandle(overlapped.hEvent);
+        return;
+    }
+
+    DWORD buffer[1024];
+    DWORD len;
+    while (ReadDirectoryChangesW(dir, buffer, sizeof(buffer), FALSE,
+            FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME, NULL, &overlapped, NULL)) {
+        while (WaitForSingleObject(overlapped.hEvent,
+                   has_unreclaimed_tables(g_engine) ? RECLAIM_INTERVAL_MS : INFINITE) == WAIT_TIMEOUT) {
+            reclaim_remap_tables(g_engine);
+        }
+        if (!GetOverlappedResult(dir, &overlapped, &len, FALSE)) break;
+        int changed = 0;
+        FILE_NOTIFY_INFORMATION * info = (FILE_NOTIFY_INFORMATION *)buffer;
+        while (len) {
+            changed |= info->FileNameLength == wcslen(L"config.txt") * sizeof(wchar_t) &&
+                _wcsnicmp(info->FileName, L"config.txt", wcslen(L"config.txt")) == 0;
+            if (!info->NextEntryOffset) break;
+            info = (FILE_NOTIFY_INFORMATION *)((char *)info + info->NextEntryOffset);
+        }
+        if (!changed) continue;
+        // Editors often write in several steps; let them finish
+        Sleep(50);
+        load_config_file(config_path, reload_config_buffer);
+    }
+    CloseHandle(overlapped.hEvent);
+    CloseHandle(dir);
+}
+
+void write_stats_file()
+{
+    FILE * file;
+    wchar_t stats_path[MAX_PATH];
+    put_app_file_path(stats_path, L"stats.txt");
+    if (_wfopen_s(&file, stats_path, L"w") > 0) return;
+    dump_stats(g_engine, file);
+    fclose(file);
+}
+
+// Pages of a file mapping are written back by the system even if we crash,
+// so the recording in flight.rec outlives us. A file of the wrong size is
+// started over.
+/* @return error */
+int map_flight_file(struct FlightRecorder * recorder, wchar_t * path)
+{
+    HANDLE file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size)) {
+        printf("Cannot open flight recording '%ws'.\n", path);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        return 1;
+    }
+    if (size.QuadPart != FLIGHT_FILE_SIZE) {
+        // Truncating first zeroes it
+        SetFilePointer(file, 0, NULL, FILE_BEGIN);
+        SetEndOfFile(file);
+    }
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READWRITE, 0, FLIGHT_FILE_SIZE, NULL);
+    void * memory = mapping ? MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, FLIGHT_FILE_SIZE) : NULL;
+    // The view keeps both alive
+    if (mapping) CloseHandle(mapping);
+    CloseHandle(file);
+    if (!memory) {
+        printf("Cannot map flight recording '%ws'.\n", path);
+        return 1;
+    }
+    init_flight_recorder(recorder, memory);
+    return 0;
+}
+
+void write_flight_file()
+{
+    FILE * file;
+    wchar_t flight_path[MAX_PATH];
+    put_app_file_path(flight_path, L"flight.txt");
+    if (_wfopen_s(&file, flight_path, L"w") > 0) return;
+    print_flight_log(g_recorder.header, file);
+    fclose(file);
 }
 
 
@@ -141,27 +302,66 @@ int main()
         goto end;
     }
 
+    init_keys();
+#ifdef BAKED_CONFIG
+    init_engine(&g_baked_engine, &g_baked_table, send_input_batch, NULL);
+    g_engine = &g_baked_engine;
+#else
+    g_engine = new_engine(send_input_batch, NULL);
     wchar_t config_path[MAX_PATH];
     put_config_path(config_path);
-    int err = load_config_file(config_path);
+    int err = load_config_file(config_path, load_config_buffer);
     if (err) {
         goto end;
     }
+#endif
 
-    g_debug = g_debug || getenv("DEBUG") != NULL;
+    g_engine->debug = g_engine->debug || getenv("DEBUG") != NULL;
+    wchar_t flight_path[MAX_PATH];
+    put_app_file_path(flight_path, L"flight.rec");
+    if (!map_flight_file(&g_recorder, flight_path)) {
+        g_engine->recorder = &g_recorder;
+    }
+    if (g_engine->debug) {
+        // Record raw inputs so the session can be replayed (see replay.c).
+        // The log thread writes them, the hooks only queue them.
+        wchar_t trace_path[MAX_PATH];
+        put_app_file_path(trace_path, L"trace.txt");
+        if (_wfopen_s(&g_engine->trace_file, trace_path, L"w") > 0) {
+            g_engine->trace_file = NULL;
+        }
+    }
     g_mouse_hook = SetWindowsHookEx(WH_MOUSE_LL, mouse_callback, NULL, 0);
     g_keyboard_hook = SetWindowsHookEx(WH_KEYBOARD_LL, keyboard_callback, NULL, 0);
 
+#ifndef BAKED_CONFIG
+    // Edits to the config apply live
+    Thread config_watch;
+    start_thread(&config_watch, config_watch_main, config_path);
+#endif
+
     // We're all good if we got this far. Hide the console window unless we're debugging.
-    if (g_debug) {
+    if (g_engine->debug) {
         printf("-- DEBUG MODE --\n");
+        start_log_thread(g_engine);
     } else {
         destroy_console();
     }
 
+    RegisterHotKey(NULL, STATS_HOTKEY_ID, MOD_CONTROL | MOD_ALT | MOD_SHIFT | MOD_NOREPEAT, VK_F12);
+
     MSG msg;
     while (GetMessage(&msg, NULL, 0, 0) > 0)
     {
+        if (msg.message == WM_TIMER && msg.wParam == g_engine_timer) {
+            run_engine_timers();
+            continue;
+        }
+        if (msg.message == WM_HOTKEY && msg.wParam == STATS_HOTKEY_ID) {
+            write_stats_file();
+            if (g_engine->recorder) write_flight_file();
+            if (g_engine->debug) dump_stats(g_engine, stdout);
+        }
         TranslateMessage(&msg);
         DispatchMessage(&msg);
     }
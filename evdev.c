@@ -0,0 +1,1209 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include "input.h"
+#include "keys.c"
+#include "remap.c"
+
+#ifndef EVDEV_C
+#define EVDEV_C
+
+// Linux backend
+// --------------------------------------
+
+// The Linux counterpart of the hooks in dual-key-remap.c. A keyboard is
+// grabbed through evdev so nobody else sees its events, every event is fed to
+// handle_input and whatever should reach applications is written to a uinput
+// device. Both ends are plain file descriptors: when they turn out not to be
+// devices (a pipe, a socketpair or a file) the ioctls are skipped, which is
+// how the backend is tested without hardware.
+
+// Linux keycodes mapped onto the scan and virtual codes used by the engine,
+// covering every key in key_table. Keys not listed are still passed through,
+// they are just never remapped.
+struct EvdevKey
+{
+    int code;
+    int scan_code;
+    int virt_code;
+};
+
+struct EvdevKey evdev_key_table[] = {
+    {KEY_LEFTCTRL, SK_LEFT_CTRL, VK_LEFT_CTRL},
+    {KEY_RIGHTCTRL, SK_RIGHT_CTRL, VK_RIGHT_CTRL},
+    {KEY_LEFTSHIFT, SK_LEFT_SHIFT, VK_LEFT_SHIFT},
+    {KEY_RIGHTSHIFT, SK_RIGHT_SHIFT, VK_RIGHT_SHIFT},
+    {KEY_LEFTALT, SK_LEFT_ALT, VK_LEFT_ALT},
+    {KEY_RIGHTALT, SK_RIGHT_ALT, VK_RIGHT_ALT},
+    {KEY_LEFTMETA, SK_LEFT_WIN, VK_LEFT_WIN},
+    {KEY_RIGHTMETA, SK_RIGHT_WIN, VK_RIGHT_WIN},
+
+    {KEY_BACKSPACE, SK_BACKSPACE, VK_BACKSPACE},
+    {KEY_CAPSLOCK, SK_CAPSLOCK, VK_CAPSLOCK},
+    {KEY_ENTER, SK_ENTER, VK_ENTER},
+    {KEY_ESC, SK_ESCAPE, VK_ESCAPE},
+    {KEY_SPACE, SK_SPACE, VK_SPACE},
+    {KEY_TAB, SK_TAB, VK_TAB},
+
+    {KEY_UP, SK_UP, VK_UP},
+    {KEY_LEFT, SK_LEFT, VK_LEFT},
+    {KEY_RIGHT, SK_RIGHT, VK_RIGHT},
+    {KEY_DOWN, SK_DOWN, VK_DOWN},
+
+    {KEY_F1, SK_F1, VK_F1},
+    {KEY_F2, SK_F2, VK_F2},
+    {KEY_F3, SK_F3, VK_F3},
+    {KEY_F4, SK_F4, VK_F4},
+    {KEY_F5, SK_F5, VK_F5},
+    {KEY_F6, SK_F6, VK_F6},
+    {KEY_F7, SK_F7, VK_F7},
+    {KEY_F8, SK_F8, VK_F8},
+    {KEY_F9, SK_F9, VK_F9},
+    {KEY_F10, SK_F10, VK_F10},
+    {KEY_F11, SK_F11, VK_F11},
+    {KEY_F12, SK_F12, VK_F12},
+
+    {KEY_0, SK_KEY_0, VK_KEY_0},
+    {KEY_1, SK_KEY_1, VK_KEY_1},
+    {KEY_2, SK_KEY_2, VK_KEY_2},
+    {KEY_3, SK_KEY_3, VK_KEY_3},
+    {KEY_4, SK_KEY_4, VK_KEY_4},
+    {KEY_5, SK_KEY_5, VK_KEY_5},
+    {KEY_6, SK_KEY_6, VK_KEY_6},
+    {KEY_7, SK_KEY_7, VK_KEY_7},
+    {KEY_8, SK_KEY_8, VK_KEY_8},
+    {KEY_9, SK_KEY_9, VK_KEY_9},
+
+    {KEY_A, SK_KEY_A, VK_KEY_A},
+    {KEY_B, SK_KEY_B, VK_KEY_B},
+    {KEY_C, SK_KEY_C, VK_KEY_C},
+    {KEY_D, SK_KEY_D, VK_KEY_D},
+    {KEY_E, SK_KEY_E, VK_KEY_E},
+    {KEY_F, SK_KEY_F, VK_KEY_F},
+    {KEY_G, SK_KEY_G, VK_KEY_G},
+    {KEY_H, SK_KEY_H, VK_KEY_H},
+    {KEY_I, SK_KEY_I, VK_KEY_I},
+    {KEY_J, SK_KEY_J, VK_KEY_J},
+    {KEY_K, SK_KEY_K, VK_KEY_K},
+    {KEY_L, SK_KEY_L, VK_KEY_L},
+    {KEY_M, SK_KEY_M, VK_KEY_M},
+    {KEY_N, SK_KEY_N, VK_KEY_N},
+    {KEY_O, SK_KEY_O, VK_KEY_O},
+    {KEY_P, SK_KEY_P, VK_KEY_P},
+    {KEY_Q, SK_KEY_Q, VK_KEY_Q},
+    {KEY_R, SK_KEY_R, VK_KEY_R},
+    {KEY_S, SK_KEY_S, VK_KEY_S},
+    {KEY_T, SK_KEY_T, VK_KEY_T},
+    {KEY_U, SK_KEY_U, VK_KEY_U},
+    {KEY_V, SK_KEY_V, VK_KEY_V},
+    {KEY_W, SK_KEY_W, VK_KEY_W},
+    {KEY_X, SK_KEY_X, VK_KEY_X},
+    {KEY_Y, SK_KEY_Y, VK_KEY_Y},
+    {KEY_Z, SK_KEY_Z, VK_KEY_Z},
+
+    {KEY_INSERT, SK_INSERT, VK_INSERT},
+    {KEY_DELETE, SK_DELETE, VK_DELETE},
+    {KEY_HOME, SK_HOME, VK_HOME},
+    {KEY_END, SK_END, VK_END},
+    {KEY_PAGEUP, SK_PAGE_UP, VK_PAGE_UP},
+    {KEY_PAGEDOWN, SK_PAGE_DOWN, VK_PAGE_DOWN},
+
+    {KEY_SYSRQ, 0, VK_PRINT_SCREEN},
+    {KEY_NUMLOCK, 0, VK_NUMLOCK},
+    {KEY_SCROLLLOCK, 0, VK_SCROLLLOCK},
+    {KEY_PAUSE, 0, VK_PAUSE},
+
+    {KEY_EQUAL, SK_PLUS, VK_PLUS},
+    {KEY_COMMA, SK_COMMA, VK_COMMA},
+    {KEY_MINUS, SK_MINUS, VK_MINUS},
+    {KEY_DOT, SK_PERIOD, VK_PERIOD},
+
+    {KEY_SEMICOLON, SK_US_SEMI, VK_US_SEMI},
+    {KEY_SLASH, SK_US_SLASH, VK_US_SLASH},
+    {KEY_GRAVE, SK_US_TILDE, VK_US_TILDE},
+};
+
+#define EVDEV_KEY_TABLE_LEN (sizeof(evdev_key_table) / sizeof(struct EvdevKey))
+
+// Direct lookups in both directions, built once by init_evdev_keys
+struct EvdevKey * g_evdev_key_by_code[KEY_MAX + 1];
+int g_evdev_code_by_virt_code[VIRT_CODE_INDEX_LEN];
+
+void init_evdev_keys()
+{
+    for (int i = EVDEV_KEY_TABLE_LEN - 1; i >= 0; i--) {
+        struct EvdevKey * key = &evdev_key_table[i];
+        g_evdev_key_by_code[key->code] = key;
+        g_evdev_code_by_virt_code[key->virt_code] = key->code;
+    }
+}
+
+// Output
+// --------------------------------------
+
+// Everything written in response to one read from a device is collected here
+// and handed to the sink with a single write(). Each engine has its own,
+// reached through the engine's context. Engines running on their own thread
+// (see Sharding) hand it to the output queue instead of writing it themselves.
+
+#define EVDEV_OUTPUT_LEN 512
+
+struct OutputQueue;
+void push_output_frame(struct OutputQueue * queue, struct input_event * events, int count);
+
+struct EvdevOutput
+{
+    int fd; // Unused with a queue
+    struct OutputQueue * queue;
+    struct input_event events[EVDEV_OUTPUT_LEN];
+    int count;
+};
+
+// Written to by the engine of the shared loop
+struct EvdevOutput g_evdev_output = {.fd = -1};
+
+/* @return error */
+int write_evdev_events(int fd, struct input_event * events, int count)
+{
+    char * data = (char *)events;
+    size_t len = count * sizeof(struct input_event);
+    while (len) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/* @return error */
+int write_evdev_output(struct EvdevOutput * output)
+{
+    int count = output->count;
+    output->count = 0;
+    if (!count) return 0;
+    if (output->queue) {
+        push_output_frame(output->queue, output->events, count);
+        return 0;
+    }
+    return write_evdev_events(output->fd, output->events, count);
+}
+
+void queue_evdev_event(struct EvdevOutput * output, int type, int code, int value)
+{
+    if (output->count == EVDEV_OUTPUT_LEN) {
+        write_evdev_output(output);
+    }
+    struct input_event * event = &output->events[output->count++];
+    memset(event, 0, sizeof(struct input_event));
+    event->type = type;
+    event->code = code;
+    event->value = value;
+}
+
+// Every key event is reported on its own so that a tap is never collapsed
+void queue_evdev_key(struct EvdevOutput * output, int code, int value)
+{
+    queue_evdev_event(output, EV_KEY, code, value);
+    queue_evdev_event(output, EV_SYN, SYN_REPORT, 0);
+}
+
+// Input
+// --------------------------------------
+
+// The engine's sink. Unlike Windows, our own output never comes back through
+// the grabbed devices (our uinput device is never grabbed, see Devices). Echo
+// it to the engine ourselves so it is accounted for exactly as on Windows.
+void send_evdev_batch(struct Engine * engine, struct InputBatch * batch)
+{
+    for (int i = 0; i < batch->count; i++) {
+        struct InputEvent * event = &batch->events[i];
+        consume_echo(engine, event->seq);
+        int code = event->virt_code < VIRT_CODE_INDEX_LEN
+            ? g_evdev_code_by_virt_code[event->virt_code]
+            : 0;
+        if (code) {
+            queue_evdev_key(engine->context, code, event->direction == DOWN);
+        }
+    }
+}
+
+// The engine only needs its milliseconds to be consistent, so the device
+// clock is used as is
+uint32_t evdev_event_time(struct input_event * event)
+{
+    return (uint32_t)((uint64_t)event->input_event_sec * 1000 + event->input_event_usec / 1000);
+}
+
+int is_mouse_button(int code)
+{
+    return code >= BTN_MOUSE && code <= BTN_TASK;
+}
+
+// Presses and scrolling count as other input while a remapped key is held
+/* @return block_input */
+int handle_evdev_mouse_event(struct Engine * engine, struct input_event * event)
+{
+    int is_press = event->type == EV_KEY && event->value == 1;
+    int is_scroll = event->type == EV_REL && (event->code == REL_WHEEL || event->code == REL_HWHEEL);
+    if (!(is_press || is_scroll) || !is_engine_armed(engine)) return 0;
+    int block_input = handle_input(engine, 0, MOUSE_DUMMY_VK, DOWN, evdev_event_time(event));
+    flush_output(engine);
+    return block_input;
+}
+
+void handle_evdev_event(struct Engine * engine, struct input_event * event)
+{
+    struct EvdevOutput * output = engine->context;
+    if (event->type == EV_KEY && !is_mouse_button(event->code)) {
+        // Autorepeat (value 2) reaches the engine as another DOWN, like on Windows
+        enum Direction dir = event->value ? DOWN : UP;
+        struct EvdevKey * key = event->code <= KEY_MAX ? g_evdev_key_by_code[event->code] : NULL;
+        int block_input = handle_input(engine, key ? key->scan_code : 0, key ? key->virt_code : 0, dir,
+            evdev_event_time(event));
+        flush_output(engine);
+        if (!block_input) {
+            queue_evdev_key(output, event->code, event->value);
+        }
+        return;
+    }
+
+    // Devices report their own SYN_REPORTs and MSC_SCANs, we send ours
+    if (event->type == EV_SYN || event->type == EV_MSC) {
+        return;
+    }
+
+    // Mouse input is passed through
+    if (!handle_evdev_mouse_event(engine, event)) {
+        queue_evdev_event(output, event->type, event->code, event->value);
+        queue_evdev_event(output, EV_SYN, SYN_REPORT, 0);
+    }
+}
+
+// Pointers are read but never grabbed (see Devices), their input reaches
+// applications without us and can't be blocked
+void handle_evdev_pointer_event(struct Engine * engine, struct input_event * event)
+{
+    if ((event->type == EV_KEY && is_mouse_button(event->code)) || event->type == EV_REL) {
+        handle_evdev_mouse_event(engine, event);
+    }
+}
+
+#define EVDEV_READ_LEN 64
+
+/* @return number of events read, 0 at end of input and -1 on error */
+int read_evdev_events(int fd, struct input_event * events)
+{
+    ssize_t len;
+    do {
+        len = read(fd, events, EVDEV_READ_LEN * sizeof(struct input_event));
+    } while (len < 0 && errno == EINTR);
+    if (len <= 0) return len;
+    return len / sizeof(struct input_event);
+}
+
+/* @return number of events handled, 0 at end of input and -1 on error */
+int process_evdev_input(struct Engine * engine, int fd)
+{
+    struct input_event events[EVDEV_READ_LEN];
+    int count = read_evdev_events(fd, events);
+    if (count <= 0) return count;
+    for (int i = 0; i < count; i++) {
+        handle_evdev_event(engine, &events[i]);
+    }
+    if (write_evdev_output(engine->context)) return -1;
+    return count;
+}
+
+/* @return number of events handled, 0 at end of input and -1 on error */
+int process_evdev_pointer_input(struct Engine * engine, int fd)
+{
+    struct input_event events[EVDEV_READ_LEN];
+    int count = read_evdev_events(fd, events);
+    if (count <= 0) return count;
+    for (int i = 0; i < count; i++) {
+        handle_evdev_pointer_event(engine, &events[i]);
+    }
+    if (write_evdev_output(engine->context)) return -1;
+    return count;
+}
+
+// Devices
+// --------------------------------------
+
+/* @return error */
+int grab_evdev_device(int fd)
+{
+    if (ioctl(fd, EVIOCGRAB, 1) < 0 && errno != ENOTTY && errno != EINVAL) {
+        fprintf(stderr, "Cannot grab input device: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/* @return error */
+int create_uinput_device(int fd)
+{
+    if (ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0) {
+        // Not a uinput device, events are written as is
+        if (errno == ENOTTY || errno == EINVAL) return 0;
+        fprintf(stderr, "Cannot set up output device: %s\n", strerror(errno));
+        return 1;
+    }
+    ioctl(fd, UI_SET_EVBIT, EV_SYN);
+    ioctl(fd, UI_SET_EVBIT, EV_REL);
+    for (int code = 1; code <= KEY_MAX; code++) {
+        ioctl(fd, UI_SET_KEYBIT, code);
+    }
+    int rel_codes[] = {REL_X, REL_Y, REL_WHEEL, REL_HWHEEL};
+    for (int i = 0; i < 4; i++) {
+        ioctl(fd, UI_SET_RELBIT, rel_codes[i]);
+    }
+
+    struct uinput_setup setup = {0};
+    setup.id.bustype = BUS_VIRTUAL;
+    snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "dual-key-remap");
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+        fprintf(stderr, "Cannot create output device: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+#define UINPUT_DEVICE_NAME "dual-key-remap"
+
+int has_evdev_bit(unsigned long * bits, int code)
+{
+    int bits_per_long = 8 * sizeof(long);
+    return (bits[code / bits_per_long] >> (code % bits_per_long)) & 1;
+}
+
+int is_own_device(int fd)
+{
+    char name[256] = "";
+    ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+    return strcmp(name, UINPUT_DEVICE_NAME) == 0;
+}
+
+// Only keyboards are worth grabbing, and never our own uinput device. Things
+// that aren't input devices at all (pipes in tests) are taken as they are.
+int is_remappable_device(int fd)
+{
+    unsigned long key_bits[KEY_MAX / (8 * sizeof(long)) + 1] = {0};
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits) < 0) {
+        return errno == ENOTTY || errno == EINVAL;
+    }
+    if (is_own_device(fd)) return 0;
+    return has_evdev_bit(key_bits, KEY_A) && has_evdev_bit(key_bits, KEY_SPACE);
+}
+
+// Mice and touchpads are read for clicks and scrolling, never grabbed
+int is_pointer_device(int fd)
+{
+    unsigned long ev_bits[EV_MAX / (8 * sizeof(long)) + 1] = {0};
+    unsigned long key_bits[KEY_MAX / (8 * sizeof(long)) + 1] = {0};
+    if (ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits) < 0 ||
+        ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits) < 0) {
+        return 0;
+    }
+    if (is_own_device(fd)) return 0;
+    return has_evdev_bit(ev_bits, EV_REL) && has_evdev_bit(key_bits, BTN_LEFT);
+}
+
+// Event loop
+// --------------------------------------
+
+// A single epoll set multiplexes every grabbed device together with a timerfd
+// for time based engine events and, optionally, an inotify watch on a
+// directory of devices (/dev/input) so keyboards can come and go. The loop
+// only ever sleeps in epoll_wait: an idle remapper uses no CPU and an input
+// is written out in the same wakeup it was read in.
+//
+// Pointers are in the same set but never grabbed, their input reaches
+// applications on its own and only tells the engine a click or scroll
+// happened. Unlike the Windows mouse hook we can't hold a click back, so it
+// may reach applications just before the modifier it comes with.
+
+#define EVDEV_MAX_DEVICES 32
+#define EVDEV_MAX_EPOLL_EVENTS 16
+
+struct EvdevShards;
+
+struct EvdevLoop
+{
+    struct Engine * engine; // Shared by all devices, so a held key applies to every keyboard
+    struct EvdevShards * shards; // Instead of the engine, hands every device its own, see Sharding
+    int epoll_fd;
+    int timer_fd;
+    int inotify_fd; // -1 unless watching a directory
+    char * watch_dir;
+    int device_fds[EVDEV_MAX_DEVICES];
+    int device_count;
+    int pointer_fds[EVDEV_MAX_DEVICES]; // Read but not grabbed, they don't keep the loop running
+    int pointer_count;
+    int has_engine_deadline;
+    uint32_t engine_deadline; // On the engine's clock
+    void (*on_timer)(); // Called when the timer armed by arm_evdev_timer expires
+};
+
+int start_evdev_shard(struct EvdevShards * shards, int fd);
+int is_evdev_reap_fd(struct EvdevShards * shards, int fd);
+int forward_evdev_pointer_input(struct EvdevShards * shards, int fd);
+void reap_evdev_shards(struct EvdevShards * shards, struct EvdevLoop * loop);
+
+int epoll_add_fd(struct EvdevLoop * loop, int fd)
+{
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/* @return error */
+int init_evdev_loop(struct EvdevLoop * loop, struct Engine * engine)
+{
+    memset(loop, 0, sizeof(struct EvdevLoop));
+    loop->engine = engine;
+    loop->inotify_fd = -1;
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->epoll_fd < 0 || loop->timer_fd < 0 || epoll_add_fd(loop, loop->timer_fd)) {
+        fprintf(stderr, "Cannot set up event loop: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/* @return error */
+int add_evdev_device(struct EvdevLoop * loop, int fd)
+{
+    if (loop->device_count == EVDEV_MAX_DEVICES) {
+        fprintf(stderr, "Too many input devices, ignoring one.\n");
+        return 1;
+    }
+    if (grab_evdev_device(fd)) return 1;
+    if (loop->shards ? start_evdev_shard(loop->shards, fd) : epoll_add_fd(loop, fd)) {
+        return 1;
+    }
+    loop->device_fds[loop->device_count++] = fd;
+    return 0;
+}
+
+/* @return error */
+int add_evdev_pointer(struct EvdevLoop * loop, int fd)
+{
+    if (loop->pointer_count == EVDEV_MAX_DEVICES) {
+        fprintf(stderr, "Too many pointer devices, ignoring one.\n");
+        return 1;
+    }
+    if (epoll_add_fd(loop, fd)) return 1;
+    loop->pointer_fds[loop->pointer_count++] = fd;
+    return 0;
+}
+
+int is_evdev_pointer(struct EvdevLoop * loop, int fd)
+{
+    for (int i = 0; i < loop->pointer_count; i++) {
+        if (loop->pointer_fds[i] == fd) return 1;
+    }
+    return 0;
+}
+
+void remove_fd(int * fds, int * count, int fd)
+{
+    for (int i = 0; i < *count; i++) {
+        if (fds[i] == fd) {
+            fds[i] = fds[--*count];
+            break;
+        }
+    }
+}
+
+// Removes a keyboard or a pointer
+void remove_evdev_device(struct EvdevLoop * loop, int fd)
+{
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    remove_fd(loop->device_fds, &loop->device_count, fd);
+    remove_fd(loop->pointer_fds, &loop->pointer_count, fd);
+}
+
+/* @return error */
+int open_evdev_device(struct EvdevLoop * loop, char * path)
+{
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return 1;
+    int error = is_remappable_device(fd) ? add_evdev_device(loop, fd) :
+        is_pointer_device(fd) ? add_evdev_pointer(loop, fd) : 1;
+    if (error) close(fd);
+    return error;
+}
+
+int is_event_device_name(char * name)
+{
+    return strncmp(name, "event", 5) == 0;
+}
+
+// Grab every keyboard already in dir, read every pointer and watch it for new ones
+/* @return error */
+int watch_evdev_dir(struct EvdevLoop * loop, char * dir)
+{
+    loop->watch_dir = dir;
+    loop->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    // Device nodes show up before udev fixes up their permissions, so also
+    // retry on attribute changes
+    if (loop->inotify_fd < 0 ||
+        inotify_add_watch(loop->inotify_fd, dir, IN_CREATE | IN_ATTRIB) < 0 ||
+        epoll_add_fd(loop, loop->inotify_fd)) {
+        fprintf(stderr, "Cannot watch '%s': %s\n", dir, strerror(errno));
+        return 1;
+    }
+
+    char path[PATH_MAX];
+    for (int i = 0; i < 1024; i++) {
+        snprintf(path, sizeof(path), "%s/event%d", dir, i);
+        open_evdev_device(loop, path);
+    }
+    return 0;
+}
+
+int has_same_file(int * fds, int count, struct stat * info)
+{
+    for (int i = 0; i < count; i++) {
+        struct stat fd_info;
+        if (fstat(fds[i], &fd_info) == 0 && fd_info.st_dev == info->st_dev && fd_info.st_ino == info->st_ino) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int has_evdev_device(struct EvdevLoop * loop, char * path)
+{
+    struct stat info;
+    if (stat(path, &info) < 0) return 0;
+    return has_same_file(loop->device_fds, loop->device_count, &info) ||
+        has_same_file(loop->pointer_fds, loop->pointer_count, &info);
+}
+
+void handle_evdev_hotplug(struct EvdevLoop * loop)
+{
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(loop->inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char * ptr = buffer; ptr < buffer + len;) {
+            struct inotify_event * event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+            if (!event->len || !is_event_device_name(event->name)) continue;
+
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", loop->watch_dir, event->name);
+            // Permission fix-ups also trigger IN_ATTRIB on devices we already have
+            if (!has_evdev_device(loop, path)) {
+                open_evdev_device(loop, path);
+            }
+        }
+    }
+}
+
+// Sets the timer to fire after the given delay, 0 disarms it
+void arm_evdev_timer(struct EvdevLoop * loop, long long delay_ns)
+{
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = delay_ns / 1000000000LL;
+    spec.it_value.tv_nsec = delay_ns % 1000000000LL;
+    timerfd_settime(loop->timer_fd, 0, &spec, NULL);
+}
+
+// The engine's clock is that of the device timestamps, which need not be
+// ours. So the timer is set to go off as long after the last input as the
+// engine's deadline is, and the engine is told it is that time when it does.
+void schedule_engine_timer(struct EvdevLoop * loop)
+{
+    uint32_t deadline;
+    // The loop handing out shards has no engine of its own
+    if (!loop->engine || !next_timer_deadline(loop->engine, &deadline)) return;
+    if (loop->has_engine_deadline && deadline == loop->engine_deadline) return;
+    int32_t delay_ms = (int32_t)(deadline - loop->engine->now);
+    // A zero delay would disarm the timer
+    arm_evdev_timer(loop, delay_ms > 0 ? delay_ms * 1000000LL : 1);
+    loop->has_engine_deadline = 1;
+    loop->engine_deadline = deadline;
+}
+
+void run_engine_timers(struct EvdevLoop * loop)
+{
+    if (!loop->has_engine_deadline) return;
+    loop->has_engine_deadline = 0;
+    run_timers(loop->engine, loop->engine_deadline);
+    flush_output(loop->engine);
+    write_evdev_output(loop->engine->context);
+}
+
+int is_evdev_loop_active(struct EvdevLoop * loop)
+{
+    return loop->device_count > 0 || loop->inotify_fd >= 0;
+}
+
+// Waits up to timeout_ms (-1 for ever) and handles whatever became ready
+/* @return error */
+int run_evdev_loop_once(struct EvdevLoop * loop, int timeout_ms)
+{
+    struct epoll_event events[EVDEV_MAX_EPOLL_EVENTS];
+    int count = epoll_wait(loop->epoll_fd, events, EVDEV_MAX_EPOLL_EVENTS, timeout_ms);
+    if (count < 0) {
+        return errno != EINTR;
+    }
+    for (int i = 0; i < count; i++) {
+        int fd = events[i].data.fd;
+        if (fd == loop->timer_fd) {
+            uint64_t expirations;
+            if (read(fd, &expirations, sizeof(expirations)) > 0) {
+                run_engine_timers(loop);
+                if (loop->on_timer) loop->on_timer();
+            }
+        } else if (fd == loop->inotify_fd) {
+            handle_evdev_hotplug(loop);
+        } else if (loop->shards && is_evdev_reap_fd(loop->shards, fd)) {
+            uint64_t wakeups;
+            read(fd, &wakeups, sizeof(wakeups));
+            reap_evdev_shards(loop->shards, loop);
+        } else if (is_evdev_pointer(loop, fd)) {
+            // The loop handing out shards hands the pointers to every shard
+            int result = loop->shards ? forward_evdev_pointer_input(loop->shards, fd) :
+                process_evdev_pointer_input(loop->engine, fd);
+            if (result == 0 || (result < 0 && errno != EAGAIN)) {
+                remove_evdev_device(loop, fd);
+            }
+        } else {
+            int result = process_evdev_input(loop->engine, fd);
+            // A device that was unplugged reports ENODEV, a closed pipe EOF
+            if (result == 0 || (result < 0 && errno != EAGAIN)) {
+                remove_evdev_device(loop, fd);
+            }
+        }
+    }
+    schedule_engine_timer(loop);
+    return 0;
+}
+
+/* @return error */
+int run_evdev_loop(struct EvdevLoop * loop)
+{
+    while (is_evdev_loop_active(loop)) {
+        if (run_evdev_loop_once(loop, -1)) return 1;
+    }
+    return 0;
+}
+
+// Flight recorder file
+// --------------------------------------
+
+// A shared mapping is written back by the kernel whatever becomes of us, so
+// the recording outlives a crash. A file of the wrong size is started over.
+/* @return error */
+int map_flight_file(struct FlightRecorder * recorder, char * path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        fprintf(stderr, "Cannot open flight recording '%s': %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    if (info.st_size != FLIGHT_FILE_SIZE && (ftruncate(fd, 0) < 0 || ftruncate(fd, FLIGHT_FILE_SIZE) < 0)) {
+        fprintf(stderr, "Cannot size flight recording '%s': %s\n", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    void * memory = mmap(NULL, FLIGHT_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "Cannot map flight recording '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    init_flight_recorder(recorder, memory);
+    return 0;
+}
+
+void unmap_flight_file(struct FlightRecorder * recorder)
+{
+    munmap(recorder->header, FLIGHT_FILE_SIZE);
+}
+
+// Config files
+// --------------------------------------
+
+// The config is parsed straight out of a private mapping of the file
+/* @return error */
+int load_config_file(struct Engine * engine, char * path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        fprintf(stderr, "Cannot open configuration file '%s'.\n", path);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    void * data = MAP_FAILED;
+    if (S_ISREG(info.st_mode) && info.st_size > 0) {
+        data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (data == MAP_FAILED) {
+        // Empty files can't be mapped and pipes aren't regular files
+        FILE * file = fdopen(fd, "r");
+        int err = load_config_stream(engine, file, load_config_buffer);
+        fclose(file);
+        return err;
+    }
+    int err = load_config_buffer(engine, data, info.st_size);
+    munmap(data, info.st_size);
+    close(fd);
+    return err;
+}
+
+// Reloads the config whenever it changes. The directory is watched rather
+// than the file since editors tend to save by replacing it. Parsing happens
+// on the watch thread, the engine picks up the result on its next input.
+// The watch thread also frees the tables the engine is done with, see
+// Reloading in remap.c.
+
+struct ConfigWatch
+{
+    struct Engine * engine;
+    char path[PATH_MAX];
+    char * name; // Points into path
+    int inotify_fd;
+    int stop_pipe[2];
+    Thread thread;
+    volatile long reloads; // Successful reloads, for the curious
+};
+
+int is_config_change(struct ConfigWatch * watch)
+{
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t len;
+    while ((len = read(watch->inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char * ptr = buffer; ptr < buffer + len;) {
+            struct inotify_event * event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+            changed |= event->len && strcmp(event->name, watch->name) == 0;
+        }
+    }
+    return changed;
+}
+
+// Read rather than mapped: an editor truncating the file while we parse it
+// would fault a mapping
+void reload_config_file(struct ConfigWatch * watch)
+{
+    FILE * file = fopen(watch->path, "r");
+    if (!file) return; // Mid-rename, the next event brings it back
+    if (load_config_stream(watch->engine, file, reload_config_buffer) == 0) {
+        atomic_store_release(&watch->reloads, watch->reloads + 1);
+    }
+    fclose(file);
+}
+
+void config_watch_main(void * arg)
+{
+    struct ConfigWatch * watch = arg;
+    struct pollfd fds[2] = {{.fd = watch->inotify_fd, .events = POLLIN}, {.fd = watch->stop_pipe[0], .events = POLLIN}};
+    while (1) {
+        int timeout_ms = has_unreclaimed_tables(watch->engine) ? RECLAIM_INTERVAL_MS : -1;
+        if (poll(fds, 2, timeout_ms) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents) break;
+        reclaim_remap_tables(watch->engine);
+        if ((fds[0].revents & POLLIN) && is_config_change(watch)) {
+            reload_config_file(watch);
+        }
+    }
+}
+
+/* @return error */
+int start_config_watch(struct ConfigWatch * watch, struct Engine * engine, char * path)
+{
+    memset(watch, 0, sizeof(struct ConfigWatch));
+    watch->engine = engine;
+    snprintf(watch->path, sizeof(watch->path), "%s", path);
+
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char * slash = strrchr(dir, '/');
+    if (slash) {
+        watch->name = watch->path + (slash - dir) + 1;
+        if (slash == dir) slash++; // Keep the root
+        *slash = '\0';
+    } else {
+        snprintf(dir, sizeof(dir), ".");
+        watch->name = watch->path;
+    }
+
+    watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->inotify_fd < 0 ||
+        inotify_add_watch(watch->inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+        pipe(watch->stop_pipe) < 0 ||
+        start_thread(&watch->thread, config_watch_main, watch)) {
+        fprintf(stderr, "Cannot watch '%s' for changes: %s\n", path, strerror(errno));
+        if (watch->inotify_fd >= 0) close(watch->inotify_fd);
+        return 1;
+    }
+    return 0;
+}
+
+void stop_config_watch(struct ConfigWatch * watch)
+{
+    char stop = 0;
+    write(watch->stop_pipe[1], &stop, 1);
+    join_thread(watch->thread);
+    close(watch->inotify_fd);
+    close(watch->stop_pipe[0]);
+    close(watch->stop_pipe[1]);
+}
+
+// Output queue
+// --------------------------------------
+
+// Shards (see below) share the uinput device through a single writer thread.
+// The queue is a bounded ring of frames, a frame being everything one engine
+// wrote in response to one read, so the output of two devices never ends up
+// interleaved within a frame. Producers claim a slot with a compare-and-swap
+// on the tail and publish it through the slot's sequence number, the writer
+// takes slots in order. Nobody waits for a lock: a producer only yields while
+// the ring is full and the writer only sleeps on an eventfd while it's empty.
+
+#define OUTPUT_QUEUE_LEN 32 // A power of two
+
+struct OutputFrame
+{
+    volatile long seq; // Claimable at the slot's turn, published at turn + 1
+    int count;
+    struct input_event events[EVDEV_OUTPUT_LEN];
+};
+
+struct OutputQueue
+{
+    CACHE_ALIGNED volatile long tail; // Next turn to claim, shared by the producers
+    CACHE_ALIGNED long head; // Next turn to write, the writer's own
+    struct OutputFrame * frames;
+    int fd;
+    int wake_fd;
+    volatile long stop;
+    Thread writer;
+};
+
+void push_output_frame(struct OutputQueue * queue, struct input_event * events, int count)
+{
+    struct OutputFrame * frame;
+    long turn = atomic_load_acquire(&queue->tail);
+    while (1) {
+        frame = &queue->frames[turn & (OUTPUT_QUEUE_LEN - 1)];
+        long lag = atomic_load_acquire(&frame->seq) - turn;
+        if (lag == 0 && atomic_compare_exchange(&queue->tail, turn, turn + 1)) break;
+        // The slot still holds a frame from a lap ago: full
+        if (lag < 0) sched_yield();
+        turn = atomic_load_acquire(&queue->tail);
+    }
+    frame->count = count;
+    memcpy(frame->events, events, count * sizeof(struct input_event));
+    atomic_store_release(&frame->seq, turn + 1);
+    uint64_t wakeup = 1;
+    write(queue->wake_fd, &wakeup, sizeof(wakeup));
+}
+
+void output_writer_main(void * arg)
+{
+    struct OutputQueue * queue = arg;
+    while (1) {
+        struct OutputFrame * frame = &queue->frames[queue->head & (OUTPUT_QUEUE_LEN - 1)];
+        if (atomic_load_acquire(&frame->seq) == queue->head + 1) {
+            // A failed write loses the frame, there is nobody to tell
+            write_evdev_events(queue->fd, frame->events, frame->count);
+            atomic_store_release(&frame->seq, queue->head + OUTPUT_QUEUE_LEN);
+            queue->head++;
+        } else if (atomic_load_acquire(&queue->stop)) {
+            break;
+        } else {
+            // Every push after our check has bumped the counter, so this
+            // returns straight away if one came in meanwhile
+            uint64_t wakeups;
+            read(queue->wake_fd, &wakeups, sizeof(wakeups));
+        }
+    }
+}
+
+/* @return error */
+int start_output_queue(struct OutputQueue * queue, int fd)
+{
+    memset(queue, 0, sizeof(struct OutputQueue));
+    queue->fd = fd;
+    queue->frames = malloc(OUTPUT_QUEUE_LEN * sizeof(struct OutputFrame));
+    for (int i = 0; i < OUTPUT_QUEUE_LEN; i++) {
+        queue->frames[i].seq = i;
+    }
+    queue->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (queue->wake_fd < 0 || start_thread(&queue->writer, output_writer_main, queue)) {
+        fprintf(stderr, "Cannot start output writer: %s\n", strerror(errno));
+        if (queue->wake_fd >= 0) close(queue->wake_fd);
+        free(queue->frames);
+        return 1;
+    }
+    return 0;
+}
+
+// Writes out what is left and stops the writer, nothing may push anymore
+void stop_output_queue(struct OutputQueue * queue)
+{
+    atomic_store_release(&queue->stop, 1);
+    uint64_t wakeup = 1;
+    write(queue->wake_fd, &wakeup, sizeof(wakeup));
+    join_thread(queue->writer);
+    close(queue->wake_fd);
+    free(queue->frames);
+}
+
+// Sharding
+// --------------------------------------
+
+// A shared engine lets a key held on one keyboard apply to every other: hold
+// CapsLock on the laptop and the external keyboard types Ctrl combos. Sharded,
+// the main loop only grabs devices and hands each to a shard of its own, an
+// engine with its own config, flight recording and event loop on its own
+// thread, pinned to a core where there are enough of them. No two shards touch
+// the same state, they only meet in the output queue.
+
+struct EvdevShard
+{
+    struct Engine * engine;
+    struct EvdevOutput output;
+    struct EvdevLoop loop;
+    struct FlightRecorder recorder;
+    struct ConfigWatch watch;
+    int has_watch;
+    int fd; // As grabbed by the main loop, the shard reads a duplicate
+    int pointer_fd; // The main loop forwards pointer input here, see forward_evdev_pointer_input
+    int cpu;
+    Thread thread;
+    volatile long done; // Set once the device is gone
+    struct EvdevShards * shards;
+    struct EvdevShard * next;
+};
+
+struct EvdevShards
+{
+    struct OutputQueue queue;
+    char * config_path; // For the devices added next
+    char * recording_path; // Shard n records to <path>.<n>, NULL for none
+    int debug;
+    int count; // Shards ever started, numbers them
+    struct EvdevShard * list;
+    int reap_fd; // Signalled by shards whose device is gone, see attach_evdev_shards
+};
+
+/* @return error */
+int init_evdev_shards(struct EvdevShards * shards, int output_fd, char * config_path)
+{
+    memset(shards, 0, sizeof(struct EvdevShards));
+    shards->config_path = config_path;
+    shards->reap_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shards->reap_fd < 0) {
+        fprintf(stderr, "Cannot set up input devices: %s\n", strerror(errno));
+        return 1;
+    }
+    if (start_output_queue(&shards->queue, output_fd)) {
+        close(shards->reap_fd);
+        return 1;
+    }
+    return 0;
+}
+
+// Once every shard is gone, see attach_evdev_shards
+void stop_evdev_shards(struct EvdevShards * shards)
+{
+    stop_output_queue(&shards->queue);
+    close(shards->reap_fd);
+}
+
+// Hands the devices the loop adds to shards. The loop lets go of a shard as
+// soon as its device is gone, and ends once every device has.
+/* @return error */
+int attach_evdev_shards(struct EvdevLoop * loop, struct EvdevShards * shards)
+{
+    loop->shards = shards;
+    if (epoll_add_fd(loop, shards->reap_fd)) {
+        fprintf(stderr, "Cannot set up event loop: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+int is_evdev_reap_fd(struct EvdevShards * shards, int fd)
+{
+    return fd == shards->reap_fd;
+}
+
+// Only a hint, a shard that can't be pinned runs wherever it is scheduled.
+// The raw syscall spares us _GNU_SOURCE.
+#define MAX_PINNED_CPU 1024
+
+void pin_to_cpu(int cpu)
+{
+    int bits_per_long = 8 * sizeof(long);
+    unsigned long mask[MAX_PINNED_CPU / (8 * sizeof(long))] = {0};
+    if (cpu >= MAX_PINNED_CPU) return;
+    mask[cpu / bits_per_long] |= 1UL << (cpu % bits_per_long);
+    syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+}
+
+void evdev_shard_main(void * arg)
+{
+    struct EvdevShard * shard = arg;
+    pin_to_cpu(shard->cpu);
+    if (run_evdev_loop(&shard->loop)) {
+        fprintf(stderr, "Event loop error: %s\n", strerror(errno));
+    }
+    atomic_store_release(&shard->done, 1);
+    uint64_t wakeup = 1;
+    write(shard->shards->reap_fd, &wakeup, sizeof(wakeup));
+}
+
+void free_evdev_shard(struct EvdevShard * shard)
+{
+    if (shard->has_watch) stop_config_watch(&shard->watch);
+    for (int i = 0; i < shard->loop.device_count; i++) {
+        close(shard->loop.device_fds[i]);
+    }
+    for (int i = 0; i < shard->loop.pointer_count; i++) {
+        close(shard->loop.pointer_fds[i]);
+    }
+    if (shard->pointer_fd >= 0) close(shard->pointer_fd);
+    if (shard->loop.epoll_fd >= 0) close(shard->loop.epoll_fd);
+    if (shard->loop.timer_fd >= 0) close(shard->loop.timer_fd);
+    if (shard->engine->recorder) unmap_flight_file(&shard->recorder);
+    stop_log_thread(shard->engine);
+    free_engine(shard->engine);
+    free(shard);
+}
+
+// Without _GNU_SOURCE there is no pipe2
+/* @return error */
+int open_pointer_pipe(struct EvdevShard * shard)
+{
+    int fds[2];
+    if (pipe(fds) < 0) return 1;
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[i], F_SETFL, O_NONBLOCK);
+    }
+    shard->pointer_fd = fds[1];
+    if (add_evdev_pointer(&shard->loop, fds[0])) {
+        close(fds[0]);
+        return 1;
+    }
+    return 0;
+}
+
+// Starts a shard for a device that was just grabbed
+/* @return error */
+int start_evdev_shard(struct EvdevShards * shards, int fd)
+{
+    struct EvdevShard * shard = calloc(1, sizeof(struct EvdevShard));
+    shard->fd = fd;
+    shard->shards = shards;
+    shard->output.queue = &shards->queue;
+    shard->engine = new_engine(send_evdev_batch, &shard->output);
+    shard->loop.epoll_fd = shard->loop.timer_fd = shard->pointer_fd = -1;
+    int loop_fd = -1;
+    if (load_config_file(shard->engine, shards->config_path) ||
+        init_evdev_loop(&shard->loop, shard->engine) ||
+        (loop_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0 ||
+        epoll_add_fd(&shard->loop, loop_fd)) {
+        if (loop_fd >= 0) close(loop_fd);
+        free_evdev_shard(shard);
+        return 1;
+    }
+    // Already grabbed, a second grab through the duplicate would fail
+    shard->loop.device_fds[shard->loop.device_count++] = loop_fd;
+    if (open_pointer_pipe(shard)) {
+        fprintf(stderr, "Cannot set up input device: %s\n", strerror(errno));
+        free_evdev_shard(shard);
+        return 1;
+    }
+
+    shard->engine->debug = shard->engine->debug || shards->debug;
+    if (shards->recording_path) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s.%d", shards->recording_path, shards->count);
+        if (!map_flight_file(&shard->recorder, path)) shard->engine->recorder = &shard->recorder;
+    }
+    shard->has_watch = !start_config_watch(&shard->watch, shard->engine, shards->config_path);
+    if (shard->engine->debug) start_log_thread(shard->engine);
+
+    shard->cpu = shards->count % cpu_count();
+    if (start_thread(&shard->thread, evdev_shard_main, shard)) {
+        fprintf(stderr, "Cannot start a thread for input device: %s\n", strerror(errno));
+        free_evdev_shard(shard);
+        return 1;
+    }
+    shard->next = shards->list;
+    shards->list = shard;
+    shards->count++;
+    return 0;
+}
+
+// Every shard counts a click or scroll as other input, as a shared engine
+// would. Each read is forwarded as a whole, a pipe write of that size is
+// atomic, and dropped for a shard too far behind to take it.
+/* @return number of events read, 0 at end of input and -1 on error */
+int forward_evdev_pointer_input(struct EvdevShards * shards, int fd)
+{
+    struct input_event events[EVDEV_READ_LEN];
+    int count = read_evdev_events(fd, events);
+    if (count <= 0) return count;
+    for (struct EvdevShard * shard = shards->list; shard; shard = shard->next) {
+        write(shard->pointer_fd, events, count * sizeof(struct input_event));
+    }
+    return count;
+}
+
+// Lets go of the shards whose device is gone and removes the device from the
+// main loop, called whenever a shard signals the reap_fd
+void reap_evdev_shards(struct EvdevShards * shards, struct EvdevLoop * loop)
+{
+    struct EvdevShard ** link = &shards->list;
+    while (*link) {
+        struct EvdevShard * shard = *link;
+        if (!atomic_load_acquire(&shard->done)) {
+            link = &shard->next;
+            continue;
+        }
+        join_thread(shard->thread);
+        *link = shard->next;
+        remove_evdev_device(loop, shard->fd);
+        free_evdev_shard(shard);
+    }
+}
+
+#endif
@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "input.h"
+#include "keys.c"
+#include "remap.c"
+
+// Prints a flight recording (see recorder.c) in the debug log format, oldest
+// record first. The file can be copied off a machine while dual-key-remap is
+// still running or after it crashed.
+//
+// usage: flight <recording>
+
+int main(int argc, char ** argv)
+{
+    if (argc != 2) {
+        printf("usage: flight <recording>\n");
+        return 2;
+    }
+    FILE * file = fopen(argv[1], "rb");
+    if (!file) {
+        printf("Cannot open flight recording '%s'.\n", argv[1]);
+        return 1;
+    }
+    struct FlightHeader * header = calloc(1, FLIGHT_FILE_SIZE);
+    size_t len = fread(header, 1, FLIGHT_FILE_SIZE, file);
+    fclose(file);
+    if (len != FLIGHT_FILE_SIZE || !is_flight_recording(header)) {
+        printf("'%s' is not a flight recording.\n", argv[1]);
+        return 1;
+    }
+
+    init_keys();
+    print_flight_log(header, stdout);
+    free(header);
+    return 0;
+}
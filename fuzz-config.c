@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "input.h"
+#include "keys.c"
+#include "remap.c"
+#include "fuzz.c"
+
+// Feeds arbitrary bytes to the config parser the three ways configs arrive:
+// a whole unterminated buffer at startup, terminated lines through
+// load_config_line, and a reload that the next input adopts. See fuzz.c for
+// building and running it; seeds are in fuzz/config.
+
+struct Engine * g_engine;
+
+void discard_batch(struct Engine * engine, struct InputBatch * batch)
+{
+    for (int i = 0; i < batch->count; i++) {
+        consume_echo(engine, batch->events[i].seq);
+    }
+}
+
+int LLVMFuzzerInitialize(int * argc, char *** argv)
+{
+    silence_stdout();
+    init_keys();
+    g_engine = new_engine(discard_batch, NULL);
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+    load_config_buffer(g_engine, (const char *)data, size);
+    reset_config(g_engine);
+
+    char * copy = malloc(size + 1);
+    memcpy(copy, data, size);
+    copy[size] = 0;
+    char * line = copy;
+    for (int linenum = 1; line; linenum++) {
+        char * eol = strchr(line, '\n');
+        if (eol) *eol = 0;
+        if (load_config_line(g_engine, line, linenum)) break;
+        line = eol ? eol + 1 : NULL;
+    }
+    free(copy);
+    reset_config(g_engine);
+
+    if (reload_config_buffer(g_engine, (const char *)data, size) == 0) {
+        handle_input(g_engine, 0, 0, DOWN, 0);
+        flush_output(g_engine);
+    }
+    reset_config(g_engine);
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "input.h"
+#include "keys.c"
+#include "remap.c"
+#include "fuzz.c"
+
+// Feeds arbitrary event sequences to handle_input. See fuzz.c for building and
+// running it; seeds are in fuzz/input.
+//
+// An input is a config followed by a 0 byte, then events of three bytes each
+// (a trailing partial event is ignored):
+//
+//   op          bit 0-1: 0 key, 1 mouse, 2 time passes, 3 reload the config
+//               bit 2: DOWN, bit 3: the delay counts in 256 ms steps
+//   virt code   for keys
+//   delay       milliseconds since the previous event
+//
+// An empty config stands for the default one below. Once the events ran out
+// every key still down is released and all timers fire, after which nothing
+// may be held and every key sent DOWN must have been sent UP again.
+
+char * g_default_config =
+    "remap_key=CAPSLOCK\n"
+    "when_alone=ESCAPE\n"
+    "with_other=CTRL\n"
+    "hold_timeout_ms=200\n"
+    "remap_key=TAB\n"
+    "when_alone=TAB\n"
+    "with_other=ALT+RIGHT_CTRL\n"
+    "tap_timeout_ms=300\n"
+    "double_tap=CAPSLOCK\n"
+    "remap_key=LEFT_SHIFT\n"
+    "when_alone=CTRL+KEY_Z, SPACE\n"
+    "with_other=LEFT_SHIFT\n";
+
+enum FuzzOp {
+    FUZZ_KEY,
+    FUZZ_MOUSE,
+    FUZZ_TIME,
+    FUZZ_RELOAD,
+};
+
+struct Engine * g_engine;
+int g_sent_down[VIRT_CODE_INDEX_LEN];
+
+void count_batch(struct Engine * engine, struct InputBatch * batch)
+{
+    for (int i = 0; i < batch->count; i++) {
+        struct InputEvent * event = &batch->events[i];
+        assert(("OWN ECHO", consume_echo(engine, event->seq)));
+        g_sent_down[event->virt_code & 0xFF] += event->direction == DOWN ? 1 : -1;
+    }
+}
+
+void fuzz_key(uint8_t * down, int virt_code, enum Direction dir, uint32_t time)
+{
+    KEY_DEF * key = find_key_def_by_virt_code(virt_code);
+    handle_input(g_engine, key ? key->scan_code : 0, virt_code, dir, time);
+    flush_output(g_engine);
+    down[virt_code] = dir == DOWN;
+}
+
+int LLVMFuzzerInitialize(int * argc, char *** argv)
+{
+    silence_stdout();
+    init_keys();
+    g_engine = new_engine(count_batch, NULL);
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+    const uint8_t * end_of_config = memchr(data, 0, size);
+    if (!end_of_config) return 0;
+    const char * config = (const char *)data;
+    size_t config_len = end_of_config - data;
+    data = end_of_config + 1;
+    size -= config_len + 1;
+    if (!config_len) {
+        config = g_default_config;
+        config_len = strlen(g_default_config);
+    }
+    if (load_config_buffer(g_engine, config, config_len)) {
+        reset_config(g_engine);
+        return 0;
+    }
+    g_engine->debug = 0;
+    memset(g_sent_down, 0, sizeof(g_sent_down));
+
+    uint8_t down[VIRT_CODE_INDEX_LEN] = {0};
+    uint32_t time = 0;
+    for (size_t i = 0; i + 3 <= size; i += 3) {
+        uint8_t op = data[i];
+        time += op & 8 ? data[i + 2] * 256u : data[i + 2];
+        switch (op & 3) {
+        case FUZZ_KEY:
+            fuzz_key(down, data[i + 1], op & 4 ? DOWN : UP, time);
+            break;
+        case FUZZ_MOUSE:
+            // Like the hooks, skip the engine while nothing is held
+            if (is_engine_armed(g_engine)) {
+                handle_input(g_engine, 0, MOUSE_DUMMY_VK, DOWN, time);
+                flush_output(g_engine);
+            }
+            break;
+        case FUZZ_TIME:
+            run_timers(g_engine, time);
+            flush_output(g_engine);
+            break;
+        case FUZZ_RELOAD:
+            reload_config_buffer(g_engine, config, config_len);
+            break;
+        }
+    }
+
+    for (int code = 0; code < VIRT_CODE_INDEX_LEN; code++) {
+        if (down[code]) fuzz_key(down, code, UP, time);
+    }
+    run_timers(g_engine, time + 2 * MAX_CONFIG_TIMEOUT_MS);
+    flush_output(g_engine);
+    assert(("NOTHING HELD", !is_engine_armed(g_engine) && !g_engine->draining));
+    for (int code = 0; code < VIRT_CODE_INDEX_LEN; code++) {
+        assert(("EVERY DOWN SENT UP", g_sent_down[code] == 0));
+    }
+    reset_config(g_engine);
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef FUZZ_C
+#define FUZZ_C
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+// Fuzzing
+// --------------------------------------
+
+// The fuzz targets (fuzz-*.c) only define LLVMFuzzerTestOneInput and
+// LLVMFuzzerInitialize, which makes them build three ways:
+//
+// - with clang and -fsanitize=fuzzer,address,undefined libFuzzer drives them.
+//   A parallel run on every core, starting from the seed corpus:
+//
+//       clang -g -O1 -fsanitize=fuzzer,address,undefined fuzz-input.c -o fuzz-input
+//       ./fuzz-input -fork=$(nproc) fuzz/input
+//
+// - with afl-clang-fast and FUZZ_MAIN the main below reads AFL's test cases in
+//   persistent mode, e.g. `afl-fuzz -i fuzz/input -o findings -- ./fuzz-input`
+//   with one -M and several -S instances for a parallel run.
+//
+// - with any compiler and FUZZ_MAIN the main below runs the files and
+//   directories it is given, which replays a corpus or a crash (this is what
+//   `make fuzz-linux` does with gcc's sanitizers).
+//
+// The targets keep one engine around and reset it after every input, so
+// memory that reset_config doesn't free shows up as a leak.
+
+int LLVMFuzzerInitialize(int * argc, char *** argv);
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size);
+
+// Config errors are printed, which would be most of the time spent fuzzing
+void silence_stdout()
+{
+#ifdef _WIN32
+    freopen("NUL", "w", stdout);
+#else
+    freopen("/dev/null", "w", stdout);
+#endif
+}
+
+#ifdef FUZZ_MAIN
+
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+__AFL_FUZZ_INIT();
+#endif
+
+/* @return error */
+int run_fuzz_file(char * path)
+{
+    FILE * file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Cannot open '%s'.\n", path);
+        return 1;
+    }
+    size_t len = 0;
+    size_t capacity = 4096;
+    uint8_t * data = malloc(capacity);
+    size_t read;
+    while ((read = fread(data + len, 1, capacity - len, file)) > 0) {
+        len += read;
+        if (len == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
+    fclose(file);
+    // Exactly as long as the input, so reads past the end are caught
+    uint8_t * input = malloc(len ? len : 1);
+    memcpy(input, data, len);
+    free(data);
+    LLVMFuzzerTestOneInput(input, len);
+    free(input);
+    return 0;
+}
+
+/* @return number of inputs run, -1 on error */
+int run_fuzz_path(char * path)
+{
+#ifndef _WIN32
+    struct stat info;
+    if (stat(path, &info) == 0 && S_ISDIR(info.st_mode)) {
+        DIR * dir = opendir(path);
+        if (!dir) return -1;
+        int count = 0;
+        struct dirent * entry;
+        while ((entry = readdir(dir))) {
+            if (entry->d_name[0] == '.') continue;
+            char child[4096];
+            snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+            int ran = run_fuzz_path(child);
+            if (ran < 0) {
+                closedir(dir);
+                return -1;
+            }
+            count += ran;
+        }
+        closedir(dir);
+        return count;
+    }
+#endif
+    return run_fuzz_file(path) ? -1 : 1;
+}
+
+int main(int argc, char ** argv)
+{
+    LLVMFuzzerInitialize(&argc, &argv);
+    if (argc == 1) {
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+        unsigned char * data = __AFL_FUZZ_TESTCASE_BUF;
+        while (__AFL_LOOP(100000)) {
+            LLVMFuzzerTestOneInput(data, __AFL_FUZZ_TESTCASE_LEN);
+        }
+        return 0;
+#else
+        fprintf(stderr, "usage: %s <file or directory>...\n", argv[0]);
+        return 2;
+#endif
+    }
+    int count = 0;
+    for (int i = 1; i < argc; i++) {
+        int ran = run_fuzz_path(argv[i]);
+        if (ran < 0) return 1;
+        count += ran;
+    }
+    fprintf(stderr, "Ran %d inputs.\n", count);
+    return 0;
+}
+
+#endif
+
+#endif
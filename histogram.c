@@ -0,0 +1,93 @@
+#include <stdint.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifndef HISTOGRAM_C
+#define HISTOGRAM_C
+
+// Latency histogram
+// --------------------------------------
+
+// A log-linear (HDR style) histogram over unsigned 64 bit values. Values
+// below HISTOGRAM_SUB_BUCKETS are counted exactly. Above that every power of
+// two range is split into HISTOGRAM_SUB_BUCKETS / 2 equal buckets, which keeps
+// the relative error under 1/32 (~3%) with a fixed 15KB footprint. Recording
+// is a bit scan and an increment: no allocation, no locking.
+
+#define HISTOGRAM_SUB_BUCKET_BITS 6
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_HALF_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+#define HISTOGRAM_LEN ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_HALF_BUCKETS + HISTOGRAM_HALF_BUCKETS)
+
+struct Histogram
+{
+    uint64_t counts[HISTOGRAM_LEN];
+    uint64_t total;
+    uint64_t max;
+};
+
+int highest_set_bit(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (int)index;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+int histogram_index(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS) return (int)value;
+    int shift = highest_set_bit(value) - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+    return shift * HISTOGRAM_HALF_BUCKETS + (int)(value >> shift);
+}
+
+uint64_t histogram_bucket_lowest(int index)
+{
+    if (index < HISTOGRAM_SUB_BUCKETS) return index;
+    int shift = index / HISTOGRAM_HALF_BUCKETS - 1;
+    return (uint64_t)(index % HISTOGRAM_HALF_BUCKETS + HISTOGRAM_HALF_BUCKETS) << shift;
+}
+
+uint64_t histogram_bucket_highest(int index)
+{
+    if (index < HISTOGRAM_SUB_BUCKETS) return index;
+    int shift = index / HISTOGRAM_HALF_BUCKETS - 1;
+    return histogram_bucket_lowest(index) + ((uint64_t)1 << shift) - 1;
+}
+
+void histogram_record(struct Histogram * histogram, uint64_t value)
+{
+    histogram->counts[histogram_index(value)]++;
+    histogram->total++;
+    if (value > histogram->max) histogram->max = value;
+}
+
+// The highest value that could be in the bucket holding the given percentile
+// (0-100), never more than the largest value recorded.
+uint64_t histogram_percentile(struct Histogram * histogram, double percentile)
+{
+    if (!histogram->total) return 0;
+    uint64_t rank = (uint64_t)(percentile / 100.0 * histogram->total + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_LEN; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t highest = histogram_bucket_highest(i);
+            return highest < histogram->max ? highest : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void reset_histogram(struct Histogram * histogram)
+{
+    memset(histogram, 0, sizeof(struct Histogram));
+}
+
+#endif
@@ -6,6 +6,32 @@ enum Direction {
     DOWN,
 };
 
-void send_input(int scan_code, int virt_code, enum Direction direction);
+// Outputs are numbered so that their echoes can be told apart, see Echoes in
+// remap.c. Backends only have room for the low bits.
+#define ECHO_SEQ_MASK 0xFFFF
+
+// Output flags, worked out by the engine so backends don't have to
+#define INPUT_EXTENDED 1 // The scan code has the 0xE0 prefix
+
+struct InputEvent
+{
+    int scan_code;
+    int virt_code;
+    enum Direction direction;
+    unsigned int seq; // Outputs only
+    unsigned int flags; // Outputs only
+};
+
+// Inputs generated while handling a single hook event are collected into a
+// batch and injected together once the event has been handled. This keeps the
+// generated events contiguous and costs the backend a single call per event.
+// There is room for the longest macro, see Macros in remap.c.
+#define INPUT_BATCH_CAPACITY 256
+
+struct InputBatch
+{
+    int count;
+    struct InputEvent events[INPUT_BATCH_CAPACITY];
+};
 
 #endif
@@ -1,4 +1,7 @@
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 
 #ifndef KEYS_C
 #define KEYS_C
@@ -304,7 +307,7 @@ KEY_DEF key_table[] = {
     {"US_TILDE", SK_US_TILDE, VK_US_TILDE}, // `~ key on US keyboards
 };
 
-#define KEY_TABLE_LEN (sizeof(key_table) / sizeof(struct KeyDef))
+#define KEY_TABLE_LEN ((int)(sizeof(key_table) / sizeof(struct KeyDef)))
 
 // Shortcuts to common keys (useful for debugging/testing)
 KEY_DEF * CTRL  = &key_table[0];
@@ -318,41 +321,150 @@ KEY_DEF * ESC   = &key_table[14];
 KEY_DEF * SPACE = &key_table[15];
 KEY_DEF * TAB   = &key_table[16];
 
-KEY_DEF * find_key_def_by_name(char * name)
+// Alternative spellings accepted in configs. Names are matched ignoring case,
+// so these only need to cover abbreviations and common variants.
+struct KeyAlias {
+    char * alias;
+    char * name;
+};
+
+struct KeyAlias key_aliases[] = {
+    {"CONTROL", "CTRL"},
+    {"LCTRL", "LEFT_CTRL"},
+    {"RCTRL", "RIGHT_CTRL"},
+    {"LSHIFT", "LEFT_SHIFT"},
+    {"RSHIFT", "RIGHT_SHIFT"},
+    {"LALT", "LEFT_ALT"},
+    {"RALT", "RIGHT_ALT"},
+    {"ALTGR", "RIGHT_ALT"},
+    {"WIN", "LEFT_WIN"},
+    {"LWIN", "LEFT_WIN"},
+    {"RWIN", "RIGHT_WIN"},
+    {"BKSP", "BACKSPACE"},
+    {"CAPS", "CAPSLOCK"},
+    {"CAPS_LOCK", "CAPSLOCK"},
+    {"RETURN", "ENTER"},
+    {"ESC", "ESCAPE"},
+    {"INS", "INSERT"},
+    {"DEL", "DELETE"},
+    {"PGUP", "PAGE_UP"},
+    {"PGDN", "PAGE_DOWN"},
+    {"PRTSC", "PRINT_SCREEN"},
+    {"NUM_LOCK", "NUMLOCK"},
+    {"SCROLL_LOCK", "SCROLLLOCK"},
+};
+
+#define KEY_ALIASES_LEN ((int)(sizeof(key_aliases) / sizeof(struct KeyAlias)))
+
+// Lookups
+// --------------------------------------
+
+// Built once by init_keys. Names and aliases are kept sorted for a binary
+// search, codes are indexed directly. Scan codes are either a single byte or
+// 0xE0 prefixed, so both halves fit in one table.
+//
+// When several keys share a code the first in key_table wins.
+
+#define KEY_NAMES_LEN (KEY_TABLE_LEN + KEY_ALIASES_LEN)
+#define MAX_KEY_NAME_LEN 32
+#define KEY_VIRT_CODE_INDEX_LEN 256
+#define KEY_SCAN_CODE_INDEX_LEN 512
+
+struct KeyName {
+    char * name;
+    KEY_DEF * key;
+};
+
+struct KeyName g_key_names[KEY_NAMES_LEN];
+KEY_DEF * g_key_by_virt_code[KEY_VIRT_CODE_INDEX_LEN];
+KEY_DEF * g_key_by_scan_code[KEY_SCAN_CODE_INDEX_LEN];
+
+int key_scan_code_index(int code)
 {
-    if (name) {
-        for (int i = 0; i < KEY_TABLE_LEN; ++i) {
-            KEY_DEF * key = key_table + i;
-            if (strcmp(key->name, name) == 0) {
-                return key;
-            }
-        }
-    }
-    return NULL;
+    if (code >= 0 && code <= 0xFF) return code;
+    if (code >> 8 == 0xE0) return 0x100 | (code & 0xFF);
+    return -1;
 }
 
-KEY_DEF * find_key_def_by_scan_code(int code)
+int compare_key_names(const void * a, const void * b)
+{
+    return strcmp(((struct KeyName *)a)->name, ((struct KeyName *)b)->name);
+}
+
+KEY_DEF * find_key_def_by_exact_name(char * name)
 {
     for (int i = 0; i < KEY_TABLE_LEN; ++i) {
-        KEY_DEF * key = key_table + i;
-        if (key->scan_code == code) {
-            return key;
+        if (strcmp(key_table[i].name, name) == 0) {
+            return &key_table[i];
         }
     }
     return NULL;
 }
 
-KEY_DEF * find_key_def_by_virt_code(int code)
+// Must be called once before any other lookup
+void init_keys()
 {
-    for (int i = 0; i < KEY_TABLE_LEN; ++i) {
-        KEY_DEF * key = key_table + i;
-        if (key->virt_code == code) {
-            return key;
+    for (int i = 0; i < KEY_TABLE_LEN; i++) {
+        g_key_names[i].name = key_table[i].name;
+        g_key_names[i].key = &key_table[i];
+    }
+    for (int i = 0; i < KEY_ALIASES_LEN; i++) {
+        g_key_names[KEY_TABLE_LEN + i].name = key_aliases[i].alias;
+        g_key_names[KEY_TABLE_LEN + i].key = find_key_def_by_exact_name(key_aliases[i].name);
+    }
+    qsort(g_key_names, KEY_NAMES_LEN, sizeof(struct KeyName), compare_key_names);
+
+    for (int i = KEY_TABLE_LEN - 1; i >= 0; i--) {
+        KEY_DEF * key = &key_table[i];
+        g_key_by_virt_code[key->virt_code] = key;
+        int index = key_scan_code_index(key->scan_code);
+        if (index >= 0) g_key_by_scan_code[index] = key;
+    }
+}
+
+// Looks up the first len characters of name, which needn't be terminated
+KEY_DEF * find_key_def_by_name_len(const char * name, int len)
+{
+    if (len > MAX_KEY_NAME_LEN) return NULL;
+
+    char upper[MAX_KEY_NAME_LEN + 1];
+    for (int i = 0; i < len; i++) {
+        upper[i] = toupper((unsigned char)name[i]);
+    }
+    upper[len] = '\0';
+
+    int low = 0;
+    int high = KEY_NAMES_LEN - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        int cmp = strcmp(upper, g_key_names[mid].name);
+        if (cmp == 0) return g_key_names[mid].key;
+        if (cmp < 0) {
+            high = mid - 1;
+        } else {
+            low = mid + 1;
         }
     }
     return NULL;
 }
 
+KEY_DEF * find_key_def_by_name(char * name)
+{
+    return name ? find_key_def_by_name_len(name, strlen(name)) : NULL;
+}
+
+KEY_DEF * find_key_def_by_scan_code(int code)
+{
+    int index = key_scan_code_index(code);
+    return index >= 0 ? g_key_by_scan_code[index] : NULL;
+}
+
+KEY_DEF * find_key_def_by_virt_code(int code)
+{
+    if (code < 0 || code >= KEY_VIRT_CODE_INDEX_LEN) return NULL;
+    return g_key_by_virt_code[code];
+}
+
 // Defaults to the remappable key names per our definitions, but also
 // handles more obscure codes that aren't available for remapping (yet).
 // These fallback names are wrapped in angle brackets for log clarity.
@@ -0,0 +1,86 @@
+#include <string.h>
+#include "thread.c"
+
+#ifndef LOGGER_C
+#define LOGGER_C
+
+// Log ring
+// --------------------------------------
+
+// Debug log entries are produced inside the input hooks, which must return
+// quickly. Rather than formatting there, the hook pushes fixed size records
+// onto a single producer/single consumer lock-free ring and a background
+// thread formats them. When the consumer falls behind, new records are
+// dropped and counted instead of blocking the hook.
+
+#define LOG_RING_LEN 4096 // Power of two
+
+enum LogType {
+    LOG_INPUT,
+    LOG_BLOCKED_INPUT,
+    LOG_SEND_INPUT,
+    LOG_STATE,
+    LOG_TRACE, // A raw input for the trace file, see trace.c
+};
+
+struct LogRecord
+{
+    enum LogType type;
+    int indent;
+    int scan_code;
+    int virt_code;
+    int dir;
+    // Both must point to static storage
+    const char * label;
+    const char * key_name;
+    unsigned long time; // LOG_TRACE only
+};
+
+struct LogRing
+{
+    // Each index is only written by one side. Both count up freely and are
+    // masked on access, so head - tail is the number of unread records.
+    volatile long head; // Written by the producer
+    volatile long tail; // Written by the consumer
+    volatile long dropped; // Written by the producer
+    struct LogRecord records[LOG_RING_LEN];
+};
+
+/* @return 1 if pushed, 0 if the ring was full and the record was dropped */
+int log_ring_push(struct LogRing * ring, struct LogRecord * record)
+{
+    unsigned long head = (unsigned long)ring->head;
+    unsigned long tail = (unsigned long)atomic_load_acquire(&ring->tail);
+    if (head - tail >= LOG_RING_LEN) {
+        atomic_store_release(&ring->dropped, ring->dropped + 1);
+        return 0;
+    }
+    ring->records[head & (LOG_RING_LEN - 1)] = *record;
+    atomic_store_release(&ring->head, (long)(head + 1));
+    return 1;
+}
+
+/* @return 1 if a record was popped, 0 if the ring was empty */
+int log_ring_pop(struct LogRing * ring, struct LogRecord * record)
+{
+    unsigned long tail = (unsigned long)ring->tail;
+    unsigned long head = (unsigned long)atomic_load_acquire(&ring->head);
+    if (tail == head) {
+        return 0;
+    }
+    *record = ring->records[tail & (LOG_RING_LEN - 1)];
+    atomic_store_release(&ring->tail, (long)(tail + 1));
+    return 1;
+}
+
+long log_ring_dropped(struct LogRing * ring)
+{
+    return atomic_load_acquire(&ring->dropped);
+}
+
+void reset_log_ring(struct LogRing * ring)
+{
+    memset(ring, 0, sizeof(struct LogRing));
+}
+
+#endif
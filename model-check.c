@@ -0,0 +1,657 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "input.h"
+#include "keys.c"
+#include "remap.c"
+#include "thread.c"
+#include "timing.c"
+
+// Runs the remap engine through every input sequence up to a given length and
+// checks what it sends. The inputs are DOWN and UP of every remapped key and
+// of one key that isn't remapped, and a mouse click. Each sequence is checked
+// as it is, and again once every key still down has been released, for:
+//
+// - outputs sent DOWN while already down, or UP while not down
+// - keys still down after everything was released (stuck modifiers)
+// - input that isn't remapped being blocked
+// - presses of a remapped key that sent nothing
+// - anything else reaching applications while a held remap's with_other key
+//   isn't down
+// - outputs whose echo isn't recognised
+//
+// Sequences are never extended past a failure, so what gets reported for each
+// check is a shortest sequence that fails it.
+//
+// The search tree is split into subtrees that threads take from each other's
+// queues when they run out of their own. The subtrees are searched depth
+// first, with the engine's state saved and restored around each input rather
+// than replaying sequences from the start.
+//
+// usage: model-check [-j <threads>] [<depth>] [<config>]
+//
+// Without a config a built-in one with three remaps, two of them involving
+// the key itself, is checked. Timeouts aren't modelled: every input arrives
+// at the same time and timeouts and double taps in the config are ignored.
+// Configs with layers, chords or macros can't be checked yet.
+
+#define DEFAULT_DEPTH 6
+#define MAX_DEPTH 32
+#define MAX_MODEL_REMAPS 8
+#define MAX_KEYS (MAX_MODEL_REMAPS + 1)
+#define MAX_SYMBOLS (MAX_KEYS * 2 + 1)
+#define MAX_TASKS (MAX_SYMBOLS * MAX_DEPTH)
+#define STEP_OUTPUT_CAPACITY 256
+#define DETAIL_LEN 128
+#define SUBTREE_SEQUENCES 20000 // Roughly what a thread searches without sharing
+
+char * g_default_config =
+    "remap_key=CAPSLOCK\n"
+    "when_alone=ESCAPE\n"
+    "with_other=CTRL\n"
+    "remap_key=TAB\n"
+    "when_alone=TAB\n"
+    "with_other=ALT\n"
+    "remap_key=LEFT_SHIFT\n"
+    "when_alone=SPACE\n"
+    "with_other=LEFT_SHIFT\n";
+
+// Tried in order for the key that isn't remapped
+char * g_other_key_names[] = {"ENTER", "A", "B", "SPACE"};
+
+// Alphabet
+// --------------------------------------
+
+// Keys are numbered remapped keys first, in slot order, then the other key.
+// Key k goes DOWN with symbol 2k and UP with 2k + 1, the mouse comes last.
+
+struct Symbol
+{
+    KEY_DEF * key;
+    enum Direction dir;
+    int key_index; // -1 for the mouse
+    int slot; // Slot of the key's remap, -1 for other input
+};
+
+KEY_DEF g_mouse = {"MOUSE", 0, MOUSE_DUMMY_VK};
+struct Symbol g_alphabet[MAX_SYMBOLS];
+int g_symbol_count;
+int g_key_count;
+int g_depth = DEFAULT_DEPTH;
+int g_subtree_depth; // Subtrees at most this deep aren't shared
+
+void add_key_symbols(KEY_DEF * key, int slot)
+{
+    for (int dir = DOWN; dir >= UP; dir--) {
+        struct Symbol * symbol = &g_alphabet[g_symbol_count++];
+        symbol->key = key;
+        symbol->dir = dir;
+        symbol->key_index = g_key_count;
+        symbol->slot = slot;
+    }
+    g_key_count++;
+}
+
+int is_used_by_remaps(struct RemapTable * table, KEY_DEF * key)
+{
+    for (int i = 0; i < table->remap_count; i++) {
+        struct Remap * remap = table->remaps[i];
+        if (remap->from->virt_code == key->virt_code ||
+            remap->to_when_alone->virt_code == key->virt_code ||
+            remap->to_with_other->virt_code == key->virt_code) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* @return error */
+int init_alphabet(struct RemapTable * table)
+{
+    if (table->remap_slot_count > MAX_MODEL_REMAPS) {
+        printf("Too many remaps to check, at most %d are supported.\n", MAX_MODEL_REMAPS);
+        return 1;
+    }
+    if (table->layer_list || table->chord_count || table->macro_event_count) {
+        printf("Configs with layers, chords or macros can't be checked.\n");
+        return 1;
+    }
+    for (int slot = 0; slot < table->remap_slot_count; slot++) {
+        add_key_symbols(table->remap_slots[slot]->from, slot);
+    }
+    int count = sizeof(g_other_key_names) / sizeof(g_other_key_names[0]);
+    for (int i = 0; i < count; i++) {
+        KEY_DEF * key = find_key_def_by_name(g_other_key_names[i]);
+        if (!is_used_by_remaps(table, key)) {
+            add_key_symbols(key, -1);
+            break;
+        }
+    }
+    struct Symbol * mouse = &g_alphabet[g_symbol_count++];
+    mouse->key = &g_mouse;
+    mouse->dir = DOWN;
+    mouse->key_index = -1;
+    mouse->slot = -1;
+    return 0;
+}
+
+// Violations
+// --------------------------------------
+
+enum Violation {
+    DUPLICATE_DOWN,
+    UP_WITHOUT_DOWN,
+    STUCK_KEY,
+    BLOCKED_OTHER_INPUT,
+    SILENT_PRESS,
+    MISSING_WITH_OTHER,
+    UNKNOWN_ECHO,
+    VIOLATION_COUNT,
+    NO_VIOLATION = VIOLATION_COUNT,
+};
+
+char * violation_names[] = {
+    "output sent DOWN while already down",
+    "output sent UP while not down",
+    "key still down after everything was released",
+    "other input blocked",
+    "remapped key press sent nothing",
+    "input while the with_other key isn't down",
+    "echo of an output not recognised",
+};
+
+struct Counterexample
+{
+    int length; // 0 if none was found
+    uint8_t sequence[MAX_DEPTH];
+    char detail[DETAIL_LEN];
+};
+
+// Workers
+// --------------------------------------
+
+struct Task
+{
+    int length;
+    uint8_t sequence[MAX_DEPTH];
+};
+
+// Everything a sequence changes: the engine's state and what applications
+// were told about keys. The config stays within one word of held remaps.
+struct ModelState
+{
+    int armed;
+    uint64_t passed_down[VIRT_CODE_INDEX_LEN / 64];
+    uint32_t next_echo_seq;
+    uint32_t echo_head;
+    uint8_t slot_states[MAX_MODEL_REMAPS];
+    uint64_t held_alone;
+    int held_alone_count;
+    int held_count;
+    uint32_t user_down; // Keys the user holds, by key index
+    uint64_t os_down[VIRT_CODE_INDEX_LEN / 64]; // Keys applications see down
+};
+
+struct Worker
+{
+    Thread thread;
+    struct Engine * engine;
+    struct ModelState initial;
+    uint32_t user_down;
+    uint64_t os_down[VIRT_CODE_INDEX_LEN / 64];
+
+    // Sent while handling the current input
+    struct InputEvent outputs[STEP_OUTPUT_CAPACITY];
+    int output_count;
+    int unknown_echo;
+    int blocked;
+
+    uint8_t sequence[MAX_DEPTH];
+    long long sequences_checked;
+    struct Counterexample found[VIOLATION_COUNT];
+
+    // Owner pushes and pops at the bottom, thieves take from the top
+    Mutex lock;
+    struct Task tasks[MAX_TASKS];
+    int task_top;
+    int task_bottom;
+};
+
+struct Worker * g_workers;
+int g_worker_count;
+long g_pending_tasks; // Pushed and not finished yet
+
+void save_state(struct Worker * worker, struct ModelState * state)
+{
+    struct Engine * engine = worker->engine;
+    struct RemapTable * table = engine->table;
+    state->armed = engine->armed;
+    memcpy(state->passed_down, engine->passed_down, sizeof(state->passed_down));
+    state->next_echo_seq = engine->next_echo_seq;
+    state->echo_head = engine->echo_head;
+    memcpy(state->slot_states, table->slot_states, MAX_MODEL_REMAPS);
+    state->held_alone = table->held_alone[0];
+    state->held_alone_count = table->held_alone_count;
+    state->held_count = table->held_count;
+    state->user_down = worker->user_down;
+    memcpy(state->os_down, worker->os_down, sizeof(state->os_down));
+}
+
+void restore_state(struct Worker * worker, struct ModelState * state)
+{
+    struct Engine * engine = worker->engine;
+    struct RemapTable * table = engine->table;
+    engine->armed = state->armed;
+    memcpy(engine->passed_down, state->passed_down, sizeof(state->passed_down));
+    engine->next_echo_seq = state->next_echo_seq;
+    engine->echo_head = state->echo_head;
+    memcpy(table->slot_states, state->slot_states, MAX_MODEL_REMAPS);
+    table->held_alone[0] = state->held_alone;
+    table->held_alone_count = state->held_alone_count;
+    table->held_count = state->held_count;
+    worker->user_down = state->user_down;
+    memcpy(worker->os_down, state->os_down, sizeof(worker->os_down));
+}
+
+void model_batch(struct Engine * engine, struct InputBatch * batch)
+{
+    struct Worker * worker = engine->context;
+    for (int i = 0; i < batch->count; i++) {
+        struct InputEvent * event = &batch->events[i];
+        if (!consume_echo(engine, event->seq)) worker->unknown_echo = 1;
+        if (worker->output_count < STEP_OUTPUT_CAPACITY) {
+            worker->outputs[worker->output_count++] = *event;
+        }
+    }
+}
+
+int is_down(uint64_t * keys, int virt_code)
+{
+    return (keys[virt_code / 64] >> (virt_code % 64)) & 1;
+}
+
+void set_down(uint64_t * keys, int virt_code, int down)
+{
+    uint64_t bit = (uint64_t)1 << (virt_code % 64);
+    if (down) keys[virt_code / 64] |= bit;
+    else keys[virt_code / 64] &= ~bit;
+}
+
+int was_sent(struct Worker * worker, KEY_DEF * key, enum Direction dir)
+{
+    for (int i = 0; i < worker->output_count; i++) {
+        if (worker->outputs[i].virt_code == key->virt_code && worker->outputs[i].direction == dir) return 1;
+    }
+    return 0;
+}
+
+int is_with_other_key(struct RemapTable * table, int virt_code)
+{
+    for (int slot = 0; slot < table->remap_slot_count; slot++) {
+        if (table->remap_slots[slot]->to_with_other->virt_code == virt_code) return 1;
+    }
+    return 0;
+}
+
+// Anything applications see while a remap is held, other than the remap's own
+// input and the with_other keys themselves, must come with its with_other key
+/* @return violation */
+int check_held_remaps(struct Worker * worker, struct Symbol * symbol, char * detail)
+{
+    struct RemapTable * table = worker->engine->table;
+    for (int k = 0; k < g_key_count; k++) {
+        struct Symbol * held = &g_alphabet[k * 2];
+        if (held->slot < 0 || k == symbol->key_index || !(worker->user_down & (1u << k))) continue;
+        KEY_DEF * with_other = table->remap_slots[held->slot]->to_with_other;
+        if (!is_down(worker->os_down, with_other->virt_code)) {
+            snprintf(detail, DETAIL_LEN, "%s held, %s not down", held->key->name, with_other->name);
+            return MISSING_WITH_OTHER;
+        }
+    }
+    return NO_VIOLATION;
+}
+
+/* @return violation, NO_VIOLATION if the input was handled correctly */
+int apply_symbol(struct Worker * worker, int index, char * detail)
+{
+    struct Symbol * symbol = &g_alphabet[index];
+    struct Engine * engine = worker->engine;
+    worker->output_count = 0;
+    worker->unknown_echo = 0;
+    worker->blocked = 0;
+    // Like the hooks, mouse input skips the engine while nothing is held
+    if (symbol->key != &g_mouse || is_engine_armed(engine)) {
+        worker->blocked = handle_input(engine, symbol->key->scan_code, symbol->key->virt_code, symbol->dir, 0);
+    }
+    flush_output(engine);
+    if (worker->unknown_echo) {
+        snprintf(detail, DETAIL_LEN, "handling %s %s", symbol->key->name, fmt_dir(symbol->dir));
+        return UNKNOWN_ECHO;
+    }
+
+    int violation;
+    for (int i = 0; i < worker->output_count; i++) {
+        struct InputEvent * event = &worker->outputs[i];
+        int down = is_down(worker->os_down, event->virt_code);
+        if (down == (event->direction == DOWN)) {
+            snprintf(detail, DETAIL_LEN, "%s", friendly_virt_code_name(event->virt_code));
+            return down ? DUPLICATE_DOWN : UP_WITHOUT_DOWN;
+        }
+        if (!is_with_other_key(engine->table, event->virt_code) &&
+            (violation = check_held_remaps(worker, symbol, detail)) != NO_VIOLATION) {
+            return violation;
+        }
+        set_down(worker->os_down, event->virt_code, event->direction == DOWN);
+    }
+
+    uint32_t key_bit = symbol->key_index >= 0 ? (uint32_t)1 << symbol->key_index : 0;
+    if (symbol->slot < 0) {
+        if (worker->blocked) {
+            snprintf(detail, DETAIL_LEN, "%s %s", symbol->key->name, fmt_dir(symbol->dir));
+            return BLOCKED_OTHER_INPUT;
+        }
+        if ((violation = check_held_remaps(worker, symbol, detail)) != NO_VIOLATION) return violation;
+        if (key_bit) set_down(worker->os_down, symbol->key->virt_code, symbol->dir == DOWN);
+    } else if (symbol->dir == UP && (worker->user_down & key_bit)) {
+        struct Remap * remap = engine->table->remap_slots[symbol->slot];
+        if (!was_sent(worker, remap->to_with_other, UP) &&
+            !(was_sent(worker, remap->to_when_alone, DOWN) && was_sent(worker, remap->to_when_alone, UP))) {
+            snprintf(detail, DETAIL_LEN, "%s", symbol->key->name);
+            return SILENT_PRESS;
+        }
+    }
+    if (symbol->dir == DOWN) worker->user_down |= key_bit;
+    else worker->user_down &= ~key_bit;
+    return NO_VIOLATION;
+}
+
+/* @return violation, NO_VIOLATION if releasing every key leaves nothing down */
+int check_release(struct Worker * worker, char * detail)
+{
+    struct ModelState state;
+    save_state(worker, &state);
+    int violation = NO_VIOLATION;
+    for (int k = 0; k < g_key_count && violation == NO_VIOLATION; k++) {
+        if (worker->user_down & (1u << k)) violation = apply_symbol(worker, k * 2 + 1, detail);
+    }
+    if (violation == NO_VIOLATION && (is_engine_armed(worker->engine) || worker->engine->table->held_count)) {
+        snprintf(detail, DETAIL_LEN, "a remap is still held");
+        violation = STUCK_KEY;
+    }
+    for (int code = 0; code < VIRT_CODE_INDEX_LEN && violation == NO_VIOLATION; code++) {
+        if (is_down(worker->os_down, code)) {
+            snprintf(detail, DETAIL_LEN, "%s", friendly_virt_code_name(code));
+            violation = STUCK_KEY;
+        }
+    }
+    restore_state(worker, &state);
+    return violation;
+}
+
+void record_counterexample(struct Worker * worker, int violation, int length, char * detail)
+{
+    struct Counterexample * found = &worker->found[violation];
+    // The shortest wins, then the first in alphabet order
+    if (found->length && (found->length < length ||
+        (found->length == length && memcmp(found->sequence, worker->sequence, length) <= 0))) {
+        return;
+    }
+    found->length = length;
+    memcpy(found->sequence, worker->sequence, length);
+    snprintf(found->detail, DETAIL_LEN, "%s", detail);
+}
+
+/* @return whether the sequence in worker->sequence passed, its last input is applied */
+int check_sequence(struct Worker * worker, int length)
+{
+    char detail[DETAIL_LEN];
+    worker->sequences_checked++;
+    int violation = apply_symbol(worker, worker->sequence[length - 1], detail);
+    if (violation == NO_VIOLATION) violation = check_release(worker, detail);
+    if (violation == NO_VIOLATION) return 1;
+    record_counterexample(worker, violation, length, detail);
+    return 0;
+}
+
+void search(struct Worker * worker, int length)
+{
+    struct ModelState state;
+    save_state(worker, &state);
+    for (int s = 0; s < g_symbol_count; s++) {
+        worker->sequence[length] = (uint8_t)s;
+        if (check_sequence(worker, length + 1) && length + 1 < g_depth) {
+            search(worker, length + 1);
+        }
+        restore_state(worker, &state);
+    }
+}
+
+// Work stealing
+// --------------------------------------
+
+void push_task(struct Worker * worker, int length)
+{
+    atomic_add(&g_pending_tasks, 1);
+    lock_mutex(&worker->lock);
+    if (worker->task_bottom == MAX_TASKS) {
+        int count = worker->task_bottom - worker->task_top;
+        memmove(worker->tasks, &worker->tasks[worker->task_top], count * sizeof(struct Task));
+        worker->task_top = 0;
+        worker->task_bottom = count;
+    }
+    struct Task * task = &worker->tasks[worker->task_bottom++];
+    task->length = length;
+    memcpy(task->sequence, worker->sequence, length);
+    unlock_mutex(&worker->lock);
+}
+
+/* @return whether a task was taken */
+int pop_task(struct Worker * worker, struct Task * task)
+{
+    int found = 0;
+    lock_mutex(&worker->lock);
+    if (worker->task_bottom > worker->task_top) {
+        *task = worker->tasks[--worker->task_bottom];
+        found = 1;
+    }
+    unlock_mutex(&worker->lock);
+    return found;
+}
+
+/* @return whether a task was taken, the shallowest a victim has */
+int steal_task(struct Worker * worker, struct Task * task)
+{
+    int self = (int)(worker - g_workers);
+    for (int i = 1; i < g_worker_count; i++) {
+        struct Worker * victim = &g_workers[(self + i) % g_worker_count];
+        int found = 0;
+        lock_mutex(&victim->lock);
+        if (victim->task_bottom > victim->task_top) {
+            *task = victim->tasks[victim->task_top++];
+            found = 1;
+        }
+        unlock_mutex(&victim->lock);
+        if (found) return 1;
+    }
+    return 0;
+}
+
+void run_task(struct Worker * worker, struct Task * task)
+{
+    char detail[DETAIL_LEN];
+    restore_state(worker, &worker->initial);
+    // Every prefix of the task already passed
+    for (int i = 0; i < task->length; i++) {
+        worker->sequence[i] = task->sequence[i];
+        apply_symbol(worker, task->sequence[i], detail);
+    }
+    if (g_depth - task->length <= g_subtree_depth) {
+        search(worker, task->length);
+        return;
+    }
+    struct ModelState state;
+    save_state(worker, &state);
+    for (int s = 0; s < g_symbol_count; s++) {
+        worker->sequence[task->length] = (uint8_t)s;
+        if (check_sequence(worker, task->length + 1)) push_task(worker, task->length + 1);
+        restore_state(worker, &state);
+    }
+}
+
+void run_worker(void * arg)
+{
+    struct Worker * worker = arg;
+    struct Task task;
+    for (;;) {
+        if (pop_task(worker, &task) || steal_task(worker, &task)) {
+            run_task(worker, &task);
+            atomic_add(&g_pending_tasks, -1);
+        } else if (atomic_load_acquire(&g_pending_tasks) == 0) {
+            return;
+        } else {
+            sleep_ms(1);
+        }
+    }
+}
+
+// Reporting
+// --------------------------------------
+
+void print_step(struct Worker * worker, int index)
+{
+    char detail[DETAIL_LEN];
+    struct Symbol * symbol = &g_alphabet[index];
+    apply_symbol(worker, index, detail);
+    printf("    %s %s", symbol->key->name, fmt_dir(symbol->dir));
+    for (int i = 0; i < worker->output_count; i++) {
+        struct InputEvent * event = &worker->outputs[i];
+        printf("%s%s %s", i ? ", " : " -> ", friendly_virt_code_name(event->virt_code), fmt_dir(event->direction));
+    }
+    printf("%s\n", worker->blocked ? "" : " (passed through)");
+}
+
+void print_counterexample(struct Worker * worker, int violation, struct Counterexample * found)
+{
+    printf("\nViolation: %s (%s)\n", violation_names[violation], found->detail);
+    restore_state(worker, &worker->initial);
+    for (int i = 0; i < found->length; i++) {
+        print_step(worker, found->sequence[i]);
+    }
+    if (!worker->user_down) return;
+    printf("  releasing everything:\n");
+    for (int k = 0; k < g_key_count; k++) {
+        if (worker->user_down & (1u << k)) print_step(worker, k * 2 + 1);
+    }
+}
+
+// Main
+// --------------------------------------
+
+/* @return error */
+int init_worker(struct Worker * worker, char * config_path)
+{
+    worker->engine = new_engine(model_batch, worker);
+    int err;
+    if (config_path) {
+        FILE * file = fopen(config_path, "r");
+        if (!file) {
+            printf("Cannot open configuration file '%s'.\n", config_path);
+            return 1;
+        }
+        err = load_config_stream(worker->engine, file, load_config_buffer);
+        fclose(file);
+    } else {
+        err = load_config_buffer(worker->engine, g_default_config, strlen(g_default_config));
+    }
+    if (err) return 1;
+    worker->engine->debug = 0;
+    struct RemapTable * table = worker->engine->table;
+    for (int i = 0; i < table->remap_count; i++) {
+        table->remaps[i]->hold_timeout_ms = 0;
+        table->remaps[i]->tap_timeout_ms = 0;
+        table->remaps[i]->double_tap_ms = 0;
+    }
+    init_mutex(&worker->lock);
+    save_state(worker, &worker->initial);
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    char * config_path = NULL;
+    g_worker_count = cpu_count();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            g_worker_count = atoi(argv[++i]);
+        } else if (argv[i][0] >= '0' && argv[i][0] <= '9') {
+            g_depth = atoi(argv[i]);
+        } else if (argv[i][0] != '-' && !config_path) {
+            config_path = argv[i];
+        } else {
+            printf("usage: model-check [-j <threads>] [<depth>] [<config>]\n");
+            return 2;
+        }
+    }
+    if (g_depth < 1 || g_depth > MAX_DEPTH || g_worker_count < 1) {
+        printf("Depth must be 1 to %d and there must be at least one thread.\n", MAX_DEPTH);
+        return 2;
+    }
+
+    init_keys();
+    g_workers = calloc(g_worker_count, sizeof(struct Worker));
+    for (int i = 0; i < g_worker_count; i++) {
+        if (init_worker(&g_workers[i], config_path)) return 2;
+    }
+    if (init_alphabet(g_workers[0].engine->table)) return 2;
+    long long subtree = g_symbol_count;
+    for (g_subtree_depth = 1; subtree < SUBTREE_SEQUENCES; g_subtree_depth++) {
+        subtree *= g_symbol_count;
+    }
+
+    long long start = now_ns();
+    push_task(&g_workers[0], 0);
+    for (int i = 1; i < g_worker_count; i++) {
+        start_thread(&g_workers[i].thread, run_worker, &g_workers[i]);
+    }
+    run_worker(&g_workers[0]);
+    for (int i = 1; i < g_worker_count; i++) {
+        join_thread(g_workers[i].thread);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    long long sequences = 0;
+    struct Counterexample found[VIOLATION_COUNT] = {0};
+    for (int i = 0; i < g_worker_count; i++) {
+        struct Worker * worker = &g_workers[i];
+        sequences += worker->sequences_checked;
+        for (int v = 0; v < VIOLATION_COUNT; v++) {
+            struct Counterexample * candidate = &worker->found[v];
+            if (candidate->length && (!found[v].length || candidate->length < found[v].length ||
+                (candidate->length == found[v].length &&
+                memcmp(candidate->sequence, found[v].sequence, candidate->length) < 0))) {
+                found[v] = *candidate;
+            }
+        }
+    }
+
+    printf("Checked %lld sequences of up to %d inputs on %d thread%s in %.2f s.\n",
+        sequences, g_depth, g_worker_count, g_worker_count == 1 ? "" : "s", seconds);
+    printf("Inputs:");
+    for (int s = 0; s < g_symbol_count; s++) {
+        printf(" %s %s", g_alphabet[s].key->name, fmt_dir(g_alphabet[s].dir));
+    }
+    printf("\n");
+    int failed = 0;
+    for (int v = 0; v < VIOLATION_COUNT; v++) {
+        if (!found[v].length) continue;
+        print_counterexample(&g_workers[0], v, &found[v]);
+        failed = 1;
+    }
+    if (!failed) printf("No violations.\n");
+
+    for (int i = 0; i < g_worker_count; i++) {
+        free_engine(g_workers[i].engine);
+    }
+    free(g_workers);
+    return failed;
+}
@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef RECORDER_C
+#define RECORDER_C
+
+// Flight recorder
+// --------------------------------------
+
+// Always on, unlike the debug log: the engine appends a packed 16 byte record
+// for every input, output, state change and blocked input to a fixed size
+// ring. The ring lives in a memory mapped file the backend provides, so what
+// led up to a stuck key can be collected afterwards even when the process
+// crashed. Recording is a single store, nothing is formatted or allocated;
+// see print_flight_log for turning a recording into a readable log.
+//
+// The file is a header followed by the records. A recording that is found
+// again on startup is carried on rather than cleared, with a marker record
+// where the new session starts.
+
+#define FLIGHT_MAGIC 0x52464B44 // "DKFR"
+#define FLIGHT_VERSION 1
+#define FLIGHT_RECORDS 65536 // Power of two
+
+enum FlightType {
+    FLIGHT_START,
+    FLIGHT_INPUT,
+    FLIGHT_BLOCKED_INPUT,
+    FLIGHT_SEND_INPUT,
+    FLIGHT_STATE,
+};
+
+struct FlightRecord
+{
+    uint32_t index; // Position in the recording, tells torn or stale records apart
+    uint32_t time; // Engine clock
+    uint16_t scan_code;
+    uint8_t virt_code;
+    uint8_t type;
+    uint8_t dir; // The new state for FLIGHT_STATE
+    uint8_t indent;
+    uint8_t label; // enum OutputLabel for FLIGHT_SEND_INPUT
+    uint8_t slot;
+};
+
+typedef char flight_record_is_16_bytes[sizeof(struct FlightRecord) == 16 ? 1 : -1];
+
+struct FlightHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t record_size;
+    uint32_t head; // Records ever written
+    uint32_t reserved[11];
+};
+
+#define FLIGHT_FILE_SIZE (sizeof(struct FlightHeader) + FLIGHT_RECORDS * sizeof(struct FlightRecord))
+
+struct FlightRecorder
+{
+    struct FlightHeader * header;
+    struct FlightRecord * records;
+};
+
+/* @return whether the memory holds a recording we can read */
+int is_flight_recording(struct FlightHeader * header)
+{
+    return header->magic == FLIGHT_MAGIC &&
+        header->version == FLIGHT_VERSION &&
+        header->capacity == FLIGHT_RECORDS &&
+        header->record_size == sizeof(struct FlightRecord);
+}
+
+void record_flight(struct FlightRecorder * recorder, enum FlightType type, uint32_t time, int scan_code,
+    int virt_code, int dir, int indent, int label, int slot)
+{
+    uint32_t index = recorder->header->head;
+    struct FlightRecord * record = &recorder->records[index & (FLIGHT_RECORDS - 1)];
+    record->index = index;
+    record->time = time;
+    record->scan_code = (uint16_t)scan_code;
+    record->virt_code = (uint8_t)virt_code;
+    record->type = (uint8_t)type;
+    record->dir = (uint8_t)dir;
+    record->indent = (uint8_t)indent;
+    record->label = (uint8_t)label;
+    record->slot = (uint8_t)slot;
+    recorder->header->head = index + 1;
+}
+
+// Memory must be FLIGHT_FILE_SIZE bytes, either zeroed or holding an earlier
+// recording. The start marker carries the wall clock in seconds.
+void init_flight_recorder(struct FlightRecorder * recorder, void * memory)
+{
+    recorder->header = memory;
+    recorder->records = (struct FlightRecord *)(recorder->header + 1);
+    if (!is_flight_recording(recorder->header)) {
+        memset(memory, 0, FLIGHT_FILE_SIZE);
+        recorder->header->magic = FLIGHT_MAGIC;
+        recorder->header->version = FLIGHT_VERSION;
+        recorder->header->capacity = FLIGHT_RECORDS;
+        recorder->header->record_size = sizeof(struct FlightRecord);
+    }
+    record_flight(recorder, FLIGHT_START, (uint32_t)time(NULL), 0, 0, 0, 0, 0, 0);
+}
+
+#endif
@@ -1,8 +1,23 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <assert.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 #include "input.h"
 #include "keys.c"
+#include "logger.c"
+#include "recorder.c"
+#include "histogram.c"
+#include "timing.c"
+#include "timer_wheel.c"
+#include "trace.c"
+
+#ifndef REMAP_C
+#define REMAP_C
 
 // Types
 // --------------------------------------
@@ -11,268 +26,2112 @@ enum State {
     IDLE,
     HELD_DOWN_ALONE,
     HELD_DOWN_WITH_OTHER,
+    TAPPED, // Released after a tap, see Double taps
+    HELD_DOWN_DOUBLE_TAP,
+};
+
+char * state_names[] = {"IDLE", "HELD_DOWN_ALONE", "HELD_DOWN_WITH_OTHER", "TAPPED", "HELD_DOWN_DOUBLE_TAP"};
+
+// Why an output was sent
+enum OutputLabel {
+    OUTPUT_WHEN_ALONE,
+    OUTPUT_WITH_OTHER,
+    OUTPUT_LAYER,
+    OUTPUT_CHORD,
+    OUTPUT_HELD_BACK,
+    OUTPUT_DOUBLE_TAP,
+};
+
+char * output_label_names[] = {"when_alone", "with_other", "layer", "chord", "held_back", "double_tap"};
+
+#ifdef _MSC_VER
+#define CACHE_ALIGNED __declspec(align(64))
+#else
+#define CACHE_ALIGNED __attribute__((aligned(64)))
+#endif
+
+struct RemapTable;
+struct Layer;
+
+// Macros
+// --------------------------------------
+
+// when_alone and with_other can be combos (CTRL+SHIFT+P) instead of single
+// keys, and when_alone a sequence of them (CTRL+C, CTRL+V). Loading compiles
+// each into a run of events ready to send, all kept in one flat array on the
+// table, with the flags backends need worked out once. Sending a run copies it
+// into the output batch, which is flushed first if the run wouldn't fit, so a
+// macro always goes out in one injection. A with_other combo is its presses
+// followed by its releases: the first half goes out when the key is held with
+// other input and the second when it is released.
+
+#define MAX_MACRO_EVENTS INPUT_BATCH_CAPACITY
+
+struct MacroEvent
+{
+    uint16_t scan_code;
+    uint8_t virt_code;
+    uint8_t direction;
+    uint8_t flags; // INPUT_EXTENDED
+};
+
+struct Macro
+{
+    int first; // Index into the table's macro_events
+    int count; // 0 unless the key is a macro
 };
 
 struct Remap
 {
     KEY_DEF * from;
-    KEY_DEF * to_when_alone;
-    KEY_DEF * to_with_other;
+    KEY_DEF * to_when_alone; // NULL if when_alone is a macro
+    KEY_DEF * to_with_other; // NULL if with_other is a layer or a macro
+    struct Macro when_alone_macro;
+    struct Macro with_other_macro;
+    struct Layer * layer; // See Layers
+    int hold_timeout_ms; // 0 to only go with_other on other input
+    int tap_timeout_ms; // 0 to allow taps of any length
+    KEY_DEF * to_double_tap; // NULL unless configured, see Double taps
+    int double_tap_ms; // 0 turns double taps off
+
+    int slot; // Position in the table's slot arrays, -1 if shadowed by an earlier remap
+    struct RemapTable * table;
+    uint32_t pressed_at;
+    struct Timer hold_timer;
+    struct Timer double_tap_timer;
 
-    enum State state;
+    uint64_t with_other_count;
+    uint64_t when_alone_count;
+    uint64_t double_tap_count;
 
     struct Remap * next;
 };
 
-// Globals
+// Dispatch index
+// --------------------------------------
+
+// Every input looks up its remap, so the table keeps its hot data as small
+// arrays next to the remap list rather than behind pointers into the heap.
+// Virtual codes fit in a byte and map straight to a slot (see Held remaps)
+// through a byte array, and the state of each slot's remap sits in another.
+// Handling a key that isn't remapped reads one byte, and with a typical
+// config everything else an input looks at shares a cache line or two.
+//
+// Scan codes index the remaps in registration order through the same 512
+// entries keys.c uses for its own scan code lookups.
+//
+// When two remaps share a key the first one registered wins, matching the
+// order in which the list would be walked.
+
+#define VIRT_CODE_INDEX_LEN 256
+
+// Held remaps
+// --------------------------------------
+
+// Only remaps reachable through the virtual code index can ever be held, so
+// there are at most 256 of them. Each gets a slot in registration order and
+// the remaps currently HELD_DOWN_ALONE are tracked as a bitset over those
+// slots. Other inputs then only have to visit the held remaps, and in the
+// common case where nothing is held a single counter check suffices.
+
+#define MAX_REMAP_SLOTS VIRT_CODE_INDEX_LEN
+#define HELD_SET_WORDS (MAX_REMAP_SLOTS / 64)
+
+// Double taps
+// --------------------------------------
+
+// A remap with a double_tap key can't send its when_alone key on release:
+// the same key might follow. It goes TAPPED instead, stays armed and waits on
+// the engine's timer for double_tap_ms. Pressing the key again in time sends
+// the double_tap key for as long as it is held. Anything else, or the timer
+// running out, sends the tap as it would have been sent on release.
+//
+// Any input other than that press ends the wait, so at most one remap is
+// TAPPED at a time and the engine just points at it. Remaps without a
+// double_tap key never go TAPPED and send their taps straight away.
+
+#define DEFAULT_DOUBLE_TAP_MS 200
+
+// Layers
+// --------------------------------------
+
+// A remap's with_other can name a layer instead of a key. While the remap is
+// held with other input its layer is the engine's active layer, and other
+// keys go through it: a dense table over virtual codes, so translating a key
+// is a single index. Keys the layer leaves out, and remapped keys, are
+// handled as usual.
+//
+// Switching layers swaps one pointer. The engine also remembers what each
+// translated key went down as and releases that, whatever layer is active by
+// the time the key comes up.
+
+#define MAX_LAYER_NAME_LEN 31
+
+struct Layer
+{
+    KEY_DEF * keys[VIRT_CODE_INDEX_LEN]; // NULL for keys the layer leaves alone
+    char name[MAX_LAYER_NAME_LEN + 1];
+    int is_defined;
+    int first_use_line; // For errors about layers that are used but never defined
+    struct Layer * next;
+};
+
+// Chords
+// --------------------------------------
+
+// A chord is a few keys pressed together within the chord window that send
+// another key instead, J+K for Escape say. Chord keys can't go through as
+// they are pressed, so handle_input blocks them and holds them back until the
+// chord is complete, which sends the chord's key, or until anything else
+// happens or the window ends, which sends the held back keys after all, in
+// order. The window runs on the engine's clock from the first key held back,
+// so no key is ever held back for longer than that. Keys that aren't part of
+// a chord are never held back.
+//
+// Only distinct chord keys going down are held back, so the buffer has a
+// fixed capacity and nothing is allocated. One chord can be down at a time,
+// chord keys pressed meanwhile go through as usual.
+
+#define MAX_CHORDS 32
+#define MAX_CHORD_KEYS 4
+#define DEFAULT_CHORD_WINDOW_MS 30
+#define MAX_CHORD_WINDOW_MS 1000
+
+struct Chord
+{
+    KEY_DEF * keys[MAX_CHORD_KEYS];
+    int key_count;
+    KEY_DEF * to;
+};
+
+struct HeldBackKey
+{
+    int scan_code;
+    int virt_code;
+    uint32_t time;
+};
+
+// Stats
+// --------------------------------------
+
+// Always on and cheap enough for the hook: plain counters and a histogram of
+// the time spent in handle_input, all updated on the hook thread without
+// allocating or locking. Per remap counters live on struct Remap. Inputs
+// taking the fast path are counted but not timed.
+
+struct Stats
+{
+    struct Histogram handle_input_ns;
+    uint64_t events_seen;
+    uint64_t events_blocked;
+    uint64_t injected_ignored;
+    uint64_t chords_sent;
+    uint64_t keys_held_back; // Then sent after all
+    uint32_t max_held_back_ms;
+};
+
+// Remap tables
+// --------------------------------------
+
+// Everything a config defines lives in a remap table: the remaps with their
+// states, the indexes over them and the held set. The engine runs on one
+// table at a time and a reloaded config arrives as a whole new table, see
+// Reloading below.
+
+struct RemapTable
+{
+    // Hot, see Dispatch index
+    CACHE_ALIGNED uint8_t slot_by_virt_code[VIRT_CODE_INDEX_LEN]; // Slot + 1, 0 if not remapped
+    CACHE_ALIGNED uint8_t slot_states[MAX_REMAP_SLOTS]; // enum State of each slot's remap
+    CACHE_ALIGNED uint32_t chords_by_virt_code[VIRT_CODE_INDEX_LEN]; // Bit per chord the key is part of
+    CACHE_ALIGNED uint64_t held_alone[HELD_SET_WORDS];
+    int held_alone_count;
+    int held_count; // Remaps that aren't IDLE, HELD_DOWN_WITH_OTHER and TAPPED included
+    int remap_slot_count;
+    struct Remap * remap_slots[MAX_REMAP_SLOTS];
+
+    // Every remap in registration order
+    int remap_by_scan_code[KEY_SCAN_CODE_INDEX_LEN]; // Index + 1 into remaps, 0 if not remapped
+    struct Remap ** remaps;
+    int remap_count;
+    int remap_capacity;
+
+    int debug;
+    struct Remap * remap_list;
+    struct Remap * remap_tail; // Appending stays cheap for long configs
+    struct Remap * remap_parsee;
+    struct Layer * layer_list;
+    struct Layer * layer_parsee; // The layer map lines go to
+    struct Chord chords[MAX_CHORDS];
+    int chord_count;
+    int chord_window_ms; // 0 for the default
+    struct MacroEvent * macro_events; // See Macros
+    int macro_event_count;
+    int macro_event_capacity;
+
+    struct RemapTable * next; // Links replaced tables
+};
+
+struct RemapTable * new_remap_table()
+{
+    struct RemapTable * table;
+#ifdef _MSC_VER
+    table = _aligned_malloc(sizeof(struct RemapTable), 64);
+#else
+    if (posix_memalign((void **)&table, 64, sizeof(struct RemapTable))) table = NULL;
+#endif
+    memset(table, 0, sizeof(struct RemapTable));
+    return table;
+}
+
+void clear_remap_table(struct RemapTable * table)
+{
+    free(table->remap_parsee);
+    while (table->remap_list) {
+        struct Remap * remap = table->remap_list;
+        table->remap_list = remap->next;
+        free(remap);
+    }
+    while (table->layer_list) {
+        struct Layer * layer = table->layer_list;
+        table->layer_list = layer->next;
+        free(layer);
+    }
+    free(table->remaps);
+    free(table->macro_events);
+    struct RemapTable * next = table->next;
+    memset(table, 0, sizeof(struct RemapTable));
+    table->next = next;
+}
+
+void free_remap_table(struct RemapTable * table)
+{
+    clear_remap_table(table);
+#ifdef _MSC_VER
+    _aligned_free(table);
+#else
+    free(table);
+#endif
+}
+
+/* @return number of tables freed */
+int free_remap_tables(struct RemapTable * table)
+{
+    int count = 0;
+    for (; table; count++) {
+        struct RemapTable * next = table->next;
+        free_remap_table(table);
+        table = next;
+    }
+    return count;
+}
+
+// Engine
+// --------------------------------------
+
+// An engine owns everything the remapper keeps between inputs: the current
+// remap table, the pending output, the debug log and the stats. Engines share
+// nothing mutable, so separate engines may be driven from separate threads
+// (one per device, say). A single engine must only ever be driven by one
+// thread at a time, the only exception being reload_config_buffer.
+//
+// Output goes to the sink the backend created the engine with. The context
+// pointer is for the backend to find its own state from inside the sink.
+
+struct Engine;
+
+typedef void (*InputSink)(struct Engine * engine, struct InputBatch * batch);
+
+struct Engine
+{
+    int armed; // See Fast path
+    int debug;
+    struct RemapTable * table;
+
+    // Replaced tables, see Reloading
+    struct RemapTable * draining;
+    struct RemapTable * retired;
+    struct RemapTable * volatile pending_table;
+    struct RemapTable * volatile reclaimable_tables;
+    int unreclaimed_tables; // Reloading thread only, replaced tables it has yet to free
+    uint64_t passed_down[VIRT_CODE_INDEX_LEN / 64]; // Unremapped keys still down
+
+    // See Layers
+    struct Layer * active_layer;
+    struct Remap * layer_remap; // The held remap that activated it
+    KEY_DEF * layer_down[VIRT_CODE_INDEX_LEN]; // What translated keys still down went down as
+
+    struct Remap * tapped; // The TAPPED remap if any, see Double taps
+
+    // See Chords
+    struct HeldBackKey held_back[MAX_CHORD_KEYS];
+    int held_back_count;
+    uint32_t chord_candidates; // Chords the held back keys may still complete
+    struct Timer chord_timer;
+    struct Chord down_chord; // Copied, the table may go. No keys unless a chord is down.
+    int down_chord_keys; // Bit per key of the down chord still down
+
+    // See Clock
+    uint32_t now;
+    struct TimerWheel timers;
+
+    struct InputBatch output_batch;
+    InputSink send_input_batch;
+    void * context;
+    int applying_other_input;
+    uint32_t next_echo_seq; // See Echoes
+    uint32_t echo_head;
+
+    struct FlightRecorder * recorder; // NULL while not recording
+    struct LogRing log_ring;
+    FILE * trace_file; // Raw inputs go here in debug mode, written by whoever drains the log
+    int log_indent_level;
+    int log_counter; // Only used by whoever drains the log
+    long log_dropped_reported;
+    Thread log_thread; // See start_log_thread
+    int has_log_thread;
+    volatile long stop_log_thread;
+
+    struct Stats stats;
+};
+
+void reset_config(struct Engine * engine);
+void on_chord_timeout(struct Timer * timer, void * arg);
+void release_held_back_keys(struct Engine * engine);
+
+// Sets up an engine in memory the caller provides, running on the given table.
+// Baked builds (see bake.c) pass static storage and their baked table, which
+// must then never be reset, reloaded or freed.
+void init_engine(struct Engine * engine, struct RemapTable * table, InputSink send_input_batch, void * context)
+{
+    memset(engine, 0, sizeof(struct Engine));
+    engine->table = table;
+    engine->debug = table->debug;
+    engine->send_input_batch = send_input_batch;
+    engine->context = context;
+    engine->log_counter = 1;
+    init_timer(&engine->chord_timer, on_chord_timeout);
+}
+
+struct Engine * new_engine(InputSink send_input_batch, void * context)
+{
+    struct Engine * engine = malloc(sizeof(struct Engine));
+    init_engine(engine, new_remap_table(), send_input_batch, context);
+    return engine;
+}
+
+void free_engine(struct Engine * engine)
+{
+    reset_config(engine);
+    free_remap_table(engine->table);
+    free(engine);
+}
+
+// Held remaps
 // --------------------------------------
 
-int g_debug = 0;
-struct Remap * g_remap_list;
-struct Remap * g_remap_parsee = NULL;
+int lowest_set_bit(uint64_t word)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return (int)index;
+#else
+    return __builtin_ctzll(word);
+#endif
+}
+
+void mark_held_alone(struct RemapTable * table, struct Remap * remap)
+{
+    uint64_t bit = (uint64_t)1 << (remap->slot % 64);
+    if (!(table->held_alone[remap->slot / 64] & bit)) {
+        table->held_alone[remap->slot / 64] |= bit;
+        table->held_alone_count++;
+    }
+}
+
+void unmark_held_alone(struct RemapTable * table, struct Remap * remap)
+{
+    uint64_t bit = (uint64_t)1 << (remap->slot % 64);
+    if (table->held_alone[remap->slot / 64] & bit) {
+        table->held_alone[remap->slot / 64] &= ~bit;
+        table->held_alone_count--;
+    }
+}
 
 // Debug Logging
 // --------------------------------------
 
+// Logging happens inside the hooks, so the log calls below only push records
+// onto the engine's log ring. The log thread (or drain_log) does the actual
+// formatting. The same calls feed the flight recorder, which is on whether
+// debugging or not.
+
 char * fmt_dir(enum Direction dir)
 {
     return dir ? "DOWN" : "UP";
 }
 
-int log_indent_level = 0;
-int log_counter = 1;
-void print_log_prefix()
+void push_log_record(struct Engine * engine, enum LogType type, int scan_code, int virt_code, int dir,
+    const char * label, const char * key_name)
+{
+    struct LogRecord record = {
+        .type = type,
+        .indent = engine->log_indent_level,
+        .scan_code = scan_code,
+        .virt_code = virt_code,
+        .dir = dir,
+        .label = label,
+        .key_name = key_name,
+    };
+    log_ring_push(&engine->log_ring, &record);
+}
+
+void log_handle_input_start(struct Engine * engine, int scan_code, int virt_code, int dir)
+{
+    if (engine->recorder) {
+        record_flight(engine->recorder, FLIGHT_INPUT, engine->now, scan_code, virt_code, dir,
+            engine->log_indent_level, 0, 0);
+    }
+    if (engine->debug) {
+        push_log_record(engine, LOG_INPUT, scan_code, virt_code, dir, NULL, NULL);
+    }
+    engine->log_indent_level++;
+}
+
+void log_handle_input_end(struct Engine * engine, int scan_code, int virt_code, int dir, int block_input)
+{
+    engine->log_indent_level--;
+    if (!block_input) return;
+    if (engine->recorder) {
+        record_flight(engine->recorder, FLIGHT_BLOCKED_INPUT, engine->now, scan_code, virt_code, dir,
+            engine->log_indent_level, 0, 0);
+    }
+    if (engine->debug) {
+        push_log_record(engine, LOG_BLOCKED_INPUT, scan_code, virt_code, dir, NULL, NULL);
+    }
+}
+
+void log_send_input(struct Engine * engine, enum OutputLabel label, KEY_DEF * key, int dir)
 {
-    printf("\n%03d. ", log_counter++);
-    for (int i = 0; i < log_indent_level; i++)
+    if (engine->recorder) {
+        record_flight(engine->recorder, FLIGHT_SEND_INPUT, engine->now, key->scan_code, key->virt_code, dir,
+            engine->log_indent_level, label, 0);
+    }
+    if (engine->debug) {
+        push_log_record(engine, LOG_SEND_INPUT, 0, 0, dir, output_label_names[label], key->name);
+    }
+}
+
+void log_send_macro_event(struct Engine * engine, enum OutputLabel label, struct MacroEvent * event)
+{
+    if (engine->recorder) {
+        record_flight(engine->recorder, FLIGHT_SEND_INPUT, engine->now, event->scan_code, event->virt_code,
+            event->direction, engine->log_indent_level, label, 0);
+    }
+    if (engine->debug) {
+        KEY_DEF * key = find_key_def_by_virt_code(event->virt_code);
+        push_log_record(engine, LOG_SEND_INPUT, 0, 0, event->direction, output_label_names[label],
+            key ? key->name : "???");
+    }
+}
+
+void log_state_change(struct Engine * engine, KEY_DEF * key, int slot, enum State state)
+{
+    if (engine->recorder) {
+        record_flight(engine->recorder, FLIGHT_STATE, engine->now, key->scan_code, key->virt_code, state,
+            engine->log_indent_level, 0, slot);
+    }
+    if (engine->debug) {
+        push_log_record(engine, LOG_STATE, key->scan_code, key->virt_code, state, state_names[state], key->name);
+    }
+}
+
+// Hooks call this for every raw input before handling it, so that the session
+// can be replayed (see replay.c). Writing the line is left to drain_log.
+void log_trace_input(struct Engine * engine, int scan_code, int virt_code, int dir, unsigned long time)
+{
+    if (!engine->trace_file) return;
+    struct LogRecord record = {LOG_TRACE, 0, scan_code, virt_code, dir, NULL, NULL, time};
+    log_ring_push(&engine->log_ring, &record);
+}
+
+void print_log_prefix(FILE * file, int number, int indent)
+{
+    fprintf(file, "\n%03d. ", number);
+    for (int i = 0; i < indent; i++)
     {
-        printf("\t");
+        fprintf(file, "\t");
+    }
+}
+
+void print_log_record(FILE * file, int number, struct LogRecord * record)
+{
+    print_log_prefix(file, number, record->indent);
+    switch (record->type) {
+    case LOG_INPUT:
+        fprintf(file, "[input] %s %s (scan:0x%02x virt:0x%02x)",
+            friendly_virt_code_name(record->virt_code),
+            fmt_dir(record->dir),
+            record->scan_code,
+            record->virt_code);
+        break;
+    case LOG_BLOCKED_INPUT:
+        fprintf(file, "#blocked-input# %s %s",
+            friendly_virt_code_name(record->virt_code),
+            fmt_dir(record->dir));
+        break;
+    case LOG_SEND_INPUT:
+        fprintf(file, "(sending:%s) %s %s",
+            record->label,
+            record->key_name,
+            fmt_dir(record->dir));
+        break;
+    case LOG_STATE:
+        fprintf(file, "{state} %s %s",
+            record->key_name,
+            record->label);
+        break;
+    case LOG_TRACE:
+        fprintf(file, "[trace] (scan:0x%02x virt:0x%02x) %s",
+            record->scan_code,
+            record->virt_code,
+            fmt_dir(record->dir));
+        break;
+    }
+}
+
+/* @return number of records drained, traces included */
+int drain_log(struct Engine * engine)
+{
+    struct LogRecord record;
+    int count = 0;
+    int traced = 0;
+    while (log_ring_pop(&engine->log_ring, &record)) {
+        if (record.type == LOG_TRACE) {
+            struct TraceEvent event = {record.time, record.scan_code, record.virt_code, record.dir, 0};
+            write_trace_event(engine->trace_file, &event);
+            traced++;
+            continue;
+        }
+        print_log_record(stdout, engine->log_counter++, &record);
+        count++;
+    }
+    if (traced) fflush(engine->trace_file);
+    long dropped = log_ring_dropped(&engine->log_ring);
+    if (dropped != engine->log_dropped_reported) {
+        printf("\n(%ld log entries dropped)", dropped - engine->log_dropped_reported);
+        engine->log_dropped_reported = dropped;
+    }
+    if (count) fflush(stdout);
+    return count + traced;
+}
+
+void log_thread_main(void * arg)
+{
+    struct Engine * engine = arg;
+    while (!atomic_load_acquire(&engine->stop_log_thread)) {
+        if (!drain_log(engine)) sleep_ms(5);
     }
+    drain_log(engine); // Whatever came in while we slept
 }
 
-void log_handle_input_start(int scan_code, int virt_code, int dir, int is_injected)
+/* @return error */
+int start_log_thread(struct Engine * engine)
+{
+    engine->stop_log_thread = 0;
+    engine->has_log_thread = !start_thread(&engine->log_thread, log_thread_main, engine);
+    return !engine->has_log_thread;
+}
+
+// Drains what is left and waits for the log thread, the engine may go after
+void stop_log_thread(struct Engine * engine)
 {
-    if (!g_debug) return;
-    print_log_prefix();
-    printf("[%s] %s %s (scan:0x%02x virt:0x%02x)",
-        is_injected ? "output" : "input",
-        friendly_virt_code_name(virt_code),
-        fmt_dir(dir),
-        scan_code,
-        virt_code);
-    log_indent_level++;
+    if (!engine->has_log_thread) return;
+    atomic_store_release(&engine->stop_log_thread, 1);
+    join_thread(engine->log_thread);
+    engine->has_log_thread = 0;
 }
 
-void log_handle_input_end(int scan_code, int virt_code, int dir, int is_injected, int block_input)
+// Flight recordings
+// --------------------------------------
+
+// Turns a recording (see recorder.c) back into the debug log format, oldest
+// record first. Only ever used offline or on demand, never from the hooks.
+
+#define NAME_OR_UNKNOWN(names, i) ((i) < sizeof(names) / sizeof(names[0]) ? names[i] : "???")
+
+/* @return number of records printed */
+int print_flight_log(struct FlightHeader * header, FILE * file)
 {
-    if (!g_debug) return;
-    log_indent_level--;
-    if (block_input) {
-        print_log_prefix();
-        printf("#blocked-input# %s %s",
-            friendly_virt_code_name(virt_code),
-            fmt_dir(dir));
+    struct FlightRecord * records = (struct FlightRecord *)(header + 1);
+    uint32_t head = header->head;
+    // When full, the oldest slot is the one a crash may have left half written
+    uint32_t start = head >= FLIGHT_RECORDS ? head - FLIGHT_RECORDS + 1 : 0;
+    int count = 0;
+    for (uint32_t i = start; i != head; i++) {
+        struct FlightRecord * record = &records[i & (FLIGHT_RECORDS - 1)];
+        if (record->index != i) continue;
+        struct LogRecord log = {0};
+        log.indent = record->indent;
+        log.scan_code = record->scan_code;
+        log.virt_code = record->virt_code;
+        log.dir = record->dir;
+        switch (record->type) {
+        case FLIGHT_START:
+            fprintf(file, "\n--- recording started (unix time %u) ---", record->time);
+            continue;
+        case FLIGHT_INPUT:
+            log.type = LOG_INPUT;
+            break;
+        case FLIGHT_BLOCKED_INPUT:
+            log.type = LOG_BLOCKED_INPUT;
+            break;
+        case FLIGHT_SEND_INPUT:
+            log.type = LOG_SEND_INPUT;
+            log.label = NAME_OR_UNKNOWN(output_label_names, record->label);
+            log.key_name = friendly_virt_code_name(record->virt_code);
+            break;
+        case FLIGHT_STATE:
+            log.type = LOG_STATE;
+            log.label = NAME_OR_UNKNOWN(state_names, record->dir);
+            log.key_name = friendly_virt_code_name(record->virt_code);
+            break;
+        default:
+            continue;
+        }
+        print_log_record(file, ++count, &log);
     }
+    fprintf(file, "\n");
+    return count;
 }
 
-void log_send_input(char * remap_name, KEY_DEF * key, int dir)
+// Stats
+// --------------------------------------
+
+void reset_stats(struct Engine * engine)
 {
-    if (!g_debug) return;
-    print_log_prefix();
-    printf("(sending:%s) %s %s",
-        remap_name,
-        key ? key->name : "???",
-        fmt_dir(dir));
+    memset(&engine->stats, 0, sizeof(engine->stats));
+    for (int i = 0; i < engine->table->remap_slot_count; i++) {
+        engine->table->remap_slots[i]->with_other_count = 0;
+        engine->table->remap_slots[i]->when_alone_count = 0;
+        engine->table->remap_slots[i]->double_tap_count = 0;
+    }
 }
 
 // Remapping
 // -------------------------------------
 
+void on_hold_timeout(struct Timer * timer, void * arg);
+void on_double_tap_timeout(struct Timer * timer, void * arg);
+
 struct Remap * new_remap(KEY_DEF * from, KEY_DEF * to_when_alone, KEY_DEF * to_with_other)
 {
     struct Remap * remap = malloc(sizeof(struct Remap));
     remap->from = from;
     remap->to_when_alone = to_when_alone;
     remap->to_with_other = to_with_other;
-    remap->state = IDLE;
+    remap->when_alone_macro.first = remap->when_alone_macro.count = 0;
+    remap->with_other_macro.first = remap->with_other_macro.count = 0;
+    remap->layer = NULL;
+    remap->hold_timeout_ms = 0;
+    remap->tap_timeout_ms = 0;
+    remap->to_double_tap = NULL;
+    remap->double_tap_ms = DEFAULT_DOUBLE_TAP_MS;
+    remap->slot = -1;
+    remap->table = NULL;
+    remap->pressed_at = 0;
+    init_timer(&remap->hold_timer, on_hold_timeout);
+    init_timer(&remap->double_tap_timer, on_double_tap_timeout);
+    remap->with_other_count = 0;
+    remap->when_alone_count = 0;
+    remap->double_tap_count = 0;
     remap->next = NULL;
     return remap;
 }
 
-void register_remap(struct Remap * remap)
+void index_remap(struct RemapTable * table, struct Remap * remap)
+{
+    int virt_code = remap->from->virt_code;
+    if (virt_code >= 0 && virt_code < VIRT_CODE_INDEX_LEN && !table->slot_by_virt_code[virt_code]) {
+        remap->slot = table->remap_slot_count++;
+        table->slot_by_virt_code[virt_code] = (uint8_t)(remap->slot + 1);
+        table->slot_states[remap->slot] = IDLE;
+        table->remap_slots[remap->slot] = remap;
+    }
+
+    int scan_index = key_scan_code_index(remap->from->scan_code);
+    if (scan_index >= 0 && !table->remap_by_scan_code[scan_index]) {
+        table->remap_by_scan_code[scan_index] = table->remap_count + 1;
+    }
+    if (table->remap_count == table->remap_capacity) {
+        table->remap_capacity = table->remap_capacity ? table->remap_capacity * 2 : 16;
+        table->remaps = realloc(table->remaps, table->remap_capacity * sizeof(struct Remap *));
+    }
+    table->remaps[table->remap_count++] = remap;
+}
+
+void add_remap(struct RemapTable * table, struct Remap * remap)
 {
-    if (g_remap_list) {
-        struct Remap * tail = g_remap_list;
-        while (tail->next) tail = tail->next;
-        tail->next = remap;
+    remap->table = table;
+    index_remap(table, remap);
+
+    if (table->remap_tail) {
+        table->remap_tail->next = remap;
     } else {
-        g_remap_list = remap;
+        table->remap_list = remap;
     }
+    table->remap_tail = remap;
 }
 
-struct Remap * find_remap_for_virt_code(int virt_code)
+void register_remap(struct Engine * engine, struct Remap * remap)
 {
-    struct Remap * remap = g_remap_list;
-    while(remap) {
-        if (remap->from->virt_code == virt_code) {
-            return remap;
-        }
-        remap = remap->next;
+    add_remap(engine->table, remap);
+}
+
+/* @return slot, -1 if the key isn't remapped */
+int find_slot_for_virt_code(struct RemapTable * table, int virt_code)
+{
+    if (virt_code < 0 || virt_code >= VIRT_CODE_INDEX_LEN) return -1;
+    return table->slot_by_virt_code[virt_code] - 1;
+}
+
+struct Remap * find_remap_for_virt_code(struct Engine * engine, int virt_code)
+{
+    int slot = find_slot_for_virt_code(engine->table, virt_code);
+    return slot < 0 ? NULL : engine->table->remap_slots[slot];
+}
+
+struct Remap * find_remap_for_scan_code(struct Engine * engine, int scan_code)
+{
+    struct RemapTable * table = engine->table;
+    int index = key_scan_code_index(scan_code);
+    if (index < 0 || !table->remap_by_scan_code[index]) return NULL;
+    return table->remaps[table->remap_by_scan_code[index] - 1];
+}
+
+// Reloading
+// -------------------------------------
+
+// A reloaded config is parsed off the hook thread into a fresh table and
+// published through pending_table with a single pointer swap. The hook thread
+// adopts it at the start of the next input, so it never waits on the parser
+// and never sees a half built table.
+//
+// Remaps held at that moment must be released on the definition they were
+// pressed with, or a DOWN would be left without its UP. So the replaced table
+// keeps draining: key releases still go to its held remaps and other input
+// still counts against them. Once none are held the hook thread retires it,
+// handing retired tables back through reclaimable_tables for the reloading
+// thread to free. Each of those pointers only ever has one writer of non-NULL
+// values and one reader, which is what makes the hand-offs safe. Until every
+// table it replaced is back, the reloading thread wakes up every
+// RECLAIM_INTERVAL_MS to free them, rather than waiting for the next reload.
+//
+// The reverse happens too: a key that went through untouched may be remapped
+// by the time it repeats or is released. Those have to go through untouched
+// as well until the key is up, so the engine remembers which unremapped keys
+// are down.
+//
+// Settings other than remaps (debug) only take effect on restart.
+
+void set_passed_down(struct Engine * engine, int virt_code, int is_down)
+{
+    if (virt_code < 0 || virt_code >= VIRT_CODE_INDEX_LEN) return;
+    uint64_t bit = (uint64_t)1 << (virt_code % 64);
+    if (is_down) {
+        engine->passed_down[virt_code / 64] |= bit;
+    } else {
+        engine->passed_down[virt_code / 64] &= ~bit;
     }
-    return NULL;
 }
 
-void send_key_def_input(char * input_name, KEY_DEF * key_def, enum Direction dir)
+int is_passed_down(struct Engine * engine, int virt_code)
 {
-    log_send_input(input_name, key_def, dir);
-    send_input(key_def->scan_code, key_def->virt_code, dir);
+    return virt_code >= 0 && virt_code < VIRT_CODE_INDEX_LEN &&
+        (engine->passed_down[virt_code / 64] >> (virt_code % 64)) & 1;
 }
 
-/* @return block_input */
-int event_remapped_key_down(struct Remap * remap)
+void hand_over_retired_tables(struct Engine * engine)
 {
-    if (remap->state == IDLE) {
-        remap->state = HELD_DOWN_ALONE;
+    if (engine->retired && !atomic_load_pointer(&engine->reclaimable_tables)) {
+        atomic_store_pointer(&engine->reclaimable_tables, engine->retired);
+        engine->retired = NULL;
     }
-    return 1;
 }
 
-/* @return block_input */
-int event_remapped_key_up(struct Remap * remap)
+void retire_remap_table(struct Engine * engine, struct RemapTable * table)
+{
+    table->next = engine->retired;
+    engine->retired = table;
+}
+
+void adopt_pending_table(struct Engine * engine)
 {
-    if (remap->state == HELD_DOWN_WITH_OTHER) {
-        remap->state = IDLE;
-        send_key_def_input("with_other", remap->to_with_other, UP);
+    // Chord candidates are indices into the old table's chords, settle the
+    // held back keys while they still mean something
+    release_held_back_keys(engine);
+    struct RemapTable * table = atomic_exchange_pointer(&engine->pending_table, NULL);
+    struct RemapTable * replaced = engine->table;
+    engine->table = table;
+    if (replaced->held_count) {
+        replaced->next = engine->draining;
+        engine->draining = replaced;
     } else {
-        remap->state = IDLE;
-        send_key_def_input("when_alone", remap->to_when_alone, DOWN);
-        send_key_def_input("when_alone", remap->to_when_alone, UP);
+        retire_remap_table(engine, replaced);
     }
-    return 1;
+    hand_over_retired_tables(engine);
 }
 
-/* @return block_input */
-int event_other_input()
+void retire_drained_tables(struct Engine * engine)
 {
-    struct Remap * remap = g_remap_list;
-    while(remap) {
-        if (remap->state == HELD_DOWN_ALONE) {
-            remap->state = HELD_DOWN_WITH_OTHER;
-            send_key_def_input("with_other", remap->to_with_other, DOWN);
+    struct RemapTable ** link = &engine->draining;
+    while (*link) {
+        struct RemapTable * table = *link;
+        if (table->held_count) {
+            link = &table->next;
+        } else {
+            *link = table->next;
+            retire_remap_table(engine, table);
         }
-        remap = remap->next;
     }
-    return 0;
+    hand_over_retired_tables(engine);
 }
 
-
-/* @return block_input */
-int handle_input(int scan_code, int virt_code, int direction, int is_injected)
+// The slot of a held remap from a replaced table, if the input releases (or
+// repeats) one
+/* @return slot, -1 if there is none */
+int find_draining_slot(struct Engine * engine, int virt_code, struct RemapTable ** table)
 {
-    log_handle_input_start(scan_code, virt_code, direction, is_injected);
-    // Note: injected keys are never remapped to avoid complex nested scenarios
-    struct Remap * remap_for_input = is_injected ? NULL : find_remap_for_virt_code(virt_code);
-    int block_input = 0;
-
-    if (!remap_for_input) {
-        block_input = event_other_input(scan_code, virt_code, direction);
-    } else {
-        block_input = direction == DOWN
-            ? event_remapped_key_down(remap_for_input)
-            : event_remapped_key_up(remap_for_input);
+    for (struct RemapTable * draining = engine->draining; draining; draining = draining->next) {
+        int slot = find_slot_for_virt_code(draining, virt_code);
+        if (slot >= 0 && draining->slot_states[slot] != IDLE) {
+            *table = draining;
+            return slot;
+        }
     }
-    log_handle_input_end(scan_code, virt_code, direction, is_injected, block_input);
-    return block_input;
+    return -1;
 }
 
-// Config
-// ---------------------------------
+#define RECLAIM_INTERVAL_MS 500
 
-void trim_newline(char * str)
+// Called from the reloading thread. Frees whatever the hook thread retired.
+void reclaim_remap_tables(struct Engine * engine)
 {
-    str[strcspn(str, "\r\n")] = 0;
+    engine->unreclaimed_tables -= free_remap_tables(atomic_exchange_pointer(&engine->reclaimable_tables, NULL));
 }
 
-int parsee_is_valid()
+// Called from the reloading thread, which should call reclaim_remap_tables
+// every RECLAIM_INTERVAL_MS while this holds
+int has_unreclaimed_tables(struct Engine * engine)
 {
-    return g_remap_parsee &&
-        g_remap_parsee->from &&
-        g_remap_parsee->to_when_alone &&
-        g_remap_parsee->to_with_other;
+    return engine->unreclaimed_tables > 0;
 }
 
-/* @return error */
-int load_config_line(char * line, int linenum)
+// Called from the reloading thread. The table belongs to the engine afterwards.
+void publish_remap_table(struct Engine * engine, struct RemapTable * table)
 {
-    trim_newline(line);
+    reclaim_remap_tables(engine);
+    // A table published earlier but not adopted yet was never seen by the
+    // hook, the new one replaces the same table it would have
+    struct RemapTable * unadopted = atomic_exchange_pointer(&engine->pending_table, table);
+    if (!unadopted) engine->unreclaimed_tables++;
+    free_remap_tables(unadopted);
+}
 
-    // Ignore comments and empty lines
-    if (line[0] == '#' || line[0] == '\0') {
-        return 0;
-    }
+// Clock
+// -------------------------------------
 
-    // Handle config declaration
-    if (strstr(line, "debug=1")) {
-        g_debug = 1;
-        return 0;
-    }
-    if (strstr(line, "debug=0")) {
-        g_debug = 0;
-        return 0;
-    }
+// The engine keeps time by the timestamps of the inputs it is handed, in
+// milliseconds on whatever clock the backend's events come with. Remaps with
+// a hold timeout arm a timer on the engine's wheel which fires either when a
+// later input's timestamp passes it or when the backend calls run_timers
+// because the deadline from next_timer_deadline went by without any input.
+// Either way the output is queued like any other, so backends flush after.
 
-    // Handle key remappings
-    char * after_eq = (char *)strchr(line, '=');
-    if (!after_eq) {
-        printf("Config error (line %d): Couldn't understand '%s'.\n", linenum, line);
-        return 1;
-    }
-    char * key_name = after_eq + 1;
-    KEY_DEF * key_def = find_key_def_by_name(key_name);
-    if (!key_def) {
-        printf("Config error (line %d): Invalid key name '%s'.\n", linenum, key_name);
-        printf("Key names were changed in the most recent version. Please review review the wiki for the new names!\n");
-        return 1;
+void run_timers(struct Engine * engine, uint32_t time)
+{
+    // While timers are pending the clock only moves forward, timestamps from
+    // different sources don't always agree
+    if (!engine->timers.count || is_time_before(engine->now, time)) {
+        engine->now = time;
     }
+    advance_timer_wheel(&engine->timers, engine->now, engine);
+}
 
-    if (g_remap_parsee == NULL) {
-        g_remap_parsee = new_remap(NULL, NULL, NULL);
-    }
+/* @return whether a timer is pending */
+int next_timer_deadline(struct Engine * engine, uint32_t * deadline)
+{
+    return next_timer_expiry(&engine->timers, deadline);
+}
 
-    if (strstr(line, "remap_key=")) {
-        if (g_remap_parsee->from && !parsee_is_valid()) {
-            printf("Config error (line %d): Incomplete remapping.\n"
-                   "Each remapping must have a 'remap_key', 'when_alone', and 'with_other'.\n",
-                   linenum);
-            return 1;
-        }
-        g_remap_parsee->from = key_def;
-    } else if (strstr(line, "when_alone=")) {
-        g_remap_parsee->to_when_alone = key_def;
-    } else if (strstr(line, "with_other=")) {
-        g_remap_parsee->to_with_other = key_def;
-    } else {
-        after_eq[0] = 0;
-        printf("Config error (line %d): Invalid setting '%s'.\n", linenum, line);
-        return 1;
-    }
+// Output
+// -------------------------------------
 
-    if (parsee_is_valid()) {
-        register_remap(g_remap_parsee);
-        g_remap_parsee = NULL;
-    }
+// Hands the queued inputs to the backend. Backends call this once after each
+// handle_input, and only then: the engine never sends from inside it unless a
+// full batch has to make room.
+void flush_output(struct Engine * engine)
+{
+    if (!engine->output_batch.count) return;
+    // Only copy what was queued, the batch is mostly empty space
+    struct InputBatch batch;
+    batch.count = engine->output_batch.count;
+    memcpy(batch.events, engine->output_batch.events, batch.count * sizeof(struct InputEvent));
+    engine->output_batch.count = 0;
+    engine->send_input_batch(engine, &batch);
+}
 
-    return 0;
+int event_other_input(struct Engine * engine);
+
+unsigned int input_flags(int scan_code)
+{
+    return scan_code >> 8 == 0xE0 ? INPUT_EXTENDED : 0;
 }
 
-void reset_config()
+void queue_input(struct Engine * engine, int scan_code, int virt_code, enum Direction dir)
 {
-    free(g_remap_parsee);
-    g_remap_parsee = NULL;
-    while (g_remap_list) {
-        struct Remap * remap = g_remap_list;
-        g_remap_list = remap->next;
-        free(remap);
+    // Our output is other input to whatever is held alone, see Echoes. It is
+    // applied ahead of the output itself, where handling the echo used to put
+    // anything it generated.
+    event_other_input(engine);
+    if (engine->output_batch.count == INPUT_BATCH_CAPACITY) {
+        flush_output(engine);
     }
-    g_remap_list = NULL;
+    struct InputEvent * event = &engine->output_batch.events[engine->output_batch.count++];
+    event->scan_code = scan_code;
+    event->virt_code = virt_code;
+    event->direction = dir;
+    event->seq = engine->next_echo_seq++ & ECHO_SEQ_MASK;
+    event->flags = input_flags(scan_code);
 }
+
+// Queues count events of a macro from the given one on, see Macros
+void queue_macro(struct Engine * engine, enum OutputLabel label, struct RemapTable * table, struct Macro * macro,
+    int from, int count)
+{
+    event_other_input(engine); // Once for the whole run, like queue_input
+    if (engine->output_batch.count + count > INPUT_BATCH_CAPACITY) {
+        flush_output(engine);
+    }
+    struct MacroEvent * events = &table->macro_events[macro->first + from];
+    for (int i = 0; i < count; i++) {
+        log_send_macro_event(engine, label, &events[i]);
+        struct InputEvent * event = &engine->output_batch.events[engine->output_batch.count++];
+        event->scan_code = events[i].scan_code;
+        event->virt_code = events[i].virt_code;
+        event->direction = events[i].direction;
+        event->seq = engine->next_echo_seq++ & ECHO_SEQ_MASK;
+        event->flags = events[i].flags;
+    }
+}
+
+// Echoes
+// -------------------------------------
+
+// Whatever we send comes straight back to the hooks as injected input, and
+// the Linux backend echoes its output to itself to match. All an echo means to
+// the engine, being other input to remaps held alone, was applied when the
+// output was queued. So echoes never reach handle_input: backends check them
+// first thing and let them through.
+//
+// Outputs are numbered as they are queued and the backend carries the number
+// along (in dwExtraInfo on Windows). The numbers still due back form a window
+// on a ring of ECHO_SEQ_MASK + 1, which makes the check constant time.
+
+/* @return whether seq is an output of ours still due back */
+int consume_echo(struct Engine * engine, uint32_t seq)
+{
+    engine->stats.events_seen++;
+    engine->stats.injected_ignored++;
+    uint32_t offset = (seq - engine->echo_head) & ECHO_SEQ_MASK;
+    uint32_t pending = (engine->next_echo_seq - engine->echo_head) & ECHO_SEQ_MASK;
+    if (offset >= pending) return 0;
+    engine->echo_head = seq + 1; // Anything before it isn't coming back
+    return 1;
+}
+
+void send_key_def_input(struct Engine * engine, enum OutputLabel label, KEY_DEF * key_def, enum Direction dir)
+{
+    log_send_input(engine, label, key_def, dir);
+    queue_input(engine, key_def->scan_code, key_def->virt_code, dir);
+}
+
+void send_when_alone(struct Engine * engine, struct Remap * remap)
+{
+    remap->when_alone_count++;
+    struct Macro * macro = &remap->when_alone_macro;
+    if (macro->count) {
+        queue_macro(engine, OUTPUT_WHEN_ALONE, remap->table, macro, 0, macro->count);
+    } else {
+        send_key_def_input(engine, OUTPUT_WHEN_ALONE, remap->to_when_alone, DOWN);
+        send_key_def_input(engine, OUTPUT_WHEN_ALONE, remap->to_when_alone, UP);
+    }
+}
+
+void send_with_other(struct Engine * engine, struct Remap * remap, enum Direction dir)
+{
+    struct Macro * macro = &remap->with_other_macro;
+    if (macro->count) {
+        int half = macro->count / 2;
+        queue_macro(engine, OUTPUT_WITH_OTHER, remap->table, macro, dir == DOWN ? 0 : half, half);
+    } else {
+        send_key_def_input(engine, OUTPUT_WITH_OTHER, remap->to_with_other, dir);
+    }
+}
+
+void set_slot_state(struct Engine * engine, struct RemapTable * table, int slot, enum State state)
+{
+    table->slot_states[slot] = (uint8_t)state;
+    log_state_change(engine, table->remap_slots[slot]->from, slot, state);
+}
+
+void hold_with_other(struct Engine * engine, struct RemapTable * table, struct Remap * remap)
+{
+    unmark_held_alone(table, remap);
+    cancel_timer(&engine->timers, &remap->hold_timer);
+    set_slot_state(engine, table, remap->slot, HELD_DOWN_WITH_OTHER);
+    remap->with_other_count++;
+    if (remap->layer) {
+        engine->active_layer = remap->layer;
+        engine->layer_remap = remap;
+    } else {
+        send_with_other(engine, remap, DOWN);
+    }
+}
+
+void on_hold_timeout(struct Timer * timer, void * arg)
+{
+    struct Remap * remap = (struct Remap *)((char *)timer - offsetof(struct Remap, hold_timer));
+    if (remap->table->slot_states[remap->slot] == HELD_DOWN_ALONE) {
+        hold_with_other(arg, remap->table, remap);
+    }
+}
+
+int is_past_tap_timeout(struct Engine * engine, struct Remap * remap)
+{
+    return remap->tap_timeout_ms && engine->now - remap->pressed_at > (uint32_t)remap->tap_timeout_ms;
+}
+
+int is_double_tap_remap(struct Remap * remap)
+{
+    return remap->to_double_tap && remap->double_tap_ms;
+}
+
+// Sends the tap a TAPPED remap held back, see Double taps
+void send_single_tap(struct Engine * engine)
+{
+    struct Remap * remap = engine->tapped;
+    engine->tapped = NULL;
+    cancel_timer(&engine->timers, &remap->double_tap_timer);
+    set_slot_state(engine, remap->table, remap->slot, IDLE);
+    remap->table->held_count--;
+    engine->armed--;
+    send_when_alone(engine, remap);
+}
+
+void on_double_tap_timeout(struct Timer * timer, void * arg)
+{
+    struct Engine * engine = arg;
+    struct Remap * remap = (struct Remap *)((char *)timer - offsetof(struct Remap, double_tap_timer));
+    if (engine->tapped == remap) {
+        send_single_tap(engine);
+    }
+}
+
+/* @return block_input */
+int event_remapped_key_down(struct Engine * engine, struct RemapTable * table, int slot)
+{
+    struct Remap * remap = table->remap_slots[slot];
+    if (table->slot_states[slot] == TAPPED) {
+        // Still armed and held since the first tap
+        engine->tapped = NULL;
+        cancel_timer(&engine->timers, &remap->double_tap_timer);
+        set_slot_state(engine, table, slot, HELD_DOWN_DOUBLE_TAP);
+        remap->double_tap_count++;
+        send_key_def_input(engine, OUTPUT_DOUBLE_TAP, remap->to_double_tap, DOWN);
+        return 1;
+    }
+    if (table->slot_states[slot] != IDLE) return 1; // Autorepeat
+    set_slot_state(engine, table, slot, HELD_DOWN_ALONE);
+    mark_held_alone(table, remap);
+    table->held_count++;
+    engine->armed++;
+    remap->pressed_at = engine->now;
+    if (remap->hold_timeout_ms) {
+        arm_timer(&engine->timers, &remap->hold_timer, engine->now + remap->hold_timeout_ms);
+    }
+    return 1;
+}
+
+/* @return block_input */
+int event_remapped_key_up(struct Engine * engine, struct RemapTable * table, int slot)
+{
+    struct Remap * remap = table->remap_slots[slot];
+    enum State state = table->slot_states[slot];
+    unmark_held_alone(table, remap);
+    cancel_timer(&engine->timers, &remap->hold_timer);
+    if (state == HELD_DOWN_ALONE && is_double_tap_remap(remap) && !is_past_tap_timeout(engine, remap)) {
+        // Stays held until the tap is decided
+        set_slot_state(engine, table, slot, TAPPED);
+        engine->tapped = remap;
+        arm_timer(&engine->timers, &remap->double_tap_timer, engine->now + remap->double_tap_ms);
+        return 1;
+    }
+    if (state != IDLE) {
+        set_slot_state(engine, table, slot, IDLE);
+        table->held_count--;
+        engine->armed--;
+    }
+    if (state == HELD_DOWN_WITH_OTHER && remap->layer) {
+        // A later layer key may have taken over
+        if (engine->layer_remap == remap) {
+            engine->active_layer = NULL;
+            engine->layer_remap = NULL;
+        }
+    } else if (state == HELD_DOWN_WITH_OTHER) {
+        send_with_other(engine, remap, UP);
+    } else if (state == HELD_DOWN_DOUBLE_TAP) {
+        send_key_def_input(engine, OUTPUT_DOUBLE_TAP, remap->to_double_tap, UP);
+    } else if (state == HELD_DOWN_ALONE && is_past_tap_timeout(engine, remap)) {
+        // Held too long to be a tap, a late Escape would only surprise
+    } else {
+        send_when_alone(engine, remap);
+    }
+    return 1;
+}
+
+void apply_other_input(struct Engine * engine, struct RemapTable * table)
+{
+    // Each send clears a bit, so re-read the set rather than iterating over a
+    // copy.
+    for (int i = 0; i < HELD_SET_WORDS; i++) {
+        while (table->held_alone[i]) {
+            struct Remap * remap = table->remap_slots[i * 64 + lowest_set_bit(table->held_alone[i])];
+            hold_with_other(engine, table, remap);
+        }
+    }
+}
+
+/* @return block_input */
+int event_other_input(struct Engine * engine)
+{
+    // The with_other inputs sent from here are other input too, but anything
+    // they would affect is next in line anyway
+    if (engine->applying_other_input) return 0;
+    engine->applying_other_input = 1;
+    for (struct RemapTable * table = engine->draining; table; table = table->next) {
+        if (table->held_alone_count) apply_other_input(engine, table);
+    }
+    if (engine->table->held_alone_count) apply_other_input(engine, engine->table);
+    engine->applying_other_input = 0;
+    return 0;
+}
+
+// Translates other input through the active layer, see Layers. Translated
+// keys keep the engine armed until they are released.
+/* @return block_input */
+int event_layer_input(struct Engine * engine, int virt_code, enum Direction dir)
+{
+    if (virt_code < 0 || virt_code >= VIRT_CODE_INDEX_LEN) return 0;
+    KEY_DEF * key = engine->layer_down[virt_code];
+    if (!key) {
+        if (dir == UP || !engine->active_layer) return 0;
+        key = engine->active_layer->keys[virt_code];
+        if (!key) return 0;
+        engine->layer_down[virt_code] = key;
+        engine->armed++;
+    } else if (dir == UP) {
+        engine->layer_down[virt_code] = NULL;
+        engine->armed--;
+    }
+    send_key_def_input(engine, OUTPUT_LAYER, key, dir);
+    return 1;
+}
+
+// Chords
+// -------------------------------------
+
+/* @return bit per chord the key is part of */
+uint32_t find_chords_for_virt_code(struct RemapTable * table, int virt_code)
+{
+    if (virt_code < 0 || virt_code >= VIRT_CODE_INDEX_LEN) return 0;
+    return table->chords_by_virt_code[virt_code];
+}
+
+int chord_window_ms(struct RemapTable * table)
+{
+    return table->chord_window_ms ? table->chord_window_ms : DEFAULT_CHORD_WINDOW_MS;
+}
+
+// Every candidate has all the held back keys, so one with as many is complete
+/* @return the completed chord, NULL if there is none */
+struct Chord * find_held_back_chord(struct Engine * engine, int * has_longer)
+{
+    struct Chord * complete = NULL;
+    *has_longer = 0;
+    for (uint32_t candidates = engine->chord_candidates; candidates; candidates &= candidates - 1) {
+        struct Chord * chord = &engine->table->chords[lowest_set_bit(candidates)];
+        if (chord->key_count == engine->held_back_count) complete = chord;
+        else *has_longer = 1;
+    }
+    return complete;
+}
+
+int is_held_back(struct Engine * engine, int virt_code)
+{
+    for (int i = 0; i < engine->held_back_count; i++) {
+        if (engine->held_back[i].virt_code == virt_code) return 1;
+    }
+    return 0;
+}
+
+void press_chord(struct Engine * engine, struct Chord * chord)
+{
+    engine->down_chord = *chord;
+    engine->down_chord_keys = (1 << chord->key_count) - 1;
+    engine->armed++;
+    engine->stats.chords_sent++;
+    send_key_def_input(engine, OUTPUT_CHORD, chord->to, DOWN);
+}
+
+// Sends the chord the held back keys complete, or else the keys themselves
+void release_held_back_keys(struct Engine * engine)
+{
+    if (!engine->held_back_count) return;
+    cancel_timer(&engine->timers, &engine->chord_timer);
+    int has_longer;
+    struct Chord * chord = find_held_back_chord(engine, &has_longer);
+    int count = engine->held_back_count;
+    engine->held_back_count = 0;
+    engine->armed--;
+    if (chord) {
+        press_chord(engine, chord);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        struct HeldBackKey * key = &engine->held_back[i];
+        uint32_t held_ms = engine->now - key->time;
+        if (held_ms > engine->stats.max_held_back_ms) engine->stats.max_held_back_ms = held_ms;
+        engine->stats.keys_held_back++;
+        // They went through after all, see Reloading
+        set_passed_down(engine, key->virt_code, 1);
+        log_send_input(engine, OUTPUT_HELD_BACK, find_key_def_by_virt_code(key->virt_code), DOWN);
+        queue_input(engine, key->scan_code, key->virt_code, DOWN);
+    }
+}
+
+void on_chord_timeout(struct Timer * timer, void * arg)
+{
+    (void)timer;
+    release_held_back_keys(arg);
+}
+
+/* @return whether the input belongs to the down chord */
+int event_down_chord_key(struct Engine * engine, int virt_code, enum Direction dir)
+{
+    struct Chord * chord = &engine->down_chord;
+    for (int i = 0; i < chord->key_count; i++) {
+        if (chord->keys[i]->virt_code != virt_code || !(engine->down_chord_keys & (1 << i))) continue;
+        if (dir == DOWN) return 1; // Autorepeat
+        // The chord's key goes up with the first of its keys
+        if (engine->down_chord_keys == (1 << chord->key_count) - 1) {
+            send_key_def_input(engine, OUTPUT_CHORD, chord->to, UP);
+        }
+        engine->down_chord_keys &= ~(1 << i);
+        if (!engine->down_chord_keys) {
+            chord->key_count = 0;
+            engine->armed--;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+int has_held_alone_layer_in(struct RemapTable * table)
+{
+    if (!table->held_alone_count) return 0;
+    for (int i = 0; i < HELD_SET_WORDS; i++) {
+        for (uint64_t held = table->held_alone[i]; held; held &= held - 1) {
+            if (table->remap_slots[i * 64 + lowest_set_bit(held)]->layer) return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether a remap held alone would activate a layer on other input
+int has_held_alone_layer(struct Engine * engine)
+{
+    for (struct RemapTable * table = engine->draining; table; table = table->next) {
+        if (has_held_alone_layer_in(table)) return 1;
+    }
+    return has_held_alone_layer_in(engine->table);
+}
+
+// Called for every input that isn't a remapped key, see Chords
+/* @return whether the input was taken, which blocks it */
+int event_chord_input(struct Engine * engine, int scan_code, int virt_code, enum Direction dir)
+{
+    uint32_t chords = 0;
+    if (dir == DOWN && !engine->down_chord.key_count && !is_passed_down(engine, virt_code)) {
+        chords = find_chords_for_virt_code(engine->table, virt_code);
+    }
+    if (chords && has_held_alone_layer(engine)) {
+        // The key is other input to the layer's remap, and the layer
+        // translates it rather than chording it
+        event_other_input(engine);
+    }
+    if (engine->active_layer) chords = 0;
+    if (chords && is_held_back(engine, virt_code)) return 1; // Autorepeat
+    if (engine->held_back_count && !(engine->chord_candidates & chords)) {
+        // Anything else settles the held back keys before it is handled itself
+        release_held_back_keys(engine);
+    }
+    if (engine->down_chord.key_count && event_down_chord_key(engine, virt_code, dir)) return 1;
+    if (!chords || engine->down_chord.key_count) return 0;
+
+    if (engine->held_back_count) {
+        engine->chord_candidates &= chords;
+    } else {
+        engine->chord_candidates = chords;
+        engine->armed++;
+        arm_timer(&engine->timers, &engine->chord_timer, engine->now + chord_window_ms(engine->table));
+    }
+    struct HeldBackKey * key = &engine->held_back[engine->held_back_count++];
+    key->scan_code = scan_code;
+    key->virt_code = virt_code;
+    key->time = engine->now;
+    int has_longer;
+    if (find_held_back_chord(engine, &has_longer) && !has_longer) {
+        release_held_back_keys(engine);
+    }
+    return 1;
+}
+
+
+// Fast path
+// -------------------------------------
+
+// Most input meets an engine with nothing held: other input then has nothing
+// to turn into with_other, and mouse input (the bulk of it while scrolling)
+// nothing to do at all. The engine keeps a single word, armed, that is
+// nonzero while any remap in any table is held down, whatever its state, or
+// TAPPED, any key translated by a layer is, or chord keys are held back or
+// down.
+// Hooks may skip the engine for other input while it is zero, and
+// handle_input only probes the dispatch index for a key then.
+//
+// Timers are only armed while the engine is, so skipping the clock is fine.
+
+int is_engine_armed(struct Engine * engine)
+{
+    return engine->armed != 0;
+}
+
+/* @return whether the input was handled */
+int handle_unarmed_input(struct Engine * engine, int scan_code, int virt_code, int direction, uint32_t time)
+{
+    if (engine->debug || atomic_load_pointer(&engine->pending_table) || engine->retired) return 0;
+    if (find_slot_for_virt_code(engine->table, virt_code) >= 0) return 0;
+    if (find_chords_for_virt_code(engine->table, virt_code)) return 0;
+    set_passed_down(engine, virt_code, direction == DOWN);
+    engine->now = time;
+    engine->stats.events_seen++;
+    if (engine->recorder) {
+        record_flight(engine->recorder, FLIGHT_INPUT, time, scan_code, virt_code, direction, 0, 0, 0);
+    }
+    return 1;
+}
+
+// Any inputs generated in response are queued, the caller is expected to
+// call flush_output once it is done with the event. Time is the event's
+// timestamp in milliseconds, see Clock.
+/* @return block_input */
+int handle_input(struct Engine * engine, int scan_code, int virt_code, int direction, uint32_t time)
+{
+    if (!engine->armed && handle_unarmed_input(engine, scan_code, virt_code, direction, time)) return 0;
+    long long start = now_ns();
+    run_timers(engine, time); // Due timers fire before the input
+    log_handle_input_start(engine, scan_code, virt_code, direction);
+    if (atomic_load_pointer(&engine->pending_table)) {
+        adopt_pending_table(engine);
+    }
+
+    struct RemapTable * table = engine->table;
+    int slot = -1;
+    if (engine->draining) {
+        slot = find_draining_slot(engine, virt_code, &table);
+    }
+    if (slot < 0) {
+        slot = find_slot_for_virt_code(table, virt_code);
+    }
+    if (slot >= 0 && table->slot_states[slot] == IDLE && is_passed_down(engine, virt_code)) {
+        slot = -1; // Pressed before a reload remapped it
+    }
+    if (engine->tapped && !(slot >= 0 && direction == DOWN && table->remap_slots[slot] == engine->tapped)) {
+        send_single_tap(engine); // Anything but the second tap decides it
+    }
+    int block_input = 0;
+
+    if (slot < 0 && event_chord_input(engine, scan_code, virt_code, direction)) {
+        block_input = 1;
+    } else if (slot < 0) {
+        set_passed_down(engine, virt_code, direction == DOWN);
+        event_other_input(engine);
+        block_input = event_layer_input(engine, virt_code, direction);
+    } else {
+        release_held_back_keys(engine);
+        set_passed_down(engine, virt_code, 0);
+        block_input = direction == DOWN
+            ? event_remapped_key_down(engine, table, slot)
+            : event_remapped_key_up(engine, table, slot);
+    }
+    if (engine->draining || engine->retired) {
+        retire_drained_tables(engine); // Also hands back what the reloading thread hadn't taken yet
+    }
+    log_handle_input_end(engine, scan_code, virt_code, direction, block_input);
+
+    struct Stats * stats = &engine->stats;
+    stats->events_seen++;
+    stats->events_blocked += block_input;
+    histogram_record(&stats->handle_input_ns, now_ns() - start);
+    return block_input;
+}
+
+void dump_stats(struct Engine * engine, FILE * file)
+{
+    struct Stats * stats = &engine->stats;
+    struct Histogram * histogram = &stats->handle_input_ns;
+    fprintf(file, "events seen: %llu\n", (unsigned long long)stats->events_seen);
+    fprintf(file, "events blocked: %llu\n", (unsigned long long)stats->events_blocked);
+    fprintf(file, "injected events ignored: %llu\n", (unsigned long long)stats->injected_ignored);
+    if (engine->table->chord_count) {
+        fprintf(file, "chords sent: %llu, keys held back: %llu, at most %u ms\n",
+            (unsigned long long)stats->chords_sent, (unsigned long long)stats->keys_held_back,
+            stats->max_held_back_ms);
+    }
+    fprintf(file, "handle_input ns: p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+        (unsigned long long)histogram_percentile(histogram, 50),
+        (unsigned long long)histogram_percentile(histogram, 90),
+        (unsigned long long)histogram_percentile(histogram, 99),
+        (unsigned long long)histogram_percentile(histogram, 99.9),
+        (unsigned long long)histogram->max);
+    for (int i = 0; i < engine->table->remap_slot_count; i++) {
+        struct Remap * remap = engine->table->remap_slots[i];
+        fprintf(file, "remap %s: when_alone %llu, with_other %llu",
+            remap->from->name,
+            (unsigned long long)remap->when_alone_count,
+            (unsigned long long)remap->with_other_count);
+        if (remap->to_double_tap) {
+            fprintf(file, ", double_tap %llu", (unsigned long long)remap->double_tap_count);
+        }
+        fprintf(file, "\n");
+    }
+}
+
+// Config
+// ---------------------------------
+
+// Configs are parsed in a single pass straight out of the buffer holding the
+// whole file. Each line is a comment, blank, or `setting=value` with optional
+// spaces around either side. Nothing is copied, lines may end in \n or \r\n
+// and the buffer doesn't have to be terminated.
+
+struct ConfigParser
+{
+    const char * pos;
+    const char * end;
+    const char * line_start;
+    int linenum;
+    int error_column; // Set when parsing fails
+};
+
+void init_config_parser(struct ConfigParser * parser, const char * data, size_t len, int linenum)
+{
+    parser->pos = data;
+    parser->end = data + len;
+    parser->line_start = data;
+    parser->linenum = linenum;
+    parser->error_column = 0;
+}
+
+int is_config_space(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+int at_config_line_end(struct ConfigParser * parser)
+{
+    return parser->pos == parser->end || *parser->pos == '\n' || *parser->pos == '\r';
+}
+
+void skip_config_spaces(struct ConfigParser * parser)
+{
+    while (parser->pos < parser->end && is_config_space(*parser->pos)) parser->pos++;
+}
+
+void skip_config_line(struct ConfigParser * parser)
+{
+    while (!at_config_line_end(parser)) parser->pos++;
+    if (parser->pos < parser->end && *parser->pos == '\r') parser->pos++;
+    if (parser->pos < parser->end && *parser->pos == '\n') parser->pos++;
+}
+
+int config_line_len(struct ConfigParser * parser)
+{
+    const char * eol = parser->line_start;
+    while (eol < parser->end && *eol != '\n' && *eol != '\r') eol++;
+    return (int)(eol - parser->line_start);
+}
+
+int config_name_is(const char * name, int len, const char * setting)
+{
+    return len == (int)strlen(setting) && memcmp(name, setting, len) == 0;
+}
+
+// Prints the start of an error message pointing at the given character,
+// the caller finishes the message
+void print_config_error(struct ConfigParser * parser, const char * at)
+{
+    parser->error_column = (int)(at - parser->line_start) + 1;
+    printf("Config error (line %d, column %d): ", parser->linenum, parser->error_column);
+}
+
+int parsee_is_valid(struct RemapTable * table)
+{
+    return table->remap_parsee &&
+        table->remap_parsee->from &&
+        (table->remap_parsee->to_when_alone || table->remap_parsee->when_alone_macro.count) &&
+        (table->remap_parsee->to_with_other || table->remap_parsee->layer ||
+            table->remap_parsee->with_other_macro.count);
+}
+
+int is_layer_name_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+}
+
+// Layers are created on first mention, a with_other may name one that is only
+// defined further down
+/* @return NULL if the name isn't valid */
+struct Layer * find_or_add_layer(struct RemapTable * table, struct ConfigParser * parser, const char * name,
+    int name_len)
+{
+    int is_valid = name_len > 0 && name_len <= MAX_LAYER_NAME_LEN;
+    for (int i = 0; i < name_len; i++) {
+        is_valid = is_valid && is_layer_name_char(name[i]);
+    }
+    if (!is_valid) {
+        print_config_error(parser, name);
+        printf("Invalid layer name '%.*s', layer names are up to %d letters, digits, '_' or '-'.\n",
+            name_len, name, MAX_LAYER_NAME_LEN);
+        return NULL;
+    }
+    struct Layer ** link = &table->layer_list;
+    while (*link && !config_name_is(name, name_len, (*link)->name)) {
+        link = &(*link)->next;
+    }
+    if (*link) return *link;
+    struct Layer * layer = calloc(1, sizeof(struct Layer));
+    memcpy(layer->name, name, name_len);
+    layer->first_use_line = parser->linenum;
+    *link = layer;
+    return layer;
+}
+
+/* @return error */
+int parse_config_layer(struct RemapTable * table, struct ConfigParser * parser, const char * value, int value_len)
+{
+    struct Layer * layer = find_or_add_layer(table, parser, value, value_len);
+    if (!layer) return 1;
+    if (layer->is_defined) {
+        print_config_error(parser, value);
+        printf("Layer '%s' is already defined.\n", layer->name);
+        return 1;
+    }
+    layer->is_defined = 1;
+    table->layer_parsee = layer;
+    return 0;
+}
+
+// Maps look like `map=KEY_H:LEFT` and apply to the layer defined last
+/* @return error */
+int parse_config_map(struct RemapTable * table, struct ConfigParser * parser, const char * name,
+    const char * value, int value_len)
+{
+    if (!table->layer_parsee) {
+        print_config_error(parser, name);
+        printf("'map' must come after the 'layer' it applies to.\n");
+        return 1;
+    }
+    const char * colon = memchr(value, ':', value_len);
+    if (!colon) {
+        print_config_error(parser, value);
+        printf("Invalid map '%.*s', maps look like 'map=KEY_H:LEFT'.\n", value_len, value);
+        return 1;
+    }
+    // Spaces around the colon are fine too
+    int from_len = (int)(colon - value);
+    while (from_len && is_config_space(value[from_len - 1])) from_len--;
+    const char * to = colon + 1;
+    while (to < value + value_len && is_config_space(*to)) to++;
+    int to_len = value_len - (int)(to - value);
+    KEY_DEF * from_key = find_key_def_by_name_len(value, from_len);
+    KEY_DEF * to_key = find_key_def_by_name_len(to, to_len);
+    if (!from_key || !to_key) {
+        const char * bad = from_key ? to : value;
+        int bad_len = from_key ? to_len : from_len;
+        print_config_error(parser, bad);
+        printf("Invalid key name '%.*s'.\n", bad_len, bad);
+        return 1;
+    }
+    if (from_key->virt_code < 0 || from_key->virt_code >= VIRT_CODE_INDEX_LEN) {
+        print_config_error(parser, value);
+        printf("Key '%s' can't be mapped in a layer.\n", from_key->name);
+        return 1;
+    }
+    table->layer_parsee->keys[from_key->virt_code] = to_key;
+    return 0;
+}
+
+// Chords look like `chord=KEY_J+KEY_K:ESCAPE`
+/* @return error */
+int parse_config_chord(struct RemapTable * table, struct ConfigParser * parser, const char * value, int value_len)
+{
+    const char * colon = memchr(value, ':', value_len);
+    if (!colon) {
+        print_config_error(parser, value);
+        printf("Invalid chord '%.*s', chords look like 'chord=KEY_J+KEY_K:ESCAPE'.\n", value_len, value);
+        return 1;
+    }
+    if (table->chord_count == MAX_CHORDS) {
+        print_config_error(parser, value);
+        printf("Too many chords, at most %d are supported.\n", MAX_CHORDS);
+        return 1;
+    }
+    struct Chord chord = {0};
+    const char * name = value;
+    while (name < colon) {
+        const char * name_end = name;
+        while (name_end < colon && *name_end != '+') name_end++;
+        int name_len = (int)(name_end - name);
+        while (name_len && is_config_space(name[name_len - 1])) name_len--;
+        KEY_DEF * key = find_key_def_by_name_len(name, name_len);
+        if (!key) {
+            print_config_error(parser, name);
+            printf("Invalid key name '%.*s'.\n", name_len, name);
+            return 1;
+        }
+        for (int i = 0; i < chord.key_count; i++) {
+            if (chord.keys[i]->virt_code == key->virt_code) key = NULL;
+        }
+        if (!key || key->virt_code < 0 || key->virt_code >= VIRT_CODE_INDEX_LEN || chord.key_count == MAX_CHORD_KEYS) {
+            print_config_error(parser, name);
+            printf("Invalid chord, chords are 2 to %d different keys.\n", MAX_CHORD_KEYS);
+            return 1;
+        }
+        chord.keys[chord.key_count++] = key;
+        name = name_end < colon ? name_end + 1 : colon;
+        while (name < colon && is_config_space(*name)) name++;
+    }
+    const char * to = colon + 1;
+    while (to < value + value_len && is_config_space(*to)) to++;
+    int to_len = value_len - (int)(to - value);
+    chord.to = find_key_def_by_name_len(to, to_len);
+    if (chord.key_count < 2) {
+        print_config_error(parser, value);
+        printf("Invalid chord, chords are 2 to %d different keys.\n", MAX_CHORD_KEYS);
+        return 1;
+    }
+    if (!chord.to) {
+        print_config_error(parser, to);
+        printf("Invalid key name '%.*s'.\n", to_len, to);
+        return 1;
+    }
+    for (int i = 0; i < chord.key_count; i++) {
+        table->chords_by_virt_code[chord.keys[i]->virt_code] |= (uint32_t)1 << table->chord_count;
+    }
+    table->chords[table->chord_count++] = chord;
+    return 0;
+}
+
+void add_macro_event(struct RemapTable * table, KEY_DEF * key, enum Direction dir)
+{
+    if (table->macro_event_count == table->macro_event_capacity) {
+        table->macro_event_capacity = table->macro_event_capacity ? table->macro_event_capacity * 2 : 64;
+        table->macro_events = realloc(table->macro_events,
+            table->macro_event_capacity * sizeof(struct MacroEvent));
+    }
+    struct MacroEvent * event = &table->macro_events[table->macro_event_count++];
+    event->scan_code = (uint16_t)key->scan_code;
+    event->virt_code = (uint8_t)key->virt_code;
+    event->direction = (uint8_t)dir;
+    event->flags = (uint8_t)input_flags(key->scan_code);
+}
+
+int is_macro_config(const char * value, int value_len)
+{
+    return memchr(value, '+', value_len) || memchr(value, ',', value_len);
+}
+
+// Combos are keys joined by '+' and sequences combos separated by ','. Each
+// combo is sent as its keys pressed in order and released in reverse.
+/* @return error */
+int parse_config_macro(struct RemapTable * table, struct ConfigParser * parser, const char * name, int name_len,
+    const char * value, int value_len, int allow_sequence, struct Macro * macro)
+{
+    KEY_DEF * combo[MAX_MACRO_EVENTS / 2];
+    int combo_len = 0;
+    macro->first = table->macro_event_count;
+    const char * pos = value;
+    const char * end = value + value_len;
+    while (1) {
+        while (pos < end && is_config_space(*pos)) pos++;
+        const char * key_name = pos;
+        while (pos < end && *pos != '+' && *pos != ',' && !is_config_space(*pos)) pos++;
+        KEY_DEF * key = find_key_def_by_name_len(key_name, (int)(pos - key_name));
+        if (!key) {
+            print_config_error(parser, key_name);
+            printf("Invalid key name '%.*s'.\n", (int)(pos - key_name), key_name);
+            break;
+        }
+        if (table->macro_event_count - macro->first + (combo_len + 1) * 2 > MAX_MACRO_EVENTS) {
+            print_config_error(parser, key_name);
+            printf("Too many keys, a macro can press at most %d.\n", MAX_MACRO_EVENTS / 2);
+            break;
+        }
+        combo[combo_len++] = key;
+        while (pos < end && is_config_space(*pos)) pos++;
+        if (pos < end && *pos == '+') {
+            pos++;
+            continue;
+        }
+        for (int i = 0; i < combo_len; i++) add_macro_event(table, combo[i], DOWN);
+        for (int i = combo_len - 1; i >= 0; i--) add_macro_event(table, combo[i], UP);
+        combo_len = 0;
+        if (pos == end) {
+            macro->count = table->macro_event_count - macro->first;
+            return 0;
+        }
+        if (!allow_sequence) {
+            print_config_error(parser, pos);
+            printf("'%.*s' can be a combo like CTRL+SHIFT but not a sequence.\n", name_len, name);
+            break;
+        }
+        pos++; // ','
+    }
+    table->macro_event_count = macro->first;
+    return 1;
+}
+
+#define MAX_CONFIG_TIMEOUT_MS 60000
+
+/* @return milliseconds, -1 if the value isn't a number up to max_ms */
+int parse_config_ms(const char * value, int value_len, int max_ms)
+{
+    int ms = 0;
+    for (int i = 0; i < value_len && ms <= max_ms; i++) {
+        if (value[i] < '0' || value[i] > '9') return -1;
+        ms = ms * 10 + (value[i] - '0');
+    }
+    return value_len && ms <= max_ms ? ms : -1;
+}
+
+// Timeouts and double taps apply to the remap whose remap_key came last
+/* @return remap, NULL if there is none */
+struct Remap * find_config_remap(struct RemapTable * table, struct ConfigParser * parser, const char * name,
+    int name_len)
+{
+    struct Remap * remap = table->remap_parsee ? table->remap_parsee : table->remap_tail;
+    if (!remap || !remap->from) {
+        print_config_error(parser, name);
+        printf("'%.*s' must come after the 'remap_key' it applies to.\n", name_len, name);
+        return NULL;
+    }
+    return remap;
+}
+
+/* @return error */
+int parse_config_timeout(struct RemapTable * table, struct ConfigParser * parser, const char * name, int name_len,
+    const char * value, int value_len)
+{
+    struct Remap * remap = find_config_remap(table, parser, name, name_len);
+    if (!remap) return 1;
+    int ms = parse_config_ms(value, value_len, MAX_CONFIG_TIMEOUT_MS);
+    if (ms < 0) {
+        print_config_error(parser, value);
+        printf("Invalid value '%.*s', %.*s must be a number of milliseconds up to %d (0 turns it off).\n",
+            value_len, value, name_len, name, MAX_CONFIG_TIMEOUT_MS);
+        return 1;
+    }
+    if (config_name_is(name, name_len, "hold_timeout_ms")) {
+        remap->hold_timeout_ms = ms;
+    } else if (config_name_is(name, name_len, "tap_timeout_ms")) {
+        remap->tap_timeout_ms = ms;
+    } else {
+        remap->double_tap_ms = ms;
+    }
+    return 0;
+}
+
+/* @return error */
+int parse_config_double_tap(struct RemapTable * table, struct ConfigParser * parser, const char * name,
+    int name_len, const char * value, int value_len)
+{
+    struct Remap * remap = find_config_remap(table, parser, name, name_len);
+    if (!remap) return 1;
+    KEY_DEF * key_def = find_key_def_by_name_len(value, value_len);
+    if (!key_def) {
+        print_config_error(parser, value);
+        printf("Invalid key name '%.*s'.\n", value_len, value);
+        return 1;
+    }
+    remap->to_double_tap = key_def;
+    return 0;
+}
+
+/* @return error */
+int parse_config_line(struct RemapTable * table, struct ConfigParser * parser)
+{
+    skip_config_spaces(parser);
+
+    // Ignore comments and empty lines
+    if (at_config_line_end(parser) || *parser->pos == '#') {
+        skip_config_line(parser);
+        return 0;
+    }
+
+    const char * name = parser->pos;
+    while (!at_config_line_end(parser) && *parser->pos != '=' && !is_config_space(*parser->pos)) {
+        parser->pos++;
+    }
+    int name_len = (int)(parser->pos - name);
+    skip_config_spaces(parser);
+    if (at_config_line_end(parser) || *parser->pos != '=') {
+        print_config_error(parser, parser->pos);
+        printf("Couldn't understand '%.*s'.\n", config_line_len(parser), parser->line_start);
+        return 1;
+    }
+    parser->pos++;
+    skip_config_spaces(parser);
+
+    const char * value = parser->pos;
+    while (!at_config_line_end(parser)) parser->pos++;
+    const char * value_end = parser->pos;
+    while (value_end > value && is_config_space(value_end[-1])) value_end--;
+    int value_len = (int)(value_end - value);
+    skip_config_line(parser);
+
+    // Handle config declaration
+    if (config_name_is(name, name_len, "debug")) {
+        if (config_name_is(value, value_len, "1")) {
+            table->debug = 1;
+        } else if (config_name_is(value, value_len, "0")) {
+            table->debug = 0;
+        } else {
+            print_config_error(parser, value);
+            printf("Invalid value '%.*s', debug must be 0 or 1.\n", value_len, value);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (config_name_is(name, name_len, "layer")) {
+        return parse_config_layer(table, parser, value, value_len);
+    }
+    if (config_name_is(name, name_len, "map")) {
+        return parse_config_map(table, parser, name, value, value_len);
+    }
+    if (config_name_is(name, name_len, "chord")) {
+        return parse_config_chord(table, parser, value, value_len);
+    }
+    if (config_name_is(name, name_len, "chord_window_ms")) {
+        int ms = parse_config_ms(value, value_len, MAX_CHORD_WINDOW_MS);
+        if (ms <= 0) {
+            print_config_error(parser, value);
+            printf("Invalid value '%.*s', chord_window_ms must be a number of milliseconds from 1 to %d.\n",
+                value_len, value, MAX_CHORD_WINDOW_MS);
+            return 1;
+        }
+        table->chord_window_ms = ms;
+        return 0;
+    }
+
+    if (config_name_is(name, name_len, "hold_timeout_ms") || config_name_is(name, name_len, "tap_timeout_ms") ||
+        config_name_is(name, name_len, "double_tap_ms")) {
+        return parse_config_timeout(table, parser, name, name_len, value, value_len);
+    }
+    if (config_name_is(name, name_len, "double_tap")) {
+        return parse_config_double_tap(table, parser, name, name_len, value, value_len);
+    }
+
+    // Handle key remappings
+    int is_remap_key = config_name_is(name, name_len, "remap_key");
+    int is_when_alone = config_name_is(name, name_len, "when_alone");
+    int is_with_other = config_name_is(name, name_len, "with_other");
+    if (!is_remap_key && !is_when_alone && !is_with_other) {
+        print_config_error(parser, name);
+        printf("Invalid setting '%.*s'.\n", name_len, name);
+        return 1;
+    }
+    struct Layer * layer = NULL;
+    KEY_DEF * key_def = NULL;
+    struct Macro macro = {0, 0};
+    int prefix_len = (int)strlen("layer:");
+    if (is_with_other && value_len >= prefix_len && memcmp(value, "layer:", prefix_len) == 0) {
+        layer = find_or_add_layer(table, parser, value + prefix_len, value_len - prefix_len);
+        if (!layer) return 1;
+    } else if (!is_remap_key && is_macro_config(value, value_len)) {
+        if (parse_config_macro(table, parser, name, name_len, value, value_len, is_when_alone, &macro)) return 1;
+    } else {
+        key_def = find_key_def_by_name_len(value, value_len);
+    }
+    if (!key_def && !layer && !macro.count) {
+        print_config_error(parser, value);
+        printf("Invalid key name '%.*s'.\n", value_len, value);
+        printf("Key names were changed in the most recent version. Please review review the wiki for the new names!\n");
+        return 1;
+    }
+
+    if (table->remap_parsee == NULL) {
+        table->remap_parsee = new_remap(NULL, NULL, NULL);
+    }
+
+    if (is_remap_key) {
+        if (table->remap_parsee->from && !parsee_is_valid(table)) {
+            print_config_error(parser, name);
+            printf("Incomplete remapping.\n"
+                   "Each remapping must have a 'remap_key', 'when_alone', and 'with_other'.\n");
+            return 1;
+        }
+        table->remap_parsee->from = key_def;
+    } else if (is_when_alone) {
+        table->remap_parsee->to_when_alone = key_def;
+        table->remap_parsee->when_alone_macro = macro;
+    } else {
+        table->remap_parsee->to_with_other = key_def;
+        table->remap_parsee->layer = layer;
+        table->remap_parsee->with_other_macro = macro;
+    }
+
+    if (parsee_is_valid(table)) {
+        add_remap(table, table->remap_parsee);
+        table->remap_parsee = NULL;
+    }
+
+    return 0;
+}
+
+/* @return error */
+int parse_config(struct RemapTable * table, struct ConfigParser * parser)
+{
+    while (parser->pos < parser->end) {
+        parser->line_start = parser->pos;
+        if (parse_config_line(table, parser)) {
+            return 1;
+        }
+        parser->linenum++;
+    }
+    for (struct Layer * layer = table->layer_list; layer; layer = layer->next) {
+        if (!layer->is_defined) {
+            printf("Config error (line %d): Layer '%s' is used but never defined.\n",
+                layer->first_use_line, layer->name);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Loading parses straight into the engine's table, before any input arrives
+/* @return error */
+int load_config_buffer(struct Engine * engine, const char * data, size_t len)
+{
+    struct ConfigParser parser;
+    init_config_parser(&parser, data, len, 1);
+    int err = parse_config(engine->table, &parser);
+    engine->debug = engine->table->debug;
+    return err;
+}
+
+/* @return error */
+int load_config_line(struct Engine * engine, char * line, int linenum)
+{
+    struct ConfigParser parser;
+    init_config_parser(&parser, line, strlen(line), linenum);
+    int err = parse_config_line(engine->table, &parser);
+    engine->debug = engine->table->debug;
+    return err;
+}
+
+// Reloading parses into a new table and publishes it once it is complete.
+// A config with errors is ignored and the current one stays.
+/* @return error */
+int reload_config_buffer(struct Engine * engine, const char * data, size_t len)
+{
+    struct ConfigParser parser;
+    struct RemapTable * table = new_remap_table();
+    init_config_parser(&parser, data, len, 1);
+    if (parse_config(table, &parser)) {
+        free_remap_tables(table);
+        return 1;
+    }
+    publish_remap_table(engine, table);
+    return 0;
+}
+
+// Returns the engine to how new_engine left it, apart from stats and the
+// clock, freeing every table it holds. Fuzzing resets after each input and
+// would report anything left behind as a leak.
+void reset_config(struct Engine * engine)
+{
+    // Armed timers belong to remaps about to be freed
+    clear_timer_wheel(&engine->timers);
+    free_remap_tables(engine->table->next);
+    engine->table->next = NULL;
+    clear_remap_table(engine->table);
+    free_remap_tables(engine->draining);
+    free_remap_tables(engine->retired);
+    free_remap_tables(engine->pending_table);
+    free_remap_tables(engine->reclaimable_tables);
+    engine->draining = NULL;
+    engine->retired = NULL;
+    engine->pending_table = NULL;
+    engine->reclaimable_tables = NULL;
+    engine->unreclaimed_tables = 0;
+    memset(engine->passed_down, 0, sizeof(engine->passed_down));
+    memset(engine->layer_down, 0, sizeof(engine->layer_down));
+    engine->active_layer = NULL;
+    engine->layer_remap = NULL;
+    engine->tapped = NULL;
+    engine->held_back_count = 0;
+    engine->down_chord.key_count = 0;
+    engine->output_batch.count = 0;
+    engine->applying_other_input = 0;
+    engine->armed = 0;
+}
+
+// Either load_config_buffer or reload_config_buffer
+typedef int (*ConfigLoader)(struct Engine * engine, const char * data, size_t len);
+
+// For streams that can't be mapped (stdin, pipes) and files that may change
+// while we read them; reads them whole first
+/* @return error */
+int load_config_stream(struct Engine * engine, FILE * file, ConfigLoader load)
+{
+    size_t len = 0;
+    size_t capacity = 4096;
+    char * data = malloc(capacity);
+    size_t read;
+    while ((read = fread(data + len, 1, capacity - len, file)) > 0) {
+        len += read;
+        if (len == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
+    int err = load(engine, data, len);
+    free(data);
+    return err;
+}
+
+#endif
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "input.h"
+#include "keys.c"
+#include "remap.c"
+#include "trace.c"
+#include "timing.c"
+
+// Replays a recorded input trace (see trace.c) through the remap engine and
+// reports the resulting input stream along with per event latencies.
+//
+// usage: replay <config> <trace> [--expect <file>] [--max-p99 <ns>] [--repeat <n>]
+//
+// The output stream is what applications would end up seeing, one input per
+// line. With --expect it is compared against a previous run instead of being
+// printed, and with --max-p99 the run fails if the engine got too slow. Both
+// make the replay usable as a regression check.
+//
+// Injected events in the trace are the echoes of our own output and are
+// skipped; the replay generates them itself like the OS would. Timers fire at
+// their deadlines between events, like the backends fire them.
+//
+// With a config that has chords, the latencies of keys that aren't part of a
+// chord are reported on their own, along with how long chord keys were held
+// back. Replaying the same trace with and without chords shows what they cost
+// other keys.
+
+#define MAX_OUTPUT_LINE 64
+
+struct ReplayOutput
+{
+    struct InputEvent * events;
+    int count;
+    int capacity;
+};
+
+struct ReplayOutput g_output = {0};
+
+void record_output(int scan_code, int virt_code, enum Direction dir)
+{
+    if (g_output.count == g_output.capacity) {
+        g_output.capacity = g_output.capacity ? g_output.capacity * 2 : 1024;
+        g_output.events = realloc(g_output.events, g_output.capacity * sizeof(struct InputEvent));
+    }
+    struct InputEvent * event = &g_output.events[g_output.count++];
+    event->scan_code = scan_code;
+    event->virt_code = virt_code;
+    event->direction = dir;
+}
+
+void format_output(char * line, struct InputEvent * event)
+{
+    snprintf(line, MAX_OUTPUT_LINE, "0x%02x 0x%02x %s %s",
+        event->scan_code,
+        event->virt_code,
+        fmt_dir(event->direction),
+        friendly_virt_code_name(event->virt_code));
+}
+
+void replay_input(struct Engine * engine, int scan_code, int virt_code, enum Direction dir, uint32_t time)
+{
+    uint32_t deadline;
+    while (next_timer_deadline(engine, &deadline) && is_time_before(deadline, time)) {
+        run_timers(engine, deadline);
+        flush_output(engine);
+    }
+    int block_input = handle_input(engine, scan_code, virt_code, dir, time);
+    flush_output(engine);
+    if (!block_input) {
+        record_output(scan_code, virt_code, dir);
+    }
+}
+
+// Capture sent input, letting its echoes through like the hooks do
+void replay_batch(struct Engine * engine, struct InputBatch * batch)
+{
+    for (int i = 0; i < batch->count; i++) {
+        struct InputEvent * event = &batch->events[i];
+        consume_echo(engine, event->seq);
+        record_output(event->scan_code, event->virt_code, event->direction);
+    }
+}
+
+int load_config(struct Engine * engine, char * path)
+{
+    FILE * file = fopen(path, "r");
+    if (!file) {
+        printf("Cannot open configuration file '%s'.\n", path);
+        return 1;
+    }
+    int err = load_config_stream(engine, file, load_config_buffer);
+    fclose(file);
+    return err;
+}
+
+/* @return number of events read, -1 on error */
+int load_trace(char * path, struct TraceEvent ** events)
+{
+    FILE * file = fopen(path, "r");
+    if (!file) {
+        printf("Cannot open trace file '%s'.\n", path);
+        return -1;
+    }
+    int count = 0;
+    int capacity = 1024;
+    int linenum = 0;
+    int result;
+    *events = malloc(capacity * sizeof(struct TraceEvent));
+    while ((result = read_trace_event(file, &(*events)[count], &linenum)) == 1) {
+        if ((*events)[count].is_injected) continue;
+        if (++count == capacity) {
+            capacity *= 2;
+            *events = realloc(*events, capacity * sizeof(struct TraceEvent));
+        }
+    }
+    fclose(file);
+    if (result < 0) {
+        printf("Trace error (line %d): Couldn't understand event.\n", linenum);
+        return -1;
+    }
+    return count;
+}
+
+/* @return error */
+int compare_output(char * path)
+{
+    FILE * file = fopen(path, "r");
+    if (!file) {
+        printf("Cannot open expected output file '%s'.\n", path);
+        return 1;
+    }
+    char line[MAX_OUTPUT_LINE + 2];
+    char actual[MAX_OUTPUT_LINE] = "<END>";
+    int i = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (i < g_output.count) format_output(actual, &g_output.events[i]);
+        if (i >= g_output.count || strcmp(line, actual) != 0) {
+            printf("Output mismatch (line %d): expected '%s' but got '%s'.\n", i + 1, line, actual);
+            fclose(file);
+            return 1;
+        }
+        i++;
+    }
+    fclose(file);
+    if (i != g_output.count) {
+        format_output(actual, &g_output.events[i]);
+        printf("Output mismatch (line %d): expected <END> but got '%s'.\n", i + 1, actual);
+        return 1;
+    }
+    return 0;
+}
+
+int compare_latency(const void * a, const void * b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* @return p99 */
+long long print_latencies(char * label, long long * latencies, int samples)
+{
+    qsort(latencies, samples, sizeof(long long), compare_latency);
+    long long p50 = latencies[samples / 2];
+    long long p99 = latencies[(int)(samples * 0.99)];
+    long long max = latencies[samples - 1];
+    fprintf(stderr, "%d %s: p50 %lld ns, p99 %lld ns, max %lld ns\n", samples, label, p50, p99, max);
+    return p99;
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc < 3) {
+        printf("usage: replay <config> <trace> [--expect <file>] [--max-p99 <ns>] [--repeat <n>]\n");
+        return 2;
+    }
+    char * expect_path = NULL;
+    long long max_p99 = 0;
+    int repeat = 1;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--expect") == 0) {
+            expect_path = argv[i + 1];
+        } else if (strcmp(argv[i], "--max-p99") == 0) {
+            max_p99 = atoll(argv[i + 1]);
+        } else if (strcmp(argv[i], "--repeat") == 0) {
+            repeat = atoi(argv[i + 1]);
+        } else {
+            printf("Unknown option '%s'.\n", argv[i]);
+            return 2;
+        }
+    }
+
+    init_keys();
+    struct Engine * engine = new_engine(replay_batch, NULL);
+    if (load_config(engine, argv[1])) return 2;
+    struct TraceEvent * events;
+    int count = load_trace(argv[2], &events);
+    if (count < 0) return 2;
+
+    long long * latencies = malloc((count * repeat + 1) * sizeof(long long));
+    long long * other_latencies = malloc((count * repeat + 1) * sizeof(long long));
+    int samples = 0;
+    int other_samples = 0;
+    // Timeouts follow the recorded timestamps, each pass continues where the
+    // previous one ended
+    uint32_t span = count ? (uint32_t)(events[count - 1].time - events[0].time) + 1 : 0;
+    for (int r = 0; r < repeat; r++) {
+        // Only the first pass contributes to the output stream
+        int output_count = g_output.count;
+        for (int i = 0; i < count; i++) {
+            struct TraceEvent * event = &events[i];
+            long long start = now_ns();
+            replay_input(engine, event->scan_code, event->virt_code, event->direction,
+                (uint32_t)event->time + r * span);
+            latencies[samples] = now_ns() - start;
+            if (!find_chords_for_virt_code(engine->table, event->virt_code)) {
+                other_latencies[other_samples++] = latencies[samples];
+            }
+            samples++;
+        }
+        if (r > 0) g_output.count = output_count;
+    }
+
+    int failed = 0;
+    if (expect_path) {
+        failed |= compare_output(expect_path);
+    } else {
+        char line[MAX_OUTPUT_LINE];
+        for (int i = 0; i < g_output.count; i++) {
+            format_output(line, &g_output.events[i]);
+            printf("%s\n", line);
+        }
+    }
+
+    if (samples) {
+        long long p99 = print_latencies("events", latencies, samples);
+        if (engine->table->chord_count && other_samples) {
+            print_latencies("non-chord key events", other_latencies, other_samples);
+            fprintf(stderr, "%llu chords sent, %llu keys held back for at most %u ms\n",
+                (unsigned long long)engine->stats.chords_sent, (unsigned long long)engine->stats.keys_held_back,
+                engine->stats.max_held_back_ms);
+        }
+        if (max_p99 && p99 > max_p99) {
+            printf("Latency regression: p99 %lld ns exceeds %lld ns.\n", p99, max_p99);
+            failed = 1;
+        }
+    }
+
+    free_engine(engine);
+    return failed;
+}
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "input.h"
+#include "keys.c"
+#include "remap.c"
+#include "baked-config.h"
+
+// Tests that a baked config (see bake.c) behaves exactly like the same config
+// parsed. The Makefile bakes tests-bake.txt into baked-config.h first.
+
+#define MAX_STEP_OUTPUT 64
+
+struct Recording
+{
+    struct InputEvent events[MAX_STEP_OUTPUT];
+    int count;
+};
+
+struct Recording g_baked_output;
+struct Recording g_parsed_output;
+struct Engine g_baked_engine; // Static like in baked builds
+struct Engine * g_parsed_engine;
+
+void record_batch(struct Engine * engine, struct InputBatch * batch)
+{
+    struct Recording * recording = engine->context;
+    for (int i = 0; i < batch->count; i++) {
+        assert(("OWN ECHO", consume_echo(engine, batch->events[i].seq)));
+        assert(recording->count < MAX_STEP_OUTPUT);
+        recording->events[recording->count++] = batch->events[i];
+    }
+}
+
+// Feeds the same input to both engines and expects the same result
+void IN_BOTH(int virt_code, enum Direction dir, uint32_t time)
+{
+    KEY_DEF * key = find_key_def_by_virt_code(virt_code);
+    int scan_code = key ? key->scan_code : 0;
+    g_baked_output.count = 0;
+    g_parsed_output.count = 0;
+    int baked_block = handle_input(&g_baked_engine, scan_code, virt_code, dir, time);
+    int parsed_block = handle_input(g_parsed_engine, scan_code, virt_code, dir, time);
+    flush_output(&g_baked_engine);
+    flush_output(g_parsed_engine);
+    assert(("same block", baked_block == parsed_block));
+    assert(("same output count", g_baked_output.count == g_parsed_output.count));
+    for (int i = 0; i < g_baked_output.count; i++) {
+        struct InputEvent * baked = &g_baked_output.events[i];
+        struct InputEvent * parsed = &g_parsed_output.events[i];
+        assert(("same output", baked->scan_code == parsed->scan_code && baked->virt_code == parsed->virt_code &&
+            baked->direction == parsed->direction));
+    }
+}
+
+void TIME_BOTH(uint32_t time)
+{
+    g_baked_output.count = 0;
+    g_parsed_output.count = 0;
+    run_timers(&g_baked_engine, time);
+    run_timers(g_parsed_engine, time);
+    flush_output(&g_baked_engine);
+    flush_output(g_parsed_engine);
+    assert(("same timer output", g_baked_output.count == g_parsed_output.count));
+}
+
+void OK()
+{
+    printf("OK\n");
+}
+
+void SECTION(char * msg) {
+    printf("\n%s\n----------------------------------------------\n", msg);
+}
+
+int main()
+{
+    init_keys();
+    init_engine(&g_baked_engine, &g_baked_table, record_batch, &g_baked_output);
+    g_parsed_engine = new_engine(record_batch, &g_parsed_output);
+    assert(0 == load_config_buffer(g_parsed_engine, g_baked_config, strlen(g_baked_config)));
+    struct RemapTable * baked = g_baked_engine.table;
+    struct RemapTable * parsed = g_parsed_engine->table;
+
+    SECTION("Baked table matches the parsed one");
+    assert(("debug", baked->debug == parsed->debug && g_baked_engine.debug == g_parsed_engine->debug));
+    assert(("index", memcmp(baked->slot_by_virt_code, parsed->slot_by_virt_code, VIRT_CODE_INDEX_LEN) == 0));
+    assert(("states", memcmp(baked->slot_states, parsed->slot_states, MAX_REMAP_SLOTS) == 0));
+    assert(("slot count", baked->remap_slot_count == parsed->remap_slot_count));
+    assert(("remap count", baked->remap_count == parsed->remap_count));
+    assert(("scan index", memcmp(baked->remap_by_scan_code, parsed->remap_by_scan_code, sizeof(baked->remap_by_scan_code)) == 0));
+    struct Remap * baked_remap = baked->remap_list;
+    struct Remap * parsed_remap = parsed->remap_list;
+    for (int i = 0; i < baked->remap_count; i++) {
+        assert(("in order", baked->remaps[i] == baked_remap && parsed->remaps[i] == parsed_remap));
+        assert(("keys", baked_remap->from == parsed_remap->from &&
+            baked_remap->to_when_alone == parsed_remap->to_when_alone &&
+            baked_remap->to_with_other == parsed_remap->to_with_other &&
+            baked_remap->to_double_tap == parsed_remap->to_double_tap));
+        assert(("macros", memcmp(&baked_remap->when_alone_macro, &parsed_remap->when_alone_macro,
+            sizeof(struct Macro)) == 0 &&
+            memcmp(&baked_remap->with_other_macro, &parsed_remap->with_other_macro, sizeof(struct Macro)) == 0));
+        assert(("layer", !baked_remap->layer == !parsed_remap->layer &&
+            (!baked_remap->layer || strcmp(baked_remap->layer->name, parsed_remap->layer->name) == 0)));
+        assert(("timeouts", baked_remap->hold_timeout_ms == parsed_remap->hold_timeout_ms &&
+            baked_remap->tap_timeout_ms == parsed_remap->tap_timeout_ms &&
+            baked_remap->double_tap_ms == parsed_remap->double_tap_ms));
+        assert(("slot", baked_remap->slot == parsed_remap->slot));
+        assert(("own table", baked_remap->table == baked));
+        assert(("timers", baked_remap->hold_timer.on_expire == parsed_remap->hold_timer.on_expire &&
+            baked_remap->double_tap_timer.on_expire == parsed_remap->double_tap_timer.on_expire));
+        if (baked_remap->slot >= 0) assert(("slotted", baked->remap_slots[baked_remap->slot] == baked_remap));
+        baked_remap = baked_remap->next;
+        parsed_remap = parsed_remap->next;
+    }
+    assert(("list ends", baked_remap == NULL && parsed_remap == NULL));
+    assert(("tail", baked->remap_tail == baked->remaps[baked->remap_count - 1]));
+    struct Layer * baked_layer = baked->layer_list;
+    struct Layer * parsed_layer = parsed->layer_list;
+    while (baked_layer && parsed_layer) {
+        assert(("layer name", strcmp(baked_layer->name, parsed_layer->name) == 0));
+        assert(("layer keys", memcmp(baked_layer->keys, parsed_layer->keys, sizeof(baked_layer->keys)) == 0));
+        baked_layer = baked_layer->next;
+        parsed_layer = parsed_layer->next;
+    }
+    assert(("same layers", baked_layer == NULL && parsed_layer == NULL));
+    assert(("chord index", memcmp(baked->chords_by_virt_code, parsed->chords_by_virt_code,
+        sizeof(baked->chords_by_virt_code)) == 0));
+    assert(("chord count", baked->chord_count == parsed->chord_count));
+    for (int i = 0; i < baked->chord_count; i++) {
+        assert(("chord", baked->chords[i].key_count == parsed->chords[i].key_count &&
+            baked->chords[i].to == parsed->chords[i].to &&
+            memcmp(baked->chords[i].keys, parsed->chords[i].keys, sizeof(baked->chords[i].keys)) == 0));
+    }
+    assert(("chord window", baked->chord_window_ms == parsed->chord_window_ms));
+    assert(("macro event count", baked->macro_event_count == parsed->macro_event_count));
+    for (int i = 0; i < baked->macro_event_count; i++) {
+        struct MacroEvent * baked_event = &baked->macro_events[i];
+        struct MacroEvent * parsed_event = &parsed->macro_events[i];
+        assert(("macro event", baked_event->scan_code == parsed_event->scan_code &&
+            baked_event->virt_code == parsed_event->virt_code &&
+            baked_event->direction == parsed_event->direction && baked_event->flags == parsed_event->flags));
+    }
+    OK();
+
+    SECTION("Baked and parsed engines send the same output");
+    // Every remapped key, one that isn't and the mouse, with time passing in
+    // steps around the config's timeouts
+    int keys[] = {VK_CAPSLOCK, VK_TAB, VK_LEFT_SHIFT, VK_RIGHT_ALT, VK_ENTER, VK_KEY_H, VK_KEY_J, VK_KEY_K, MOUSE_DUMMY_VK};
+    int key_count = sizeof(keys) / sizeof(keys[0]);
+    srand(1);
+    uint32_t time = 0;
+    for (int i = 0; i < 200000; i++) {
+        time += rand() % 4 == 0 ? rand() % 400 : 0;
+        int pick = rand() % (key_count + 1);
+        if (pick == key_count) {
+            TIME_BOTH(time);
+        } else if (keys[pick] == MOUSE_DUMMY_VK) {
+            IN_BOTH(MOUSE_DUMMY_VK, DOWN, time);
+        } else {
+            IN_BOTH(keys[pick], rand() % 2 ? DOWN : UP, time);
+        }
+    }
+    for (int i = 0; i < key_count; i++) {
+        IN_BOTH(keys[i], UP, time);
+    }
+    assert(("released", !is_engine_armed(&g_baked_engine) && !is_engine_armed(g_parsed_engine)));
+    assert(("same counts", g_baked_engine.stats.events_seen == g_parsed_engine->stats.events_seen));
+    for (int slot = 0; slot < baked->remap_slot_count; slot++) {
+        assert(("same taps", baked->remap_slots[slot]->when_alone_count == parsed->remap_slots[slot]->when_alone_count));
+        assert(("same holds", baked->remap_slots[slot]->with_other_count == parsed->remap_slots[slot]->with_other_count));
+    }
+    OK();
+
+    free_engine(g_parsed_engine);
+    printf("\nGreat! All test passed successfully.\n");
+    return 0;
+}
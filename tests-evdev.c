@@ -0,0 +1,605 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "evdev.c"
+
+// Tests for the Linux backend. Pipes stand in for the grabbed keyboard and
+// the uinput device, so no hardware or privileges are needed.
+
+struct Engine * g_engine;
+int g_device[2];
+int g_sink[2];
+
+void setup_pipes()
+{
+    assert(pipe(g_device) == 0);
+    assert(pipe(g_sink) == 0);
+    fcntl(g_sink[0], F_SETFL, O_NONBLOCK);
+    g_evdev_output.fd = g_sink[1];
+}
+
+// Write a single input frame (key, msc, syn) like a real keyboard does and
+// let the backend handle everything that is pending
+void IN(int code, int value)
+{
+    struct input_event events[3] = {0};
+    events[0].type = EV_MSC;
+    events[0].code = MSC_SCAN;
+    events[1].type = EV_KEY;
+    events[1].code = code;
+    events[1].value = value;
+    events[2].type = EV_SYN;
+    events[2].code = SYN_REPORT;
+    assert(write(g_device[1], events, sizeof(events)) == sizeof(events));
+    assert(process_evdev_input(g_engine, g_device[0]) == 3);
+}
+
+void IN_REL(int code, int value)
+{
+    struct input_event event = {0};
+    event.type = EV_REL;
+    event.code = code;
+    event.value = value;
+    assert(write(g_device[1], &event, sizeof(event)) == sizeof(event));
+    assert(process_evdev_input(g_engine, g_device[0]) == 1);
+}
+
+// Expect the next output to be the given event followed by a SYN_REPORT
+void SEE_EVENT(int type, int code, int value)
+{
+    struct input_event events[2];
+    ssize_t len = read(g_sink[0], events, sizeof(events));
+    if (len != sizeof(events) || events[0].type != type || events[0].code != code || events[0].value != value) {
+        printf("Expected output %d:%d=%d but found ", type, code, value);
+        if (len == sizeof(events)) {
+            printf("%d:%d=%d\n", events[0].type, events[0].code, events[0].value);
+        } else {
+            printf("<EMPTY>\n");
+        }
+        assert(("OUTPUT", 0));
+    }
+    assert(("SYN", events[1].type == EV_SYN && events[1].code == SYN_REPORT));
+}
+
+void SEE(int code, int value)
+{
+    SEE_EVENT(EV_KEY, code, value);
+}
+
+// For output written by another thread
+void wait_for_output()
+{
+    struct pollfd sink = {.fd = g_sink[0], .events = POLLIN};
+    assert(("output", poll(&sink, 1, 1000) == 1));
+}
+
+void EMPTY()
+{
+    struct input_event event;
+    assert(("EMPTY", read(g_sink[0], &event, sizeof(event)) < 0));
+}
+
+void write_key(int fd, int code, int value)
+{
+    struct input_event events[2] = {0};
+    events[0].type = EV_KEY;
+    events[0].code = code;
+    events[0].value = value;
+    events[1].type = EV_SYN;
+    assert(write(fd, events, sizeof(events)) == sizeof(events));
+}
+
+void write_file(char * path, char * text)
+{
+    FILE * file = fopen(path, "w");
+    assert(file);
+    fputs(text, file);
+    fclose(file);
+}
+
+void wait_for_reloads(struct ConfigWatch * watch, long reloads)
+{
+    for (int i = 0; i < 500 && atomic_load_acquire(&watch->reloads) < reloads; i++) {
+        sleep_ms(10);
+    }
+    assert(("reloaded", atomic_load_acquire(&watch->reloads) >= reloads));
+}
+
+// Until the watch freed every table the engine replaced
+void wait_for_reclaim(struct Engine * engine)
+{
+    for (int i = 0; i < 500 && *(volatile int *)&engine->unreclaimed_tables; i++) {
+        sleep_ms(10);
+    }
+    assert(("reclaimed", !*(volatile int *)&engine->unreclaimed_tables));
+}
+
+// Until the shard reading the device holds a remapped key
+void wait_for_armed(struct EvdevShards * shards, int fd)
+{
+    struct EvdevShard * shard = shards->list;
+    while (shard && shard->fd != fd) shard = shard->next;
+    assert(shard);
+    for (int i = 0; i < 500 && !*(volatile int *)&shard->engine->armed; i++) {
+        sleep_ms(10);
+    }
+    assert(("armed", shard->engine->armed));
+}
+
+#define CAPS_TO_ESC "remap_key=CAPSLOCK\nwhen_alone=ESCAPE\nwith_other=CTRL\n"
+#define CAPS_TO_BKSP "remap_key=CAPSLOCK\nwhen_alone=BACKSPACE\nwith_other=SHIFT\n"
+
+// Rewrites the config as fast as it can, alternating between in-place
+// writes (which the watch may catch half done) and atomic renames
+struct ConfigStorm
+{
+    char * path;
+    char * tmp_path;
+    volatile long stop;
+};
+
+void config_storm_main(void * arg)
+{
+    struct ConfigStorm * storm = arg;
+    for (int i = 0; !atomic_load_acquire(&storm->stop); i++) {
+        char * text = i % 2 ? CAPS_TO_ESC : CAPS_TO_BKSP;
+        if (i % 4 < 2) {
+            write_file(storm->path, text);
+        } else {
+            write_file(storm->tmp_path, text);
+            rename(storm->tmp_path, storm->path);
+        }
+    }
+}
+
+// Reads back everything written so far and tracks which keys are down
+void drain_sink(int * down)
+{
+    struct input_event events[64];
+    ssize_t len;
+    while ((len = read(g_sink[0], events, sizeof(events))) > 0) {
+        for (int i = 0; i < len / (ssize_t)sizeof(struct input_event); i++) {
+            if (events[i].type != EV_KEY || events[i].value == 2) continue;
+            down[events[i].code] += events[i].value ? 1 : -1;
+            assert(("no release without press", down[events[i].code] >= 0));
+            assert(("no double press", down[events[i].code] <= 1));
+        }
+    }
+}
+
+int g_timer_fired = 0;
+int g_timer_closes_fd = -1;
+
+void on_test_timer()
+{
+    g_timer_fired++;
+    close(g_timer_closes_fd);
+}
+
+void OK()
+{
+    printf("OK\n");
+}
+
+void SECTION(char * msg) {
+    printf("\n%s\n----------------------------------------------\n", msg);
+}
+
+int main()
+{
+    init_keys();
+    init_evdev_keys();
+    g_engine = new_engine(send_evdev_batch, &g_evdev_output);
+    setup_pipes();
+
+    SECTION("Translates linux keycodes");
+    for (int i = 0; i < KEY_TABLE_LEN; i++) {
+        KEY_DEF * key = &key_table[i];
+        int code = g_evdev_code_by_virt_code[key->virt_code];
+        assert(("every key has a code", code));
+        assert(("round trips", g_evdev_key_by_code[code]->virt_code == key->virt_code));
+    }
+    assert(g_evdev_key_by_code[KEY_CAPSLOCK]->virt_code == VK_CAPSLOCK);
+    assert(g_evdev_key_by_code[KEY_RIGHTCTRL]->scan_code == SK_RIGHT_CTRL);
+    OK();
+
+    SECTION("Passthrough without config");
+    IN(KEY_A, 1);
+    IN(KEY_A, 2);
+    IN(KEY_A, 0);
+        SEE(KEY_A, 1);
+        SEE(KEY_A, 2);
+        SEE(KEY_A, 0);
+        EMPTY();
+    IN(KEY_PROG1, 1);
+        SEE(KEY_PROG1, 1);
+        EMPTY();
+    OK();
+
+    assert(0 == load_config_line(g_engine, "remap_key=CAPSLOCK", 1));
+    assert(0 == load_config_line(g_engine, "when_alone=ESCAPE", 2));
+    assert(0 == load_config_line(g_engine, "with_other=CTRL", 3));
+    assert(0 == load_config_line(g_engine, "remap_key=TAB", 4));
+    assert(0 == load_config_line(g_engine, "when_alone=TAB", 5));
+    assert(0 == load_config_line(g_engine, "with_other=ALT", 6));
+
+    SECTION("Remap when alone");
+    IN(KEY_CAPSLOCK, 1);
+    IN(KEY_CAPSLOCK, 2);
+        EMPTY();
+    IN(KEY_CAPSLOCK, 0);
+        SEE(KEY_ESC, 1);
+        SEE(KEY_ESC, 0);
+        EMPTY();
+    OK();
+
+    SECTION("Remap with other");
+    IN(KEY_CAPSLOCK, 1);
+    IN(KEY_J, 1);
+        SEE(KEY_LEFTCTRL, 1);
+        SEE(KEY_J, 1);
+    IN(KEY_J, 0);
+    IN(KEY_CAPSLOCK, 0);
+        SEE(KEY_J, 0);
+        SEE(KEY_LEFTCTRL, 0);
+        EMPTY();
+    OK();
+
+    SECTION("Our own output counts as other input");
+    IN(KEY_CAPSLOCK, 1);
+    IN(KEY_TAB, 1);
+    IN(KEY_TAB, 0);
+        SEE(KEY_LEFTCTRL, 1);
+        SEE(KEY_TAB, 1);
+        SEE(KEY_TAB, 0);
+    IN(KEY_CAPSLOCK, 0);
+        SEE(KEY_LEFTCTRL, 0);
+        EMPTY();
+    OK();
+
+    SECTION("Mouse input counts as other input");
+    IN(KEY_CAPSLOCK, 1);
+    IN_REL(REL_WHEEL, -1);
+        SEE(KEY_LEFTCTRL, 1);
+        SEE_EVENT(EV_REL, REL_WHEEL, -1);
+    IN(BTN_LEFT, 1);
+    IN(BTN_LEFT, 0);
+    IN(KEY_CAPSLOCK, 0);
+        SEE(BTN_LEFT, 1);
+        SEE(BTN_LEFT, 0);
+        SEE(KEY_LEFTCTRL, 0);
+        EMPTY();
+    OK();
+
+    SECTION("Writes everything from one read at once");
+    struct input_event events[6] = {0};
+    events[0].type = events[3].type = EV_KEY;
+    events[0].code = events[3].code = KEY_CAPSLOCK;
+    events[0].value = 1;
+    events[1].type = events[4].type = EV_SYN;
+    events[2].type = EV_KEY;
+    events[2].code = KEY_K;
+    events[2].value = 1;
+    assert(write(g_device[1], events, sizeof(events)) == sizeof(events));
+    assert(process_evdev_input(g_engine, g_device[0]) == 6);
+    struct input_event output[16];
+    assert(("one write", read(g_sink[0], output, sizeof(output)) == 6 * sizeof(struct input_event)));
+    assert(output[0].code == KEY_LEFTCTRL && output[0].value == 1);
+    assert(output[2].code == KEY_K && output[2].value == 1);
+    assert(output[4].code == KEY_LEFTCTRL && output[4].value == 0);
+    EMPTY();
+    OK();
+
+    SECTION("Reports end of input");
+    close(g_device[1]);
+    assert(process_evdev_input(g_engine, g_device[0]) == 0);
+    close(g_device[0]);
+    OK();
+
+    SECTION("Event loop multiplexes devices");
+    struct EvdevLoop loop;
+    assert(0 == init_evdev_loop(&loop, g_engine));
+    int laptop[2], external[2];
+    assert(pipe(laptop) == 0 && pipe(external) == 0);
+    assert(0 == add_evdev_device(&loop, laptop[0]));
+    assert(0 == add_evdev_device(&loop, external[0]));
+    assert(("idle loop sleeps", 0 == run_evdev_loop_once(&loop, 0)));
+        EMPTY();
+    // Holding CAPS on one keyboard applies to the other
+    write_key(laptop[1], KEY_CAPSLOCK, 1);
+    assert(0 == run_evdev_loop_once(&loop, 100));
+        EMPTY();
+    write_key(external[1], KEY_J, 1);
+    assert(0 == run_evdev_loop_once(&loop, 100));
+        SEE(KEY_LEFTCTRL, 1);
+        SEE(KEY_J, 1);
+        EMPTY();
+    write_key(external[1], KEY_J, 0);
+    assert(0 == run_evdev_loop_once(&loop, 100));
+    write_key(laptop[1], KEY_CAPSLOCK, 0);
+    assert(0 == run_evdev_loop_once(&loop, 100));
+        SEE(KEY_J, 0);
+        SEE(KEY_LEFTCTRL, 0);
+        EMPTY();
+    close(laptop[1]);
+    close(external[1]);
+    assert(0 == run_evdev_loop(&loop));
+    assert(("closed devices are dropped", loop.device_count == 0));
+    OK();
+
+    SECTION("Event loop timer");
+    int keyboard[2];
+    assert(pipe(keyboard) == 0);
+    assert(0 == add_evdev_device(&loop, keyboard[0]));
+    loop.on_timer = on_test_timer;
+    g_timer_closes_fd = keyboard[1];
+    arm_evdev_timer(&loop, 1000000);
+    // Runs until the timer closes the last device
+    assert(0 == run_evdev_loop(&loop));
+    assert(g_timer_fired == 1);
+    OK();
+
+    SECTION("Event loop fires engine timers");
+    loop.on_timer = NULL;
+    reset_config(g_engine);
+    assert(0 == load_config_line(g_engine, "remap_key=CAPSLOCK", 1));
+    assert(0 == load_config_line(g_engine, "when_alone=ESCAPE", 2));
+    assert(0 == load_config_line(g_engine, "with_other=CTRL", 3));
+    assert(0 == load_config_line(g_engine, "hold_timeout_ms=30", 4));
+    int held[2];
+    assert(pipe(held) == 0);
+    assert(0 == add_evdev_device(&loop, held[0]));
+    write_key(held[1], KEY_CAPSLOCK, 1);
+    assert(0 == run_evdev_loop_once(&loop, 100));
+        EMPTY();
+    assert(("armed", loop.has_engine_deadline));
+    // Nothing but the timer wakes the loop
+    assert(0 == run_evdev_loop_once(&loop, 1000));
+        SEE(KEY_LEFTCTRL, 1);
+        EMPTY();
+    write_key(held[1], KEY_CAPSLOCK, 0);
+    assert(0 == run_evdev_loop_once(&loop, 100));
+        SEE(KEY_LEFTCTRL, 0);
+        EMPTY();
+    close(held[1]);
+    assert(0 == run_evdev_loop(&loop));
+    OK();
+
+    SECTION("Event loop reads pointers");
+    reset_config(g_engine);
+    assert(0 == load_config_line(g_engine, "remap_key=CAPSLOCK", 1));
+    assert(0 == load_config_line(g_engine, "when_alone=ESCAPE", 2));
+    assert(0 == load_config_line(g_engine, "with_other=CTRL", 3));
+    int keys[2], mouse[2];
+    assert(pipe(keys) == 0 && pipe(mouse) == 0);
+    assert(0 == add_evdev_device(&loop, keys[0]));
+    assert(0 == add_evdev_pointer(&loop, mouse[0]));
+    // Clicks reach applications without us
+    write_key(mouse[1], BTN_LEFT, 1);
+    write_key(mouse[1], BTN_LEFT, 0);
+    assert(0 == run_evdev_loop_once(&loop, 100));
+        EMPTY();
+    write_key(keys[1], KEY_CAPSLOCK, 1);
+    assert(0 == run_evdev_loop_once(&loop, 100));
+        EMPTY();
+    write_key(mouse[1], BTN_LEFT, 1);
+    assert(0 == run_evdev_loop_once(&loop, 100));
+        SEE(KEY_LEFTCTRL, 1);
+        EMPTY();
+    write_key(mouse[1], BTN_LEFT, 0);
+    assert(0 == run_evdev_loop_once(&loop, 100));
+        EMPTY();
+    write_key(keys[1], KEY_CAPSLOCK, 0);
+    assert(0 == run_evdev_loop_once(&loop, 100));
+        SEE(KEY_LEFTCTRL, 0);
+        EMPTY();
+    close(mouse[1]);
+    assert(0 == run_evdev_loop_once(&loop, 100));
+    assert(("closed pointers are dropped", loop.pointer_count == 0 && loop.device_count == 1));
+    close(keys[1]);
+    assert(0 == run_evdev_loop(&loop));
+    OK();
+
+    SECTION("Event loop picks up new devices");
+    char dir[] = "/tmp/dual-key-remap-XXXXXX";
+    assert(mkdtemp(dir));
+    char fifo[64];
+    snprintf(fifo, sizeof(fifo), "%s/event7", dir);
+    assert(0 == watch_evdev_dir(&loop, dir));
+    assert(loop.device_count == 0);
+    assert(0 == mkfifo(fifo, 0600));
+    assert(0 == run_evdev_loop_once(&loop, 100));
+    assert(("hotplugged", loop.device_count == 1));
+    chmod(fifo, 0660);
+    assert(0 == run_evdev_loop_once(&loop, 100));
+    assert(("not added twice", loop.device_count == 1));
+    int plugged = open(fifo, O_WRONLY);
+    write_key(plugged, KEY_CAPSLOCK, 1);
+    write_key(plugged, KEY_CAPSLOCK, 0);
+    assert(0 == run_evdev_loop_once(&loop, 100));
+        SEE(KEY_ESC, 1);
+        SEE(KEY_ESC, 0);
+        EMPTY();
+    close(plugged);
+    assert(0 == run_evdev_loop_once(&loop, 100));
+    assert(("unplugged", loop.device_count == 0));
+    unlink(fifo);
+    rmdir(dir);
+    OK();
+
+    SECTION("Devices sharded on their own engines");
+    char laptop_config[] = "/tmp/dual-key-remap-laptop-XXXXXX";
+    char external_config[] = "/tmp/dual-key-remap-external-XXXXXX";
+    close(mkstemp(laptop_config));
+    close(mkstemp(external_config));
+    write_file(laptop_config, CAPS_TO_ESC);
+    write_file(external_config, CAPS_TO_BKSP);
+    struct EvdevShards shards;
+    assert(0 == init_evdev_shards(&shards, g_sink[1], laptop_config));
+    struct EvdevLoop sharded;
+    assert(0 == init_evdev_loop(&sharded, NULL));
+    assert(0 == attach_evdev_shards(&sharded, &shards));
+    assert(pipe(laptop) == 0 && pipe(external) == 0);
+    assert(0 == add_evdev_device(&sharded, laptop[0]));
+    shards.config_path = external_config;
+    shards.debug = 1; // Its log thread has to stop before the engine goes
+    assert(0 == add_evdev_device(&sharded, external[0]));
+    assert(shards.count == 2 && sharded.device_count == 2);
+    // Holding CAPS on one keyboard leaves the other alone
+    write_key(laptop[1], KEY_CAPSLOCK, 1);
+    write_key(external[1], KEY_J, 1);
+    wait_for_output();
+        SEE(KEY_J, 1);
+    write_key(external[1], KEY_J, 0);
+    wait_for_output();
+        SEE(KEY_J, 0);
+    write_key(laptop[1], KEY_CAPSLOCK, 0);
+    wait_for_output();
+        SEE(KEY_ESC, 1);
+        SEE(KEY_ESC, 0);
+    // Each has its own config
+    write_key(external[1], KEY_CAPSLOCK, 1);
+    write_key(external[1], KEY_CAPSLOCK, 0);
+    wait_for_output();
+        SEE(KEY_BACKSPACE, 1);
+        SEE(KEY_BACKSPACE, 0);
+        EMPTY();
+    // Every shard hears of clicks
+    assert(pipe(mouse) == 0);
+    assert(0 == add_evdev_pointer(&sharded, mouse[0]));
+    write_key(laptop[1], KEY_CAPSLOCK, 1);
+    wait_for_armed(&shards, laptop[0]);
+    write_key(mouse[1], BTN_LEFT, 1);
+    assert(0 == run_evdev_loop_once(&sharded, 1000));
+    wait_for_output();
+        SEE(KEY_LEFTCTRL, 1);
+    write_key(laptop[1], KEY_CAPSLOCK, 0);
+    wait_for_output();
+        SEE(KEY_LEFTCTRL, 0);
+        EMPTY();
+    close(mouse[1]);
+    assert(0 == run_evdev_loop_once(&sharded, 1000));
+    assert(("closed pointers are dropped", sharded.pointer_count == 0));
+    // A shard goes as soon as its device does
+    close(laptop[1]);
+    assert(0 == run_evdev_loop_once(&sharded, 1000));
+    assert(("unplugged", sharded.device_count == 1 && shards.list && !shards.list->next));
+    close(external[1]);
+    assert(0 == run_evdev_loop(&sharded));
+    assert(("closed devices are dropped", sharded.device_count == 0 && !shards.list));
+    stop_evdev_shards(&shards);
+    unlink(laptop_config);
+    unlink(external_config);
+    OK();
+
+    SECTION("Reloads the config when it changes");
+    assert(pipe(g_device) == 0);
+    char config_dir[] = "/tmp/dual-key-remap-XXXXXX";
+    assert(mkdtemp(config_dir));
+    char config_path[64], tmp_path[64];
+    snprintf(config_path, sizeof(config_path), "%s/config.txt", config_dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/config.tmp", config_dir);
+    write_file(config_path, CAPS_TO_ESC);
+    reset_config(g_engine);
+    assert(0 == load_config_file(g_engine, config_path));
+    struct ConfigWatch watch;
+    assert(0 == start_config_watch(&watch, g_engine, config_path));
+    // Held keys finish with the mapping they started with
+    IN(KEY_CAPSLOCK, 1);
+    IN(KEY_J, 1);
+        SEE(KEY_LEFTCTRL, 1);
+        SEE(KEY_J, 1);
+    write_file(config_path, CAPS_TO_BKSP);
+    wait_for_reloads(&watch, 1);
+    IN(KEY_J, 0);
+    IN(KEY_CAPSLOCK, 0);
+        SEE(KEY_J, 0);
+        SEE(KEY_LEFTCTRL, 0);
+        EMPTY();
+    IN(KEY_CAPSLOCK, 1);
+    IN(KEY_CAPSLOCK, 0);
+        SEE(KEY_BACKSPACE, 1);
+        SEE(KEY_BACKSPACE, 0);
+        EMPTY();
+    // The old table is freed without waiting for another reload
+    wait_for_reclaim(g_engine);
+    assert(("handed back", atomic_load_pointer(&g_engine->reclaimable_tables) == NULL));
+    // Other files in the directory are ignored
+    write_file(tmp_path, "remap_key=NOPE\n");
+    unlink(tmp_path);
+    IN(KEY_CAPSLOCK, 1);
+    IN(KEY_CAPSLOCK, 0);
+        SEE(KEY_BACKSPACE, 1);
+        SEE(KEY_BACKSPACE, 0);
+        EMPTY();
+    OK();
+
+    SECTION("Never strands a key during a reload storm");
+    struct ConfigStorm storm = {config_path, tmp_path, 0};
+    Thread storm_thread;
+    assert(0 == start_thread(&storm_thread, config_storm_main, &storm));
+    static int down[KEY_MAX + 1];
+    for (int i = 0; i < 20000; i++) {
+        IN(KEY_CAPSLOCK, 1);
+        if (i % 3) {
+            IN(KEY_J, 1);
+            IN(KEY_J, 0);
+        }
+        IN(KEY_CAPSLOCK, 0);
+        drain_sink(down);
+    }
+    atomic_store_release(&storm.stop, 1);
+    join_thread(storm_thread);
+    stop_config_watch(&watch);
+    assert(("reloaded during the storm", watch.reloads > 2));
+    for (int code = 0; code <= KEY_MAX; code++) {
+        assert(("every press was released", down[code] == 0));
+    }
+    close(g_device[0]);
+    close(g_device[1]);
+    unlink(config_path);
+    unlink(tmp_path);
+    rmdir(config_dir);
+    OK();
+
+    SECTION("Flight recording survives a crash");
+    char recording_path[] = "/tmp/dual-key-remap-flight-XXXXXX";
+    close(mkstemp(recording_path));
+    pid_t child = fork();
+    if (child == 0) {
+        struct FlightRecorder recorder;
+        assert(0 == map_flight_file(&recorder, recording_path));
+        g_engine->recorder = &recorder;
+        reset_config(g_engine);
+        assert(0 == load_config_line(g_engine, "remap_key=CAPSLOCK", 1));
+        assert(0 == load_config_line(g_engine, "when_alone=ESCAPE", 2));
+        assert(0 == load_config_line(g_engine, "with_other=CTRL", 3));
+        setup_pipes();
+        IN(KEY_CAPSLOCK, 1);
+        IN(KEY_CAPSLOCK, 0);
+        abort();
+    }
+    int status;
+    assert(waitpid(child, &status, 0) == child);
+    assert(("crashed", WIFSIGNALED(status)));
+    FILE * recording = fopen(recording_path, "rb");
+    struct FlightHeader * header = malloc(FLIGHT_FILE_SIZE);
+    assert(fread(header, 1, FLIGHT_FILE_SIZE, recording) == FLIGHT_FILE_SIZE);
+    fclose(recording);
+    assert(("valid", is_flight_recording(header)));
+    char flight_log[1024] = {0};
+    FILE * decoded = fmemopen(flight_log, sizeof(flight_log) - 1, "w");
+    assert(("all records", print_flight_log(header, decoded) == 8));
+    fclose(decoded);
+    assert(("tap recorded", strstr(flight_log, "(sending:when_alone) ESCAPE UP")));
+    free(header);
+    unlink(recording_path);
+    OK();
+
+    printf("\nGreat! All test passed successfully.\n");
+    return 0;
+}
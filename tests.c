@@ -15,6 +15,8 @@ struct Output
 };
 
 struct Output * g_output_list = NULL;
+struct Engine * g_engine;
+uint32_t g_time = 0; // The virtual clock all inputs are stamped with
 
 register_output(int scan_code, int virt_code, enum Direction dir)
 {
@@ -33,26 +35,55 @@ register_output(int scan_code, int virt_code, enum Direction dir)
     }
 }
 
-// Simulate input and pass it to our handler. If key is not swallowed, register
-// it for later test inspection.
-void simulate_input(int scan_code, int virt_code, enum Direction dir, int is_injected)
+int g_input_depth = 0;
+
+// Simulate input and pass it to our handler. Like the hook callbacks, flush
+// any generated output before the input itself is let through. If key is not
+// swallowed, register it for later test inspection.
+void simulate_input(int scan_code, int virt_code, enum Direction dir)
 {
-    int swallow_input = handle_input(scan_code, virt_code, dir, is_injected);
+    assert(("NO NESTED INPUT", ++g_input_depth == 1));
+    int swallow_input = handle_input(g_engine, scan_code, virt_code, dir, g_time);
+    flush_output(g_engine);
     if (!swallow_input) {
         register_output(scan_code, virt_code, dir);
     }
+    g_input_depth--;
+}
+
+int g_flush_count = 0;
+struct InputBatch g_last_batch;
+
+// Mock sending input through winapi, which hands it straight back to the hook.
+// The hook recognises its own output and lets it through.
+void send_input_batch(struct Engine * engine, struct InputBatch * batch)
+{
+    g_flush_count++;
+    g_last_batch = *batch;
+    for (int i = 0; i < batch->count; i++) {
+        struct InputEvent * event = &batch->events[i];
+        assert(("OWN ECHO", consume_echo(engine, event->seq)));
+        register_output(event->scan_code, event->virt_code, event->direction);
+    }
+}
+
+void SEE_BATCH(int flush_count, int event_count)
+{
+    assert(("FLUSH COUNT", g_flush_count == flush_count));
+    assert(("BATCH SIZE", flush_count == 0 || g_last_batch.count == event_count));
+    g_flush_count = 0;
 }
 
-// Mock sending input through winapi
-void send_input(int scan_code, int virt_code, enum Direction dir)
+void SEE_BATCHED(int index, KEY_DEF * key, enum Direction dir)
 {
-    simulate_input(scan_code, virt_code, dir, 1);
+    assert(("BATCHED VIRT CODE", g_last_batch.events[index].virt_code == key->virt_code));
+    assert(("BATCHED SCAN CODE", g_last_batch.events[index].scan_code == key->scan_code));
+    assert(("BATCHED DIR", g_last_batch.events[index].direction == dir));
 }
 
-// Simulates user input, notably has no is_injected flag set
 void user_input(int scan_code, int virt_code, enum Direction dir)
 {
-    simulate_input(scan_code, virt_code, dir, 0);
+    simulate_input(scan_code, virt_code, dir);
 }
 
 dump_outputs(char * msg)
@@ -75,6 +106,142 @@ dump_outputs(char * msg)
     }
 }
 
+// Flight recorder
+// --------------------------------------
+
+char g_flight_log[4096];
+
+// Decodes a recording through a temporary file, like the backends dump it
+char * flight_log_text(struct FlightRecorder * recorder)
+{
+    FILE * file = tmpfile();
+    print_flight_log(recorder->header, file);
+    rewind(file);
+    size_t len = fread(g_flight_log, 1, sizeof(g_flight_log) - 1, file);
+    g_flight_log[len] = 0;
+    fclose(file);
+    return g_flight_log;
+}
+
+// Log ring stress test
+// --------------------------------------
+
+#define STRESS_LOG_RECORDS 5000000
+
+struct LogRing g_stress_ring;
+volatile long g_stress_done = 0;
+long g_stress_popped = 0;
+long g_stress_gaps = 0;
+int g_stress_last = -1;
+
+void stress_log_consumer(void * arg)
+{
+    struct LogRecord record;
+    while (1) {
+        int done = atomic_load_acquire(&g_stress_done);
+        if (!log_ring_pop(&g_stress_ring, &record)) {
+            if (done) break;
+            continue;
+        }
+        assert(("LOG ORDER", record.scan_code > g_stress_last));
+        g_stress_gaps += record.scan_code - g_stress_last - 1;
+        g_stress_last = record.scan_code;
+        g_stress_popped++;
+    }
+}
+
+// Timer wheel
+// --------------------------------------
+
+#define WHEEL_TEST_TIMERS 2000
+
+struct Timer g_wheel_timers[WHEEL_TEST_TIMERS];
+uint32_t g_wheel_fired[WHEEL_TEST_TIMERS];
+int g_wheel_fired_count = 0;
+
+void record_wheel_timer(struct Timer * timer, void * arg)
+{
+    g_wheel_fired[g_wheel_fired_count++] = timer->expires;
+}
+
+// Parallel engines
+// --------------------------------------
+
+// Every thread drives its own engine through the same trace. Outputs are
+// recorded per engine through its context, so nothing is shared.
+
+#define PARALLEL_ENGINES 8
+#define PARALLEL_ROUNDS 20000
+
+struct ParallelRun
+{
+    struct Engine * engine;
+    struct InputEvent * outputs;
+    int output_count;
+    int output_capacity;
+};
+
+struct InputEvent g_parallel_trace[] = {
+    {.scan_code = SK_CAPSLOCK, .virt_code = VK_CAPSLOCK, .direction = DOWN},
+    {.scan_code = SK_CAPSLOCK, .virt_code = VK_CAPSLOCK, .direction = UP},
+    {.scan_code = SK_CAPSLOCK, .virt_code = VK_CAPSLOCK, .direction = DOWN},
+    {.scan_code = SK_ENTER, .virt_code = VK_ENTER, .direction = DOWN},
+    {.scan_code = SK_ENTER, .virt_code = VK_ENTER, .direction = UP},
+    {.scan_code = SK_TAB, .virt_code = VK_TAB, .direction = DOWN},
+    {.scan_code = SK_TAB, .virt_code = VK_TAB, .direction = UP},
+    {.scan_code = SK_CAPSLOCK, .virt_code = VK_CAPSLOCK, .direction = UP},
+    {.scan_code = SK_TAB, .virt_code = VK_TAB, .direction = DOWN},
+    {.scan_code = SK_CAPSLOCK, .virt_code = VK_CAPSLOCK, .direction = DOWN},
+    {.scan_code = SK_TAB, .virt_code = VK_TAB, .direction = UP},
+    {.scan_code = SK_CAPSLOCK, .virt_code = VK_CAPSLOCK, .direction = UP},
+};
+
+#define PARALLEL_TRACE_LEN (sizeof(g_parallel_trace) / sizeof(struct InputEvent))
+
+void record_parallel_output(struct ParallelRun * run, struct InputEvent * event)
+{
+    if (run->output_count == run->output_capacity) {
+        run->output_capacity = run->output_capacity ? run->output_capacity * 2 : 1024;
+        run->outputs = realloc(run->outputs, run->output_capacity * sizeof(struct InputEvent));
+    }
+    run->outputs[run->output_count] = *event;
+    run->outputs[run->output_count++].seq = 0; // Compared across runs
+}
+
+void parallel_input(struct Engine * engine, struct InputEvent * event)
+{
+    int block_input = handle_input(engine, event->scan_code, event->virt_code, event->direction, 0);
+    flush_output(engine);
+    if (!block_input) {
+        record_parallel_output(engine->context, event);
+    }
+}
+
+void send_parallel_batch(struct Engine * engine, struct InputBatch * batch)
+{
+    for (int i = 0; i < batch->count; i++) {
+        consume_echo(engine, batch->events[i].seq);
+        record_parallel_output(engine->context, &batch->events[i]);
+    }
+}
+
+void run_parallel_engine(void * arg)
+{
+    struct ParallelRun * run = arg;
+    run->engine = new_engine(send_parallel_batch, run);
+    assert(0 == load_config_line(run->engine, "remap_key=CAPSLOCK", 1));
+    assert(0 == load_config_line(run->engine, "when_alone=ESCAPE", 2));
+    assert(0 == load_config_line(run->engine, "with_other=CTRL", 3));
+    assert(0 == load_config_line(run->engine, "remap_key=TAB", 4));
+    assert(0 == load_config_line(run->engine, "when_alone=TAB", 5));
+    assert(0 == load_config_line(run->engine, "with_other=ALT", 6));
+    for (int round = 0; round < PARALLEL_ROUNDS; round++) {
+        for (int i = 0; i < PARALLEL_TRACE_LEN; i++) {
+            parallel_input(run->engine, &g_parallel_trace[i]);
+        }
+    }
+}
+
 // Test actions & assertions
 // --------------------------------------
 
@@ -88,6 +255,14 @@ void IN_MANUAL(int scan_code, int virt_code, int dir)
     user_input(scan_code, virt_code, dir);
 }
 
+// Lets time pass without input, firing timers like a backend would
+void WAIT(int ms)
+{
+    g_time += ms;
+    run_timers(g_engine, g_time);
+    flush_output(g_engine);
+}
+
 void SEE(KEY_DEF * key, enum Direction dir)
 {
     struct Output * head = g_output_list;
@@ -130,8 +305,11 @@ void SECTION(char * msg) {
     printf("\n----------------------------------------------\n");
 }
 
-void main()
+int main()
 {
+    init_keys();
+    g_engine = new_engine(send_input_batch, NULL);
+
     SECTION("Passthrough keys if no config");
     EMPTY();
     IN(ESC, DOWN);
@@ -144,46 +322,129 @@ void main()
     OK();
 
     SECTION("Helpful error messages");
-    assert(1 == load_config_line("invalid_setting=ESCAPE", 1));
-    assert(1 == load_config_line("remap_key=INVALID_KEY", 2));
-    assert(1 == load_config_line("remap_key::ESCAPE", 3));
-    assert(0 == load_config_line("remap_key=ESCAPE", 999));
-    assert(("Incomplete key", 1 == load_config_line("remap_key=ESCAPE", 4)));
-    reset_config();
+    assert(1 == load_config_line(g_engine, "invalid_setting=ESCAPE", 1));
+    assert(1 == load_config_line(g_engine, "remap_key=INVALID_KEY", 2));
+    assert(1 == load_config_line(g_engine, "remap_key::ESCAPE", 3));
+    assert(0 == load_config_line(g_engine, "remap_key=ESCAPE", 999));
+    assert(("Incomplete key", 1 == load_config_line(g_engine, "remap_key=ESCAPE", 4)));
+    reset_config(g_engine);
+    OK();
+
+    SECTION("Parses whole config buffers");
+    char config[] =
+        "# Comment\r\n"
+        "\r\n"
+        "  debug = 1\r\n"
+        "remap_key=CAPSLOCK\n"
+        "\twhen_alone = ESCAPE \n"
+        "with_other=ctrl";
+    assert(0 == load_config_buffer(g_engine, config, strlen(config)));
+    assert(("spaces and crlf", g_engine->debug == 1));
+    assert(("no trailing newline", find_remap_for_virt_code(g_engine, VK_CAPSLOCK)->to_with_other == CTRL));
+    assert(0 == load_config_buffer(g_engine, "debug=0", 7));
+    reset_config(g_engine);
+    // Only the given length is parsed
+    assert(0 == load_config_buffer(g_engine, "remap_key=CAPSLOCK\nbogus", 19));
+    reset_config(g_engine);
+
+    struct ConfigParser parser;
+    char * bad_lines[] = {
+        "xremap_key=CAPSLOCK",
+        "remap_keys=CAPSLOCK",
+        "remap_key=CAPSLOCKS",
+        "remap_key CAPSLOCK",
+        "debug=10",
+        "remap_key=CAPSLOCK # inline comments aren't supported",
+    };
+    int bad_columns[] = {1, 1, 11, 11, 7, 11};
+    for (int i = 0; i < 6; i++) {
+        init_config_parser(&parser, bad_lines[i], strlen(bad_lines[i]), 1);
+        assert(("rejected", 1 == parse_config(g_engine->table, &parser)));
+        assert(("column", parser.error_column == bad_columns[i]));
+        reset_config(g_engine);
+    }
+    char * bad_config = "remap_key=CAPSLOCK\nwhen_alone=ESCAPE\n\n  remap_key=TAB\n";
+    init_config_parser(&parser, bad_config, strlen(bad_config), 1);
+    assert(("incomplete", 1 == parse_config(g_engine->table, &parser)));
+    assert(("line", parser.linenum == 4));
+    assert(("column", parser.error_column == 3));
+    reset_config(g_engine);
+
+    char long_line[1024];
+    memset(long_line, ' ', sizeof(long_line));
+    memcpy(long_line + 900, "remap_key=TAB", 13);
+    assert(("no line length limit", 0 == load_config_buffer(g_engine, long_line, 913)));
+    assert(g_engine->table->remap_parsee->from == TAB);
+    reset_config(g_engine);
+    OK();
+
+    SECTION("Looks up keys by name and code");
+    for (int i = 0; i < KEY_TABLE_LEN; i++) {
+        KEY_DEF * key = &key_table[i];
+        assert(("by name", find_key_def_by_name(key->name) == key));
+        KEY_DEF * first_by_virt = key_table;
+        while (first_by_virt->virt_code != key->virt_code) first_by_virt++;
+        KEY_DEF * first_by_scan = key_table;
+        while (first_by_scan->scan_code != key->scan_code) first_by_scan++;
+        assert(("by virt code", find_key_def_by_virt_code(key->virt_code) == first_by_virt));
+        assert(("by scan code", find_key_def_by_scan_code(key->scan_code) == first_by_scan));
+    }
+    for (int i = 0; i < KEY_ALIASES_LEN; i++) {
+        assert(("alias", find_key_def_by_name(key_aliases[i].alias) == find_key_def_by_exact_name(key_aliases[i].name)));
+        assert(("alias", find_key_def_by_name(key_aliases[i].alias) != NULL));
+    }
+    for (int i = 1; i < KEY_NAMES_LEN; i++) {
+        assert(("names are unique", strcmp(g_key_names[i - 1].name, g_key_names[i].name) < 0));
+    }
+    assert(("ignores case", find_key_def_by_name("CapsLock") == CAPS));
+    assert(("ignores case", find_key_def_by_name("esc") == ESC));
+    assert(("ignores case", find_key_def_by_name("LCtrl") == find_key_def_by_name("LEFT_CTRL")));
+    assert(("unknown", find_key_def_by_name("CAPSLOCKS") == NULL));
+    assert(("unknown", find_key_def_by_name("") == NULL));
+    assert(("too long", find_key_def_by_name("CAPSLOCKCAPSLOCKCAPSLOCKCAPSLOCKCAPSLOCK") == NULL));
+    assert(("unknown", find_key_def_by_virt_code(0x100) == NULL));
+    assert(("unknown", find_key_def_by_virt_code(-1) == NULL));
+    assert(("unknown", find_key_def_by_scan_code(0xE0FF) == NULL));
+    assert(("unknown", find_key_def_by_scan_code(0xE11D) == NULL));
+    assert(0 == load_config_line(g_engine, "remap_key=CapsLock", 1));
+    assert(0 == load_config_line(g_engine, "when_alone=esc", 2));
+    assert(0 == load_config_line(g_engine, "with_other=LCTRL", 3));
+    assert(("aliases in config", find_remap_for_virt_code(g_engine, VK_CAPSLOCK)->to_when_alone == ESC));
+    reset_config(g_engine);
     OK();
 
     SECTION("Registers remappings from config");
-    assert(("debug off by default", g_debug == 0));
-    assert(0 == load_config_line("debug=1", 0));
-    assert(("config turns debug on", g_debug == 1));
-    assert(0 == load_config_line("debug=0", 0));
-    assert(("config turns debug off", g_debug == 0));
-
-    assert(0 == load_config_line("# Comments are ignored", 0));
-    assert(0 == load_config_line("", 0));
-    assert(0 == load_config_line("remap_key=CAPSLOCK", 0));
-    assert(0 == load_config_line("when_alone=ESCAPE", 0));
-    assert(0 == load_config_line("with_other=CTRL", 0));
-
-    assert(0 == load_config_line("remap_key=TAB", 0));
-    assert(0 == load_config_line("when_alone=TAB", 0));
-    assert(0 == load_config_line("with_other=ALT", 0));
-
-    assert(0 == load_config_line("remap_key=SHIFT", 0));
-    assert(0 == load_config_line("when_alone=SPACE", 0));
-    assert(0 == load_config_line("with_other=SHIFT", 0));
-
-    assert(("registered first", g_remap_list->from == CAPS));
-    assert(("registered first", g_remap_list->to_when_alone == ESC));
-    assert(("registered first", g_remap_list->to_with_other == CTRL));
-
-    assert(("registered second", g_remap_list->next->from == TAB));
-    assert(("registered second", g_remap_list->next->to_when_alone == TAB));
-    assert(("registered second", g_remap_list->next->to_with_other == ALT));
-
-    assert(("registered third", g_remap_list->next->next->from == SHIFT));
-    assert(("registered third", g_remap_list->next->next->to_when_alone == SPACE));
-    assert(("registered third", g_remap_list->next->next->to_with_other == SHIFT));
+    assert(("debug off by default", g_engine->debug == 0));
+    assert(0 == load_config_line(g_engine, "debug=1", 0));
+    assert(("config turns debug on", g_engine->debug == 1));
+    assert(0 == load_config_line(g_engine, "debug=0", 0));
+    assert(("config turns debug off", g_engine->debug == 0));
+
+    assert(0 == load_config_line(g_engine, "# Comments are ignored", 0));
+    assert(0 == load_config_line(g_engine, "", 0));
+    assert(0 == load_config_line(g_engine, "remap_key=CAPSLOCK", 0));
+    assert(0 == load_config_line(g_engine, "when_alone=ESCAPE", 0));
+    assert(0 == load_config_line(g_engine, "with_other=CTRL", 0));
+
+    assert(0 == load_config_line(g_engine, "remap_key=TAB", 0));
+    assert(0 == load_config_line(g_engine, "when_alone=TAB", 0));
+    assert(0 == load_config_line(g_engine, "with_other=ALT", 0));
+
+    assert(0 == load_config_line(g_engine, "remap_key=SHIFT", 0));
+    assert(0 == load_config_line(g_engine, "when_alone=SPACE", 0));
+    assert(0 == load_config_line(g_engine, "with_other=SHIFT", 0));
+
+    assert(("registered first", g_engine->table->remap_list->from == CAPS));
+    assert(("registered first", g_engine->table->remap_list->to_when_alone == ESC));
+    assert(("registered first", g_engine->table->remap_list->to_with_other == CTRL));
+
+    assert(("registered second", g_engine->table->remap_list->next->from == TAB));
+    assert(("registered second", g_engine->table->remap_list->next->to_when_alone == TAB));
+    assert(("registered second", g_engine->table->remap_list->next->to_with_other == ALT));
+
+    assert(("registered third", g_engine->table->remap_list->next->next->from == SHIFT));
+    assert(("registered third", g_engine->table->remap_list->next->next->to_when_alone == SPACE));
+    assert(("registered third", g_engine->table->remap_list->next->next->to_with_other == SHIFT));
     printf("OK\n");
 
     SECTION("Passthrough unmapped");
@@ -302,6 +563,1045 @@ void main()
         SEE(RSHIFT, DOWN);
         SEE(RSHIFT, UP);
         EMPTY();
+    OK();
+
+    SECTION("Batch output per input");
+    g_flush_count = 0;
+    IN(ENTER, DOWN);
+    IN(ENTER, UP);
+        SEE_BATCH(0, 0);
+        SEE(ENTER, DOWN);
+        SEE(ENTER, UP);
+    IN(CAPS, DOWN);
+    IN(CAPS, UP);
+        SEE_BATCH(1, 2);
+        SEE_BATCHED(0, ESC, DOWN);
+        SEE_BATCHED(1, ESC, UP);
+        SEE(ESC, DOWN);
+        SEE(ESC, UP);
+    IN(CAPS, DOWN);
+    IN(TAB, DOWN);
+    IN(ENTER, DOWN);
+        SEE_BATCH(1, 2);
+        SEE_BATCHED(0, CTRL, DOWN);
+        SEE_BATCHED(1, ALT, DOWN);
+        SEE(CTRL, DOWN);
+        SEE(ALT, DOWN);
+        SEE(ENTER, DOWN);
+    IN(ENTER, UP);
+    IN(TAB, UP);
+        SEE_BATCH(1, 1);
+        SEE_BATCHED(0, ALT, UP);
+    IN(CAPS, UP);
+        SEE_BATCH(1, 1);
+        SEE_BATCHED(0, CTRL, UP);
+        SEE(ENTER, UP);
+        SEE(ALT, UP);
+        SEE(CTRL, UP);
+        EMPTY();
+    OK();
+
+    SECTION("Echoes don't re-enter the engine");
+    // Sending TAB makes CAPS Ctrl, its echo isn't needed for that
+    IN(TAB, DOWN);
+    IN(CAPS, DOWN);
+    IN(TAB, UP);
+        SEE_BATCH(1, 3);
+        SEE_BATCHED(0, CTRL, DOWN);
+        SEE_BATCHED(1, TAB, DOWN);
+        SEE_BATCHED(2, TAB, UP);
+    IN(CAPS, UP);
+        SEE_BATCH(1, 1);
+        SEE(CTRL, DOWN);
+        SEE(TAB, DOWN);
+        SEE(TAB, UP);
+        SEE(CTRL, UP);
+        EMPTY();
+    uint32_t next_seq = g_engine->next_echo_seq;
+    assert(("not sent yet", !consume_echo(g_engine, next_seq & ECHO_SEQ_MASK)));
+    assert(("already back", !consume_echo(g_engine, (next_seq - 1) & ECHO_SEQ_MASK)));
+    OK();
+
+    SECTION("Armed only while a remap is held");
+    assert(("idle", !is_engine_armed(g_engine)));
+    IN(ENTER, DOWN);
+        assert(("other key", !is_engine_armed(g_engine)));
+    IN(CAPS, DOWN);
+        assert(("held alone", is_engine_armed(g_engine)));
+    IN(ENTER, UP);
+        assert(("held with other", is_engine_armed(g_engine)));
+    IN(CAPS, UP);
+        assert(("released", !is_engine_armed(g_engine)));
+        SEE(ENTER, DOWN);
+        SEE(CTRL, DOWN);
+        SEE(ENTER, UP);
+        SEE(CTRL, UP);
+        EMPTY();
+    OK();
+
+    SECTION("Flight recorder keeps inputs, outputs and state changes");
+    struct FlightRecorder recorder;
+    void * recording = calloc(1, FLIGHT_FILE_SIZE);
+    init_flight_recorder(&recorder, recording);
+    g_engine->recorder = &recorder;
+    IN(ENTER, DOWN);
+    IN(CAPS, DOWN);
+    IN(ENTER, UP);
+    IN(CAPS, UP);
+    IN(CAPS, DOWN);
+    IN(CAPS, UP);
+        SEE(ENTER, DOWN);
+        SEE(CTRL, DOWN);
+        SEE(ENTER, UP);
+        SEE(CTRL, UP);
+        SEE(ESC, DOWN);
+        SEE(ESC, UP);
+        EMPTY();
+    g_engine->recorder = NULL;
+    char * flight_log = flight_log_text(&recorder);
+    assert(("starts with a marker", strncmp(flight_log, "\n--- recording started", 22) == 0));
+    assert(("same as the debug log", strcmp(strchr(flight_log + 1, '\n'),
+        "\n001. [input] ENTER DOWN (scan:0x1c virt:0x0d)"
+        "\n002. [input] CAPSLOCK DOWN (scan:0x3a virt:0x14)"
+        "\n003. \t{state} CAPSLOCK HELD_DOWN_ALONE"
+        "\n004. #blocked-input# CAPSLOCK DOWN"
+        "\n005. [input] ENTER UP (scan:0x1c virt:0x0d)"
+        "\n006. \t{state} CAPSLOCK HELD_DOWN_WITH_OTHER"
+        "\n007. \t(sending:with_other) CTRL DOWN"
+        "\n008. [input] CAPSLOCK UP (scan:0x3a virt:0x14)"
+        "\n009. \t{state} CAPSLOCK IDLE"
+        "\n010. \t(sending:with_other) CTRL UP"
+        "\n011. #blocked-input# CAPSLOCK UP"
+        "\n012. [input] CAPSLOCK DOWN (scan:0x3a virt:0x14)"
+        "\n013. \t{state} CAPSLOCK HELD_DOWN_ALONE"
+        "\n014. #blocked-input# CAPSLOCK DOWN"
+        "\n015. [input] CAPSLOCK UP (scan:0x3a virt:0x14)"
+        "\n016. \t{state} CAPSLOCK IDLE"
+        "\n017. \t(sending:when_alone) ESCAPE DOWN"
+        "\n018. \t(sending:when_alone) ESCAPE UP"
+        "\n019. #blocked-input# CAPSLOCK UP"
+        "\n") == 0));
+    // A restart carries on with the recording
+    init_flight_recorder(&recorder, recording);
+    assert(("kept", recorder.header->head == 21));
+    // Wrapping keeps all but the oldest slot, a crash may have torn it
+    for (int i = 0; i < FLIGHT_RECORDS; i++) {
+        record_flight(&recorder, FLIGHT_INPUT, 0, SK_ENTER, VK_ENTER, DOWN, 0, 0, 0);
+    }
+    FILE * null_file = tmpfile();
+    assert(("wrapped", print_flight_log(recorder.header, null_file) == FLIGHT_RECORDS - 1));
+    fclose(null_file);
+    free(recording);
+    OK();
+
+    SECTION("Log ring keeps order and counts drops");
+    struct LogRecord record = {LOG_INPUT};
+    for (int i = 0; i < LOG_RING_LEN + 100; i++) {
+        record.scan_code = i;
+        log_ring_push(&g_stress_ring, &record);
+    }
+    assert(("drops when full", log_ring_dropped(&g_stress_ring) == 100));
+    for (int i = 0; i < LOG_RING_LEN; i++) {
+        assert(log_ring_pop(&g_stress_ring, &record));
+        assert(("fifo", record.scan_code == i));
+    }
+    assert(("empty", !log_ring_pop(&g_stress_ring, &record)));
+    reset_log_ring(&g_stress_ring);
+
+    // Traces are queued by the hooks and written by whoever drains the log
+    g_engine->trace_file = tmpfile();
+    log_trace_input(g_engine, 0x3a, 0x14, DOWN, 1043);
+    assert(("not written by the hook", ftell(g_engine->trace_file) == 0));
+    assert(1 == drain_log(g_engine));
+    char trace_line[64] = "";
+    rewind(g_engine->trace_file);
+    assert(fgets(trace_line, sizeof(trace_line), g_engine->trace_file));
+    assert(("written when drained", strcmp(trace_line, "1043 0x3a 0x14 DOWN 0\n") == 0));
+    fclose(g_engine->trace_file);
+    g_engine->trace_file = NULL;
+
+    // A stopped log thread has drained everything, the engine can go then
+    struct Engine * logged = new_engine(send_input_batch, NULL);
+    logged->trace_file = tmpfile();
+    assert(0 == start_log_thread(logged));
+    log_trace_input(logged, 0x3a, 0x14, UP, 1044);
+    stop_log_thread(logged);
+    assert(("drained", ftell(logged->trace_file) > 0));
+    fclose(logged->trace_file);
+    free_engine(logged);
+
+    Thread consumer;
+    assert(0 == start_thread(&consumer, stress_log_consumer, NULL));
+    for (int i = 0; i < STRESS_LOG_RECORDS; i++) {
+        record.scan_code = i;
+        log_ring_push(&g_stress_ring, &record);
+    }
+    atomic_store_release(&g_stress_done, 1);
+    join_thread(consumer);
+    long dropped = log_ring_dropped(&g_stress_ring);
+    printf("%ld records dropped under load\n", dropped);
+    assert(("every record seen or counted", g_stress_popped + dropped == STRESS_LOG_RECORDS));
+    g_stress_gaps += STRESS_LOG_RECORDS - 1 - g_stress_last;
+    assert(("gaps are dropped records", g_stress_gaps == dropped));
+    OK();
+
+    SECTION("Histogram math");
+    for (uint64_t value = 0; value < 100000; value++) {
+        int index = histogram_index(value);
+        assert(("value in bucket", histogram_bucket_lowest(index) <= value));
+        assert(("value in bucket", histogram_bucket_highest(index) >= value));
+        if (value < HISTOGRAM_SUB_BUCKETS) {
+            assert(("small values are exact", histogram_bucket_highest(index) == value));
+        }
+        assert(("relative error", (histogram_bucket_highest(index) - histogram_bucket_lowest(index)) * 32 <= value));
+    }
+    for (int i = 1; i < HISTOGRAM_LEN; i++) {
+        assert(("buckets are contiguous", histogram_bucket_lowest(i) == histogram_bucket_highest(i - 1) + 1));
+    }
+    assert(("covers 64 bits", histogram_index(UINT64_MAX) == HISTOGRAM_LEN - 1));
+    assert(("covers 64 bits", histogram_bucket_highest(HISTOGRAM_LEN - 1) == UINT64_MAX));
+    struct Histogram * histogram = malloc(sizeof(struct Histogram));
+    reset_histogram(histogram);
+    assert(("empty", histogram_percentile(histogram, 50) == 0));
+    for (int value = 1; value <= 1000; value++) histogram_record(histogram, value);
+    assert(histogram->total == 1000 && histogram->max == 1000);
+    uint64_t p50 = histogram_percentile(histogram, 50);
+    uint64_t p99 = histogram_percentile(histogram, 99);
+    assert(("p50", p50 >= 500 && p50 <= 500 + 500 / 32));
+    assert(("p99", p99 >= 990 && p99 <= 990 + 990 / 32));
+    assert(("p100 is max", histogram_percentile(histogram, 100) == 1000));
+    reset_histogram(histogram);
+    histogram_record(histogram, 7);
+    assert(("exact small", histogram_percentile(histogram, 99.9) == 7));
+    free(histogram);
+    OK();
+
+    SECTION("Counts inputs");
+    reset_stats(g_engine);
+    IN(ENTER, DOWN);
+    IN(ENTER, UP);
+    IN(CAPS, DOWN);
+    IN(CAPS, UP);
+        SEE(ENTER, DOWN);
+        SEE(ENTER, UP);
+        SEE(ESC, DOWN);
+        SEE(ESC, UP);
+    IN(CAPS, DOWN);
+    IN(ENTER, DOWN);
+    IN(ENTER, UP);
+    IN(CAPS, UP);
+        SEE(CTRL, DOWN);
+        SEE(ENTER, DOWN);
+        SEE(ENTER, UP);
+        SEE(CTRL, UP);
+        EMPTY();
+    // 8 user inputs and 4 echoes, which never reach handle_input. The first
+    // ENTER takes the fast path and isn't timed.
+    assert(("seen", g_engine->stats.events_seen == 12));
+    assert(("blocked", g_engine->stats.events_blocked == 4));
+    assert(("injected", g_engine->stats.injected_ignored == 4));
+    assert(("timed", g_engine->stats.handle_input_ns.total == 6));
+    assert(("when_alone", find_remap_for_virt_code(g_engine, VK_CAPSLOCK)->when_alone_count == 1));
+    assert(("with_other", find_remap_for_virt_code(g_engine, VK_CAPSLOCK)->with_other_count == 1));
+    OK();
+
+    SECTION("Reloads config while keys are held");
+    reset_config(g_engine);
+    char * caps_to_ctrl = "remap_key=CAPSLOCK\nwhen_alone=ESCAPE\nwith_other=CTRL\n"
+                          "remap_key=TAB\nwhen_alone=TAB\nwith_other=ALT\n";
+    char * caps_to_alt = "remap_key=CAPSLOCK\nwhen_alone=ENTER\nwith_other=ALT\n";
+    assert(0 == load_config_buffer(g_engine, caps_to_ctrl, strlen(caps_to_ctrl)));
+    IN(CAPS, DOWN);
+    IN(ENTER, DOWN);
+        SEE(CTRL, DOWN);
+        SEE(ENTER, DOWN);
+    assert(0 == reload_config_buffer(g_engine, caps_to_alt, strlen(caps_to_alt)));
+    assert(("not adopted before the next input", g_engine->table->remap_list->to_with_other == CTRL));
+    IN(ENTER, UP);
+        SEE(ENTER, UP);
+        EMPTY();
+    assert(("adopted", g_engine->table->remap_list->to_with_other == ALT));
+    assert(("old table drains", g_engine->draining != NULL));
+    // Held keys are released on their old definitions
+    IN(CAPS, UP);
+        SEE(CTRL, UP);
+        EMPTY();
+    assert(("drained", g_engine->draining == NULL));
+    assert(("handed back", g_engine->reclaimable_tables != NULL));
+    assert(("waiting to be reclaimed", has_unreclaimed_tables(g_engine)));
+    reclaim_remap_tables(g_engine);
+    assert(("reclaimed", g_engine->reclaimable_tables == NULL && !has_unreclaimed_tables(g_engine)));
+    IN(CAPS, DOWN);
+    IN(CAPS, UP);
+        SEE(ENTER, DOWN);
+        SEE(ENTER, UP);
+    // Remaps held alone become with_other on their old definition
+    IN(CAPS, DOWN);
+    assert(0 == reload_config_buffer(g_engine, caps_to_ctrl, strlen(caps_to_ctrl)));
+    IN(ENTER, DOWN);
+        SEE(ALT, DOWN);
+        SEE(ENTER, DOWN);
+    IN(ENTER, UP);
+    IN(CAPS, UP);
+        SEE(ENTER, UP);
+        SEE(ALT, UP);
+        EMPTY();
+    assert(("drained", g_engine->draining == NULL));
+    // Even when the new config doesn't remap them at all
+    IN(TAB, DOWN);
+    assert(0 == reload_config_buffer(g_engine, caps_to_alt, strlen(caps_to_alt)));
+    IN(TAB, UP);
+        SEE(TAB, DOWN);
+        SEE(TAB, UP);
+        EMPTY();
+    IN(TAB, DOWN);
+        SEE(TAB, DOWN);
+    IN(TAB, UP);
+        SEE(TAB, UP);
+        EMPTY();
+    // Keys pressed before a reload remapped them go through until released
+    IN(TAB, DOWN);
+        SEE(TAB, DOWN);
+    assert(0 == reload_config_buffer(g_engine, caps_to_ctrl, strlen(caps_to_ctrl)));
+    IN(TAB, DOWN);
+    IN(TAB, UP);
+        SEE(TAB, DOWN);
+        SEE(TAB, UP);
+        EMPTY();
+    IN(TAB, DOWN);
+    IN(TAB, UP);
+        SEE(TAB, DOWN);
+        SEE(TAB, UP);
+        EMPTY();
+    // Only the latest of several reloads is adopted
+    assert(0 == reload_config_buffer(g_engine, caps_to_alt, strlen(caps_to_alt)));
+    assert(0 == reload_config_buffer(g_engine, caps_to_ctrl, strlen(caps_to_ctrl)));
+    // A broken config leaves the pending one alone
+    assert(1 == reload_config_buffer(g_engine, "remap_key=BOGUS", 15));
+    IN(CAPS, DOWN);
+    IN(CAPS, UP);
+        SEE(ESC, DOWN);
+        SEE(ESC, UP);
+        EMPTY();
+    // Resetting mid reload lets go of every table
+    IN(CAPS, DOWN);
+    assert(0 == reload_config_buffer(g_engine, caps_to_alt, strlen(caps_to_alt)));
+    IN(ENTER, DOWN);
+        SEE(CTRL, DOWN);
+        SEE(ENTER, DOWN);
+    assert(0 == reload_config_buffer(g_engine, caps_to_ctrl, strlen(caps_to_ctrl)));
+    reset_config(g_engine);
+    assert(("reset", !is_engine_armed(g_engine) && g_engine->table->remap_count == 0));
+    assert(("no tables left", !g_engine->draining && !g_engine->pending_table && !g_engine->table->next));
+    IN(CAPS, DOWN);
+        SEE(CAPS, DOWN);
+    IN(CAPS, UP);
+        SEE(CAPS, UP);
+        EMPTY();
+    reset_config(g_engine);
+    OK();
+
+    SECTION("Dispatch index with many remaps");
+    reset_config(g_engine);
+    // Three rounds over every key, only the first remap for each key should ever apply
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < KEY_TABLE_LEN; i++) {
+            register_remap(g_engine, round == 0
+                ? new_remap(&key_table[i], ESC, CTRL)
+                : new_remap(&key_table[i], TAB, ALT));
+        }
+    }
+    for (int i = 0; i < KEY_TABLE_LEN; i++) {
+        KEY_DEF * key = &key_table[i];
+        struct Remap * first_by_virt = g_engine->table->remap_list;
+        while (first_by_virt->from->virt_code != key->virt_code) first_by_virt = first_by_virt->next;
+        struct Remap * first_by_scan = g_engine->table->remap_list;
+        while (first_by_scan->from->scan_code != key->scan_code) first_by_scan = first_by_scan->next;
+        assert(("virt index matches list", find_remap_for_virt_code(g_engine, key->virt_code) == first_by_virt));
+        assert(("scan index matches list", find_remap_for_scan_code(g_engine, key->scan_code) == first_by_scan));
+    }
+    assert(("unmapped virt code", find_remap_for_virt_code(g_engine, MOUSE_DUMMY_VK) == NULL));
+    assert(("unmapped scan code", find_remap_for_scan_code(g_engine, 0xE0FF) == NULL));
+    IN(ENTER, DOWN);
+        EMPTY();
+    IN(ENTER, UP);
+        SEE(ESC, DOWN);
+        SEE(ESC, UP);
+        EMPTY();
+    KEY_DEF mouse = {"MOUSE", 0, MOUSE_DUMMY_VK};
+    IN(CAPS, DOWN);
+    IN(&mouse, DOWN);
+        SEE(CTRL, DOWN);
+        SEE(&mouse, DOWN);
+        EMPTY();
+    IN(CAPS, UP);
+        SEE(CTRL, UP);
+        EMPTY();
+    reset_config(g_engine);
+    assert(("reset clears index", find_remap_for_virt_code(g_engine, VK_CAPSLOCK) == NULL));
+    assert(("reset clears index", find_remap_for_scan_code(g_engine, SK_CAPSLOCK) == NULL));
+    IN(CAPS, DOWN);
+        SEE(CAPS, DOWN);
+        EMPTY();
+    OK();
+
+    SECTION("Timer wheel fires in order across levels");
+    struct TimerWheel wheel = {0};
+    // Start just before the clock wraps so cascades cross it too
+    wheel.next_tick = 0xFFFFF000u;
+    uint32_t now = wheel.next_tick;
+    srand(7);
+    for (int i = 0; i < WHEEL_TEST_TIMERS; i++) {
+        init_timer(&g_wheel_timers[i], record_wheel_timer);
+        // Mostly short, some far enough out for the third level
+        uint32_t delay = i % 8 ? rand() % 5000 : rand() % 300000;
+        arm_timer(&wheel, &g_wheel_timers[i], now + delay);
+    }
+    // Cancelled and moved timers
+    for (int i = 0; i < WHEEL_TEST_TIMERS; i += 10) cancel_timer(&wheel, &g_wheel_timers[i]);
+    for (int i = 5; i < WHEEL_TEST_TIMERS; i += 10) arm_timer(&wheel, &g_wheel_timers[i], now + 42);
+    int armed = wheel.count;
+    assert(("cancelled", armed == WHEEL_TEST_TIMERS - WHEEL_TEST_TIMERS / 10));
+    uint32_t first;
+    assert(next_timer_expiry(&wheel, &first));
+    while (wheel.count) {
+        uint32_t expected_first;
+        assert(next_timer_expiry(&wheel, &expected_first));
+        int fired_before = g_wheel_fired_count;
+        now += rand() % 700;
+        advance_timer_wheel(&wheel, now, &now);
+        for (int i = fired_before; i < g_wheel_fired_count; i++) {
+            assert(("not early", !is_time_before(now, g_wheel_fired[i])));
+            assert(("in order", i == 0 || !is_time_before(g_wheel_fired[i], g_wheel_fired[i - 1])));
+        }
+        if (g_wheel_fired_count > fired_before) {
+            assert(("next expiry is exact", g_wheel_fired[fired_before] == expected_first));
+        }
+        assert(("nothing due is left", !next_timer_expiry(&wheel, &expected_first) ||
+            is_time_before(now, expected_first)));
+    }
+    assert(("all fired", g_wheel_fired_count == armed));
+    assert(("first", g_wheel_fired[0] == first));
+    OK();
+
+    SECTION("Hold and tap timeouts on a virtual clock");
+    reset_config(g_engine);
+    assert(0 == load_config_line(g_engine, "remap_key=CAPSLOCK", 1));
+    assert(0 == load_config_line(g_engine, "hold_timeout_ms=200", 2));
+    assert(0 == load_config_line(g_engine, "when_alone=ESCAPE", 3));
+    assert(0 == load_config_line(g_engine, "with_other=CTRL", 4));
+    assert(0 == load_config_line(g_engine, "tap_timeout_ms=300", 5));
+    assert(0 == load_config_line(g_engine, "remap_key=TAB", 6));
+    assert(0 == load_config_line(g_engine, "when_alone=TAB", 7));
+    assert(0 == load_config_line(g_engine, "with_other=ALT", 8));
+    assert(0 == load_config_line(g_engine, "tap_timeout_ms=300", 9));
+    // Holding past the hold timeout goes with_other without other input
+    IN(CAPS, DOWN);
+    uint32_t deadline;
+    assert(next_timer_deadline(g_engine, &deadline) && deadline == g_time + 200);
+    WAIT(199);
+        EMPTY();
+    WAIT(1);
+        SEE(CTRL, DOWN);
+        EMPTY();
+    assert(("disarmed", !next_timer_deadline(g_engine, &deadline)));
+    WAIT(1000);
+    IN(CAPS, UP);
+        SEE(CTRL, UP);
+        EMPTY();
+    // Taps and other input before the timeout work as before
+    IN(CAPS, DOWN);
+    WAIT(150);
+    IN(CAPS, UP);
+        SEE(ESC, DOWN);
+        SEE(ESC, UP);
+        EMPTY();
+    IN(CAPS, DOWN);
+    IN(ENTER, DOWN);
+        SEE(CTRL, DOWN);
+        SEE(ENTER, DOWN);
+    assert(("cancelled by other input", !next_timer_deadline(g_engine, &deadline)));
+    IN(ENTER, UP);
+    IN(CAPS, UP);
+        SEE(ENTER, UP);
+        SEE(CTRL, UP);
+        EMPTY();
+    // An input stamped past the deadline fires the timer first
+    IN(CAPS, DOWN);
+    g_time += 250;
+    IN(ENTER, DOWN);
+        SEE(CTRL, DOWN);
+        SEE(ENTER, DOWN);
+        EMPTY();
+    IN(ENTER, UP);
+    IN(CAPS, UP);
+        SEE(ENTER, UP);
+        SEE(CTRL, UP);
+        EMPTY();
+    // Held alone past the tap timeout means no tap at all
+    IN(TAB, DOWN);
+    WAIT(300);
+    IN(TAB, UP);
+        SEE(TAB, DOWN);
+        SEE(TAB, UP);
+        EMPTY();
+    IN(TAB, DOWN);
+    WAIT(301);
+    IN(TAB, UP);
+        EMPTY();
+    // Timeouts must follow a remap_key and be plain milliseconds
+    reset_config(g_engine);
+    assert(1 == load_config_line(g_engine, "hold_timeout_ms=200", 1));
+    assert(0 == load_config_line(g_engine, "remap_key=CAPSLOCK", 2));
+    assert(1 == load_config_line(g_engine, "hold_timeout_ms=-1", 3));
+    assert(1 == load_config_line(g_engine, "hold_timeout_ms=200ms", 4));
+    assert(1 == load_config_line(g_engine, "tap_timeout_ms=60001", 5));
+    assert(1 == load_config_line(g_engine, "tap_timeout_ms=", 6));
+    assert(0 == load_config_line(g_engine, "tap_timeout_ms=0", 7));
+    reset_config(g_engine);
+    OK();
+
+    SECTION("Double taps on a virtual clock");
+    char * double_taps =
+        "remap_key=CAPSLOCK\nwhen_alone=ESCAPE\nwith_other=CTRL\ndouble_tap=CAPSLOCK\n"
+        "remap_key=TAB\nwhen_alone=TAB\nwith_other=ALT\n";
+    assert(0 == load_config_buffer(g_engine, double_taps, strlen(double_taps)));
+    assert(("default window", find_remap_for_virt_code(g_engine, CAPS->virt_code)->double_tap_ms == 200));
+    // Without a double_tap key taps go out on release
+    IN(TAB, DOWN);
+    IN(TAB, UP);
+        SEE(TAB, DOWN);
+        SEE(TAB, UP);
+        EMPTY();
+    assert(("nothing to wait for", !next_timer_deadline(g_engine, &deadline) && !is_engine_armed(g_engine)));
+    // A single tap goes out the moment the window closes
+    IN(CAPS, DOWN);
+    IN(CAPS, UP);
+        EMPTY();
+    assert(("waits", is_engine_armed(g_engine)));
+    assert(next_timer_deadline(g_engine, &deadline) && deadline == g_time + 200);
+    WAIT(199);
+        EMPTY();
+    WAIT(1);
+        SEE(ESC, DOWN);
+        SEE(ESC, UP);
+        EMPTY();
+    assert(("disarmed", !next_timer_deadline(g_engine, &deadline) && !is_engine_armed(g_engine)));
+    // Pressing again in time sends the double_tap key while held
+    IN(CAPS, DOWN);
+    IN(CAPS, UP);
+    WAIT(150);
+    IN(CAPS, DOWN);
+        SEE(CAPS, DOWN);
+        EMPTY();
+    assert(("window closed", !next_timer_deadline(g_engine, &deadline)));
+    WAIT(500);
+    IN(CAPS, DOWN);
+    IN(ENTER, DOWN);
+        SEE(ENTER, DOWN);
+    IN(ENTER, UP);
+    IN(CAPS, UP);
+        SEE(ENTER, UP);
+        SEE(CAPS, UP);
+        EMPTY();
+    assert(("released", !is_engine_armed(g_engine)));
+    // Other input sends the tap ahead of itself
+    IN(CAPS, DOWN);
+    IN(CAPS, UP);
+    IN(ENTER, DOWN);
+        SEE(ESC, DOWN);
+        SEE(ESC, UP);
+        SEE(ENTER, DOWN);
+    IN(ENTER, UP);
+        SEE(ENTER, UP);
+        EMPTY();
+    assert(("cancelled", !next_timer_deadline(g_engine, &deadline)));
+    // So does another remapped key, whose own tap follows
+    IN(CAPS, DOWN);
+    IN(CAPS, UP);
+    IN(TAB, DOWN);
+        SEE(ESC, DOWN);
+        SEE(ESC, UP);
+        EMPTY();
+    IN(TAB, UP);
+        SEE(TAB, DOWN);
+        SEE(TAB, UP);
+        EMPTY();
+    // A press stamped past the window sends the tap first and starts over
+    IN(CAPS, DOWN);
+    IN(CAPS, UP);
+    g_time += 250;
+    IN(CAPS, DOWN);
+        SEE(ESC, DOWN);
+        SEE(ESC, UP);
+        EMPTY();
+    IN(CAPS, UP);
+        EMPTY();
+    WAIT(200);
+        SEE(ESC, DOWN);
+        SEE(ESC, UP);
+        EMPTY();
+    // Holds with other input don't count as taps
+    IN(CAPS, DOWN);
+    IN(ENTER, DOWN);
+        SEE(CTRL, DOWN);
+        SEE(ENTER, DOWN);
+    IN(ENTER, UP);
+    IN(CAPS, UP);
+        SEE(ENTER, UP);
+        SEE(CTRL, UP);
+        EMPTY();
+    IN(CAPS, DOWN);
+        EMPTY();
+    IN(CAPS, UP);
+    WAIT(200);
+        SEE(ESC, DOWN);
+        SEE(ESC, UP);
+        EMPTY();
+    struct Remap * caps_remap = find_remap_for_virt_code(g_engine, CAPS->virt_code);
+    assert(("counted", caps_remap->double_tap_count == 1 && caps_remap->when_alone_count == 6));
+    // The window is set per remap, 0 turns double taps off
+    reset_config(g_engine);
+    assert(1 == load_config_line(g_engine, "double_tap=CAPSLOCK", 1));
+    assert(0 == load_config_line(g_engine, "remap_key=CAPSLOCK", 2));
+    assert(1 == load_config_line(g_engine, "double_tap=NOT_A_KEY", 3));
+    assert(0 == load_config_line(g_engine, "double_tap = ENTER", 4));
+    assert(1 == load_config_line(g_engine, "double_tap_ms=fast", 5));
+    assert(0 == load_config_line(g_engine, "double_tap_ms=0", 6));
+    assert(0 == load_config_line(g_engine, "when_alone=ESCAPE", 7));
+    assert(0 == load_config_line(g_engine, "with_other=CTRL", 8));
+    IN(CAPS, DOWN);
+    IN(CAPS, UP);
+        SEE(ESC, DOWN);
+        SEE(ESC, UP);
+        EMPTY();
+    assert(0 == load_config_line(g_engine, "double_tap_ms=100", 9));
+    IN(CAPS, DOWN);
+    IN(CAPS, UP);
+    WAIT(99);
+    IN(CAPS, DOWN);
+        SEE(ENTER, DOWN);
+    IN(CAPS, UP);
+        SEE(ENTER, UP);
+        EMPTY();
+    reset_config(g_engine);
+    OK();
+
+    SECTION("Macros go out in one batch");
+    char * macros =
+        "remap_key=CAPSLOCK\nwhen_alone=CTRL + SHIFT + KEY_P\nwith_other=RIGHT_CTRL+ALT\n"
+        "remap_key=TAB\nwhen_alone=CTRL+KEY_C, CTRL+KEY_V,ENTER\nwith_other=ALT\n";
+    assert(0 == load_config_buffer(g_engine, macros, strlen(macros)));
+    KEY_DEF * KEY_P = find_key_def_by_name("KEY_P");
+    KEY_DEF * KEY_C = find_key_def_by_name("KEY_C");
+    KEY_DEF * KEY_V = find_key_def_by_name("KEY_V");
+    KEY_DEF * RIGHT_CTRL = find_key_def_by_name("RIGHT_CTRL");
+    assert(("compiled", g_engine->table->macro_event_count == 6 + 4 + 8 + 2));
+    g_flush_count = 0;
+    // Combos press in order and release in reverse
+    IN(CAPS, DOWN);
+    IN(CAPS, UP);
+        SEE_BATCH(1, 6);
+        SEE_BATCHED(0, CTRL, DOWN);
+        SEE_BATCHED(2, KEY_P, DOWN);
+        SEE_BATCHED(5, CTRL, UP);
+        SEE(CTRL, DOWN);
+        SEE(SHIFT, DOWN);
+        SEE(KEY_P, DOWN);
+        SEE(KEY_P, UP);
+        SEE(SHIFT, UP);
+        SEE(CTRL, UP);
+        EMPTY();
+    // with_other combos are held as long as the key
+    IN(CAPS, DOWN);
+    IN(ENTER, DOWN);
+        SEE_BATCH(1, 2);
+        SEE_BATCHED(0, RIGHT_CTRL, DOWN);
+        SEE_BATCHED(1, ALT, DOWN);
+    assert(("extended flag", g_last_batch.events[0].flags == INPUT_EXTENDED && !g_last_batch.events[1].flags));
+    IN(ENTER, UP);
+    IN(CAPS, UP);
+        SEE_BATCH(1, 2);
+        SEE_BATCHED(0, ALT, UP);
+        SEE_BATCHED(1, RIGHT_CTRL, UP);
+        SEE(RIGHT_CTRL, DOWN);
+        SEE(ALT, DOWN);
+        SEE(ENTER, DOWN);
+        SEE(ENTER, UP);
+        SEE(ALT, UP);
+        SEE(RIGHT_CTRL, UP);
+        EMPTY();
+    // Sequences, and other input a macro causes, share the batch
+    IN(CAPS, DOWN);
+    IN(TAB, DOWN);
+    IN(TAB, UP);
+        SEE_BATCH(1, 2 + 10);
+    IN(CAPS, UP);
+        SEE_BATCH(1, 2);
+        SEE(RIGHT_CTRL, DOWN);
+        SEE(ALT, DOWN);
+        SEE(CTRL, DOWN);
+        SEE(KEY_C, DOWN);
+        SEE(KEY_C, UP);
+        SEE(CTRL, UP);
+        SEE(CTRL, DOWN);
+        SEE(KEY_V, DOWN);
+        SEE(KEY_V, UP);
+        SEE(CTRL, UP);
+        SEE(ENTER, DOWN);
+        SEE(ENTER, UP);
+        SEE(ALT, UP);
+        SEE(RIGHT_CTRL, UP);
+        EMPTY();
+    reset_config(g_engine);
+    // Long macros still go out in one injection, ahead of whatever was queued
+    char long_macro[4096] = "remap_key=CAPSLOCK\nwith_other=CTRL\nwhen_alone=";
+    for (int i = 0; i < MAX_MACRO_EVENTS / 2; i++) {
+        strcat(long_macro, i == 0 ? "KEY_C" : i % 2 ? ", KEY_V" : ", KEY_C");
+    }
+    assert(0 == load_config_buffer(g_engine, long_macro, strlen(long_macro)));
+    g_flush_count = 0;
+    IN(CAPS, DOWN);
+    IN(CAPS, UP);
+        SEE_BATCH(1, MAX_MACRO_EVENTS);
+    for (int i = 0; i < MAX_MACRO_EVENTS; i++) {
+        SEE(i % 4 < 2 ? KEY_C : KEY_V, i % 2 ? UP : DOWN);
+    }
+        EMPTY();
+    reset_config(g_engine);
+    // Bad macros point at the key at fault
+    char * bad_macro_lines[] = {
+        "remap_key=CAPSLOCK\nwhen_alone=CTRL+NOPE\n",
+        "remap_key=CAPSLOCK\nwhen_alone=CTRL+\n",
+        "remap_key=CAPSLOCK\nwith_other=CTRL+KEY_C, CTRL+KEY_V\n",
+        "remap_key=CAPSLOCK+KEY_A\n",
+        long_macro,
+    };
+    strcat(long_macro, "+ENTER");
+    int bad_macro_columns[] = {17, 17, 22, 11, 12 + (MAX_MACRO_EVENTS / 2) * 7 - 1};
+    for (int i = 0; i < 5; i++) {
+        init_config_parser(&parser, bad_macro_lines[i], strlen(bad_macro_lines[i]), 1);
+        assert(("rejected", 1 == parse_config(g_engine->table, &parser)));
+        assert(("column", parser.error_column == bad_macro_columns[i]));
+        assert(("nothing left behind", g_engine->table->macro_event_count == 0));
+        reset_config(g_engine);
+    }
+    OK();
+
+    SECTION("Layers translate other keys while held");
+    char * nav_layer =
+        "remap_key=CAPSLOCK\nwhen_alone=ESCAPE\nwith_other=layer:nav\n"
+        "remap_key=TAB\nwhen_alone=TAB\nwith_other=layer:fn\n"
+        "layer=nav\nmap=KEY_H:LEFT\nmap = KEY_J : DOWN\nmap=TAB:F1\n"
+        "layer=fn\nmap=KEY_H:F1\n";
+    assert(0 == load_config_buffer(g_engine, nav_layer, strlen(nav_layer)));
+    KEY_DEF * KEY_H = find_key_def_by_name("KEY_H");
+    KEY_DEF * KEY_J = find_key_def_by_name("KEY_J");
+    KEY_DEF * LEFT = find_key_def_by_name("LEFT");
+    KEY_DEF * DOWN_KEY = find_key_def_by_name("DOWN");
+    KEY_DEF * F1 = find_key_def_by_name("F1");
+    // Taps work as before
+    IN(CAPS, DOWN);
+    IN(CAPS, UP);
+        SEE(ESC, DOWN);
+        SEE(ESC, UP);
+        EMPTY();
+    // Mapped keys are translated, nothing else is sent
+    IN(CAPS, DOWN);
+    IN(KEY_H, DOWN);
+        SEE(LEFT, DOWN);
+        EMPTY();
+    IN(KEY_H, UP);
+        SEE(LEFT, UP);
+    IN(KEY_J, DOWN);
+    IN(KEY_J, DOWN);
+    IN(KEY_J, UP);
+        SEE(DOWN_KEY, DOWN);
+        SEE(DOWN_KEY, DOWN);
+        SEE(DOWN_KEY, UP);
+    IN(ENTER, DOWN);
+    IN(ENTER, UP);
+        SEE(ENTER, DOWN);
+        SEE(ENTER, UP);
+    IN(CAPS, UP);
+        EMPTY();
+    // Releasing the layer key first still releases what was sent
+    IN(CAPS, DOWN);
+    IN(KEY_H, DOWN);
+    IN(CAPS, UP);
+        SEE(LEFT, DOWN);
+        EMPTY();
+    assert(("armed until released", is_engine_armed(g_engine)));
+    IN(KEY_H, UP);
+        SEE(LEFT, UP);
+        EMPTY();
+    assert(("released", !is_engine_armed(g_engine)));
+    IN(KEY_H, DOWN);
+    IN(KEY_H, UP);
+        SEE(KEY_H, DOWN);
+        SEE(KEY_H, UP);
+        EMPTY();
+    // And a key down before the layer was active comes up as itself
+    IN(KEY_H, DOWN);
+    IN(CAPS, DOWN);
+    IN(KEY_H, UP);
+    IN(CAPS, UP);
+        SEE(KEY_H, DOWN);
+        SEE(KEY_H, UP);
+        EMPTY();
+    // Switching layers only affects keys pressed after the switch
+    IN(CAPS, DOWN);
+    IN(KEY_H, DOWN);
+    IN(TAB, DOWN);
+    IN(KEY_J, DOWN);
+        SEE(LEFT, DOWN);
+        SEE(KEY_J, DOWN);
+    assert(("switched", g_engine->active_layer == g_engine->table->remap_list->next->layer));
+    IN(KEY_H, UP);
+    IN(KEY_H, DOWN);
+        SEE(LEFT, UP);
+        SEE(F1, DOWN);
+    // The layer of the first key doesn't come back, the last one switched
+    IN(TAB, UP);
+    IN(KEY_H, UP);
+    IN(KEY_J, UP);
+    IN(CAPS, UP);
+        SEE(F1, UP);
+        SEE(KEY_J, UP);
+        EMPTY();
+    assert(("no layer", g_engine->active_layer == NULL && !is_engine_armed(g_engine)));
+    // Remapped keys keep their remap
+    IN(CAPS, DOWN);
+    IN(TAB, DOWN);
+    IN(TAB, UP);
+    IN(CAPS, UP);
+        SEE(TAB, DOWN);
+        SEE(TAB, UP);
+        EMPTY();
+    // Layers have to be defined, once, and maps must follow one
+    reset_config(g_engine);
+    char * undefined_layer = "remap_key=CAPSLOCK\nwhen_alone=ESCAPE\nwith_other=layer:nav\n";
+    assert(1 == load_config_buffer(g_engine, undefined_layer, strlen(undefined_layer)));
+    reset_config(g_engine);
+    char * twice_defined = "layer=nav\nlayer=fn\nlayer=nav\n";
+    assert(1 == load_config_buffer(g_engine, twice_defined, strlen(twice_defined)));
+    reset_config(g_engine);
+    char * bad_layer_lines[] = {
+        "map=KEY_H:LEFT",
+        "layer=nav\nmap=KEY_H",
+        "layer=nav\nmap=KEY_H:LEFTS",
+        "layer=nav\nmap=KEY_HH:LEFT",
+        "layer=na v",
+        "remap_key=CAPSLOCK\nwith_other=layer:",
+        "remap_key=CAPSLOCK\nwhen_alone=layer:nav",
+    };
+    int bad_layer_columns[] = {1, 5, 11, 5, 7, 18, 12};
+    for (int i = 0; i < 7; i++) {
+        init_config_parser(&parser, bad_layer_lines[i], strlen(bad_layer_lines[i]), 1);
+        assert(("rejected", 1 == parse_config(g_engine->table, &parser)));
+        assert(("column", parser.error_column == bad_layer_columns[i]));
+        reset_config(g_engine);
+    }
+    OK();
+
+    SECTION("Chords within the chord window");
+    char * chords =
+        "remap_key=CAPSLOCK\nwhen_alone=ESCAPE\nwith_other=CTRL\n"
+        "chord=KEY_J+KEY_K:ESCAPE\n"
+        "chord = KEY_A + KEY_S + KEY_D : F1\n"
+        "chord=KEY_A+KEY_S:F2\n"
+        "chord_window_ms=30\n";
+    assert(0 == load_config_buffer(g_engine, chords, strlen(chords)));
+    KEY_DEF * KEY_K = find_key_def_by_name("KEY_K");
+    KEY_DEF * KEY_A = find_key_def_by_name("KEY_A");
+    KEY_DEF * KEY_S = find_key_def_by_name("KEY_S");
+    KEY_DEF * KEY_D = find_key_def_by_name("KEY_D");
+    KEY_DEF * F2 = find_key_def_by_name("F2");
+    // Complete chords go out at once, with their first key up
+    IN(KEY_J, DOWN);
+        EMPTY();
+    assert(("held back", is_engine_armed(g_engine)));
+    assert(next_timer_deadline(g_engine, &deadline) && deadline == g_time + 30);
+    WAIT(10);
+    IN(KEY_K, DOWN);
+        SEE(ESC, DOWN);
+        EMPTY();
+    assert(("window closed", !next_timer_deadline(g_engine, &deadline)));
+    IN(KEY_K, DOWN);
+    IN(KEY_J, UP);
+        SEE(ESC, UP);
+    IN(KEY_K, UP);
+        EMPTY();
+    assert(("released", !is_engine_armed(g_engine)));
+    // A key alone goes out when the window ends, and never later
+    IN(KEY_J, DOWN);
+    IN(KEY_J, DOWN);
+    WAIT(29);
+        EMPTY();
+    WAIT(1);
+        SEE(KEY_J, DOWN);
+        EMPTY();
+    IN(KEY_J, DOWN);
+    IN(KEY_J, UP);
+        SEE(KEY_J, DOWN);
+        SEE(KEY_J, UP);
+        EMPTY();
+    assert(("bounded", g_engine->stats.max_held_back_ms == 30));
+    // Anything else sends the held back keys first, in order
+    IN(KEY_J, DOWN);
+    IN(ENTER, DOWN);
+        SEE(KEY_J, DOWN);
+        SEE(ENTER, DOWN);
+        EMPTY();
+    IN(ENTER, UP);
+    IN(KEY_J, UP);
+        SEE(ENTER, UP);
+        SEE(KEY_J, UP);
+    IN(KEY_J, DOWN);
+    IN(KEY_J, UP);
+        SEE(KEY_J, DOWN);
+        SEE(KEY_J, UP);
+    IN(KEY_J, DOWN);
+    IN(KEY_A, DOWN);
+        SEE(KEY_J, DOWN);
+        EMPTY();
+    IN(KEY_J, UP);
+        SEE(KEY_A, DOWN);
+        SEE(KEY_J, UP);
+    IN(KEY_A, UP);
+        SEE(KEY_A, UP);
+        EMPTY();
+    // Keys that aren't part of a chord are never held back
+    IN(ENTER, DOWN);
+        SEE(ENTER, DOWN);
+    assert(("not armed", !is_engine_armed(g_engine)));
+    IN(ENTER, UP);
+        SEE(ENTER, UP);
+        EMPTY();
+    // A chord inside a longer one waits for the window
+    IN(KEY_A, DOWN);
+    IN(KEY_S, DOWN);
+        EMPTY();
+    IN(KEY_D, DOWN);
+        SEE(F1, DOWN);
+    IN(KEY_D, UP);
+    IN(KEY_S, UP);
+    IN(KEY_A, UP);
+        SEE(F1, UP);
+        EMPTY();
+    IN(KEY_A, DOWN);
+    IN(KEY_S, DOWN);
+    WAIT(30);
+        SEE(F2, DOWN);
+    IN(KEY_S, UP);
+    IN(KEY_A, UP);
+        SEE(F2, UP);
+        EMPTY();
+    // Held back keys are other input to remaps held alone once they go out
+    IN(CAPS, DOWN);
+    IN(KEY_J, DOWN);
+        EMPTY();
+    IN(CAPS, UP);
+    IN(KEY_J, UP);
+        SEE(CTRL, DOWN);
+        SEE(KEY_J, DOWN);
+        SEE(CTRL, UP);
+        SEE(KEY_J, UP);
+        EMPTY();
+    assert(("released", !is_engine_armed(g_engine)));
+    // A reload inside the window settles the held back keys by the old config
+    char * fewer_chords = "chord=KEY_J+KEY_K:ESCAPE\n";
+    IN(KEY_A, DOWN);
+    IN(KEY_S, DOWN);
+        EMPTY();
+    assert(0 == reload_config_buffer(g_engine, fewer_chords, strlen(fewer_chords)));
+    IN(KEY_D, DOWN);
+        SEE(F2, DOWN);
+        SEE(KEY_D, DOWN);
+        EMPTY();
+    IN(KEY_D, UP);
+        SEE(KEY_D, UP);
+    IN(KEY_S, UP);
+        SEE(F2, UP);
+    IN(KEY_A, UP);
+        EMPTY();
+    assert(("released", !is_engine_armed(g_engine)));
+    // A layer key held alone takes a chord key as other input and translates it
+    reset_config(g_engine);
+    char * layer_chords =
+        "remap_key=CAPSLOCK\nwhen_alone=ESCAPE\nwith_other=layer:nav\n"
+        "layer=nav\nmap=KEY_J:DOWN\n"
+        "chord=KEY_J+KEY_K:F2\n";
+    assert(0 == load_config_buffer(g_engine, layer_chords, strlen(layer_chords)));
+    IN(CAPS, DOWN);
+    IN(KEY_J, DOWN);
+        SEE(DOWN_KEY, DOWN);
+        EMPTY();
+    IN(KEY_K, DOWN);
+        SEE(KEY_K, DOWN);
+        EMPTY();
+    IN(KEY_K, UP);
+    IN(KEY_J, UP);
+    IN(CAPS, UP);
+        SEE(KEY_K, UP);
+        SEE(DOWN_KEY, UP);
+        EMPTY();
+    assert(("released", !is_engine_armed(g_engine)));
+    reset_config(g_engine);
+    char * bad_chord_lines[] = {
+        "chord=KEY_J:ESCAPE",
+        "chord=KEY_J+KEY_J:ESCAPE",
+        "chord=KEY_J+KEY_K",
+        "chord=KEY_J+KEY_X+KEY_Q+KEY_K+KEY_L:ESCAPE",
+        "chord=KEY_J+KEY_KK:ESCAPE",
+        "chord=KEY_J+KEY_K:ESC_",
+        "chord_window_ms=0",
+        "chord_window_ms=1001",
+    };
+    int bad_chord_columns[] = {7, 13, 7, 31, 13, 19, 17, 17};
+    for (int i = 0; i < 8; i++) {
+        init_config_parser(&parser, bad_chord_lines[i], strlen(bad_chord_lines[i]), 1);
+        assert(("rejected", 1 == parse_config(g_engine->table, &parser)));
+        assert(("column", parser.error_column == bad_chord_columns[i]));
+        reset_config(g_engine);
+    }
+    OK();
+
+    SECTION("Independent engines on parallel threads");
+    struct ParallelRun reference = {0};
+    run_parallel_engine(&reference);
+    // One round, as checked by hand: tap, hold with ENTER, hold with a TAB
+    // tap, then both held and TAB tapped first
+    struct { KEY_DEF * key; enum Direction dir; } expected[] = {
+        {ESC, DOWN}, {ESC, UP},
+        {CTRL, DOWN}, {ENTER, DOWN}, {ENTER, UP},
+        {TAB, DOWN}, {TAB, UP}, {CTRL, UP},
+        {CTRL, DOWN}, {TAB, DOWN}, {TAB, UP}, {CTRL, UP},
+    };
+    int round_len = sizeof(expected) / sizeof(expected[0]);
+    assert(("output per round", reference.output_count == round_len * PARALLEL_ROUNDS));
+    for (int i = 0; i < round_len; i++) {
+        assert(("reference output", reference.outputs[i].virt_code == expected[i].key->virt_code));
+        assert(("reference output", reference.outputs[i].direction == expected[i].dir));
+    }
+    Thread threads[PARALLEL_ENGINES];
+    struct ParallelRun runs[PARALLEL_ENGINES] = {0};
+    for (int i = 0; i < PARALLEL_ENGINES; i++) {
+        assert(0 == start_thread(&threads[i], run_parallel_engine, &runs[i]));
+    }
+    for (int i = 0; i < PARALLEL_ENGINES; i++) {
+        join_thread(threads[i]);
+        assert(("same output", runs[i].output_count == reference.output_count));
+        assert(("same output", 0 == memcmp(runs[i].outputs, reference.outputs,
+            reference.output_count * sizeof(struct InputEvent))));
+        assert(("own stats", runs[i].engine->stats.events_seen == reference.engine->stats.events_seen));
+        free_engine(runs[i].engine);
+        free(runs[i].outputs);
+    }
+    free_engine(reference.engine);
+    free(reference.outputs);
+    OK();
 
     printf("\nGreat! All test passed successfully.\n");
+    return 0;
 }
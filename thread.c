@@ -0,0 +1,123 @@
+#include <stdlib.h>
+
+#ifndef THREAD_C
+#define THREAD_C
+
+#ifdef _WIN32
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// Threads & atomics
+// --------------------------------------
+
+// Just enough of a portability layer for the background workers used by the
+// engine and its tools. Atomics only come in the flavours we need for single
+// producer/single consumer hand-offs, on longs and on pointers, plus a counter,
+// a compare-and-swap for the one queue with several producers and a plain
+// mutex for the tools that share work between threads.
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+#define atomic_load_acquire(ptr) _InterlockedOr((volatile long *)(ptr), 0)
+#define atomic_store_release(ptr, value) _InterlockedExchange((volatile long *)(ptr), (value))
+#define atomic_load_pointer(ptr) _InterlockedCompareExchangePointer((void * volatile *)(ptr), NULL, NULL)
+#define atomic_store_pointer(ptr, value) _InterlockedExchangePointer((void * volatile *)(ptr), (value))
+#define atomic_exchange_pointer(ptr, value) _InterlockedExchangePointer((void * volatile *)(ptr), (value))
+#define atomic_add(ptr, value) (_InterlockedExchangeAdd((volatile long *)(ptr), (value)) + (value))
+#define atomic_compare_exchange(ptr, expected, desired) \
+    (_InterlockedCompareExchange((volatile long *)(ptr), (desired), (expected)) == (expected))
+#else
+typedef pthread_t Thread;
+#define atomic_load_acquire(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define atomic_store_release(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#define atomic_load_pointer(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define atomic_store_pointer(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#define atomic_exchange_pointer(ptr, value) __atomic_exchange_n((ptr), (value), __ATOMIC_ACQ_REL)
+#define atomic_add(ptr, value) __atomic_add_fetch((ptr), (value), __ATOMIC_ACQ_REL)
+#define atomic_compare_exchange(ptr, expected, desired) __sync_bool_compare_and_swap((ptr), (expected), (desired))
+#endif
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION Mutex;
+#define init_mutex(mutex) InitializeCriticalSection(mutex)
+#define lock_mutex(mutex) EnterCriticalSection(mutex)
+#define unlock_mutex(mutex) LeaveCriticalSection(mutex)
+#else
+typedef pthread_mutex_t Mutex;
+#define init_mutex(mutex) pthread_mutex_init((mutex), NULL)
+#define lock_mutex(mutex) pthread_mutex_lock(mutex)
+#define unlock_mutex(mutex) pthread_mutex_unlock(mutex)
+#endif
+
+struct ThreadStart
+{
+    void (*func)(void *);
+    void * arg;
+};
+
+#ifdef _WIN32
+DWORD WINAPI thread_trampoline(LPVOID param)
+#else
+void * thread_trampoline(void * param)
+#endif
+{
+    struct ThreadStart start = *(struct ThreadStart *)param;
+    free(param);
+    start.func(start.arg);
+    return 0;
+}
+
+/* @return error */
+int start_thread(Thread * thread, void (*func)(void *), void * arg)
+{
+    struct ThreadStart * start = malloc(sizeof(struct ThreadStart));
+    start->func = func;
+    start->arg = arg;
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, thread_trampoline, start, 0, NULL);
+    if (*thread) return 0;
+#else
+    if (pthread_create(thread, NULL, thread_trampoline, start) == 0) return 0;
+#endif
+    free(start);
+    return 1;
+}
+
+void join_thread(Thread thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+int cpu_count()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+void sleep_ms(int ms)
+{
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+#endif
+}
+
+#endif
@@ -0,0 +1,195 @@
+#include <stdint.h>
+#include <string.h>
+
+#ifndef TIMER_WHEEL_C
+#define TIMER_WHEEL_C
+
+// Timer wheel
+// --------------------------------------
+
+// A hierarchical timer wheel on a millisecond clock, in the style of the
+// classic Linux kernel one. Level 0 has a slot for each of the next 64 ticks,
+// every level above covers 64 times the span of the one below, and when the
+// clock crosses a slot boundary the matching slot of the level above is
+// cascaded down. Arming and cancelling are constant time, nothing allocates,
+// and the timers themselves are embedded in whatever they belong to.
+//
+// Times are 32 bit milliseconds (what Windows hands its hooks) and compared
+// through their difference so the clock may wrap. Timers further out than the
+// top level can reach (about 4.6 hours) fire at its far end instead.
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_MAX_DELAY ((1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+struct Timer;
+
+typedef void (*TimerCallback)(struct Timer * timer, void * arg);
+
+struct Timer
+{
+    uint32_t expires;
+    TimerCallback on_expire;
+    struct Timer * next;
+    struct Timer ** pprev; // NULL while not armed
+    int level;
+    int slot;
+};
+
+struct TimerWheel
+{
+    uint32_t next_tick; // The first tick not processed yet
+    int count;
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    struct Timer * slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+int is_time_before(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
+void init_timer(struct Timer * timer, TimerCallback on_expire)
+{
+    memset(timer, 0, sizeof(struct Timer));
+    timer->on_expire = on_expire;
+}
+
+int is_timer_armed(struct Timer * timer)
+{
+    return timer->pprev != NULL;
+}
+
+// Forgets every timer without touching them, for when their owners are gone.
+// The clock carries on where it was.
+void clear_timer_wheel(struct TimerWheel * wheel)
+{
+    uint32_t next_tick = wheel->next_tick;
+    memset(wheel, 0, sizeof(struct TimerWheel));
+    wheel->next_tick = next_tick;
+}
+
+void link_timer(struct TimerWheel * wheel, struct Timer * timer)
+{
+    uint32_t delay = timer->expires - wheel->next_tick;
+    if ((int32_t)delay < 0) {
+        delay = 0; // Overdue, fires on the next tick
+        timer->expires = wheel->next_tick;
+    } else if (delay > TIMER_WHEEL_MAX_DELAY) {
+        delay = TIMER_WHEEL_MAX_DELAY;
+        timer->expires = wheel->next_tick + delay;
+    }
+    int level = 0;
+    while (delay >> (TIMER_WHEEL_BITS * (level + 1))) level++;
+    timer->level = level;
+    timer->slot = (timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+    struct Timer ** head = &wheel->slots[level][timer->slot];
+    timer->next = *head;
+    if (*head) (*head)->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+    wheel->occupied[level] |= (uint64_t)1 << timer->slot;
+}
+
+void unlink_timer(struct TimerWheel * wheel, struct Timer * timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    if (!wheel->slots[timer->level][timer->slot]) {
+        wheel->occupied[timer->level] &= ~((uint64_t)1 << timer->slot);
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// Re-arming an armed timer moves it
+void arm_timer(struct TimerWheel * wheel, struct Timer * timer, uint32_t expires)
+{
+    if (is_timer_armed(timer)) {
+        unlink_timer(wheel, timer);
+    } else {
+        wheel->count++;
+    }
+    timer->expires = expires;
+    link_timer(wheel, timer);
+}
+
+void cancel_timer(struct TimerWheel * wheel, struct Timer * timer)
+{
+    if (!is_timer_armed(timer)) return;
+    unlink_timer(wheel, timer);
+    wheel->count--;
+}
+
+void cascade_timers(struct TimerWheel * wheel, int level, int slot)
+{
+    struct Timer * timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~((uint64_t)1 << slot);
+    while (timer) {
+        struct Timer * next = timer->next;
+        link_timer(wheel, timer);
+        timer = next;
+    }
+}
+
+// Fires every timer due at or before now, in order of expiry. Callbacks get
+// arg and may arm or cancel any timer, including the one that fired.
+void advance_timer_wheel(struct TimerWheel * wheel, uint32_t now, void * arg)
+{
+    while (!wheel->count || !is_time_before(now, wheel->next_tick)) {
+        // An empty wheel follows the clock wherever it goes, even backwards
+        if (!wheel->count) {
+            wheel->next_tick = now + 1;
+            return;
+        }
+
+        int index = wheel->next_tick & TIMER_WHEEL_MASK;
+        // Skip straight to the end of the level 0 span when nothing is left
+        // in it; cascades only ever happen at its start
+        if (index && !(wheel->occupied[0] >> index)) {
+            uint32_t span_end = wheel->next_tick + (TIMER_WHEEL_SLOTS - index);
+            wheel->next_tick = is_time_before(now, span_end) ? now + 1 : span_end;
+            continue;
+        }
+
+        for (int level = 1; !index && level < TIMER_WHEEL_LEVELS; level++) {
+            index = (wheel->next_tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+            cascade_timers(wheel, level, index);
+        }
+
+        // Timers armed from a callback for this tick land in this slot too
+        struct Timer ** head = &wheel->slots[0][wheel->next_tick & TIMER_WHEEL_MASK];
+        while (*head) {
+            struct Timer * timer = *head;
+            unlink_timer(wheel, timer);
+            wheel->count--;
+            timer->on_expire(timer, arg);
+        }
+        wheel->next_tick++;
+    }
+}
+
+// The earliest expiry of any armed timer. Slots aren't ordered across levels
+// (or even within one, once a level wraps) so this looks at all of them;
+// there are never more than a handful of timers.
+/* @return whether any timer is armed */
+int next_timer_expiry(struct TimerWheel * wheel, uint32_t * expires)
+{
+    if (!wheel->count) return 0;
+    int found = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS && wheel->occupied[level] >> slot; slot++) {
+            for (struct Timer * timer = wheel->slots[level][slot]; timer; timer = timer->next) {
+                if (!found || is_time_before(timer->expires, *expires)) *expires = timer->expires;
+                found = 1;
+            }
+        }
+    }
+    return found;
+}
+
+#endif
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <string.h>
+#include "input.h"
+
+#ifndef TRACE_C
+#define TRACE_C
+
+// Input traces
+// --------------------------------------
+
+// A trace is a plain text log of the raw inputs seen by the hooks, one per
+// line, so that a user's session can be replayed through the engine later:
+//
+//     <time ms> <scan code> <virt code> <UP|DOWN> <is_injected>
+//     1043 0x3a 0x14 DOWN 0
+//
+// Lines starting with '#' are comments.
+
+struct TraceEvent
+{
+    unsigned long time;
+    int scan_code;
+    int virt_code;
+    enum Direction direction;
+    int is_injected;
+};
+
+void write_trace_event(FILE * file, struct TraceEvent * event)
+{
+    fprintf(file, "%lu 0x%02x 0x%02x %s %d\n",
+        event->time,
+        event->scan_code,
+        event->virt_code,
+        event->direction == DOWN ? "DOWN" : "UP",
+        event->is_injected);
+}
+
+/* @return 1 if an event was read, 0 at end of file and -1 on a malformed line */
+int read_trace_event(FILE * file, struct TraceEvent * event, int * linenum)
+{
+    char line[255];
+    while (fgets(line, sizeof(line), file)) {
+        (*linenum)++;
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') continue;
+
+        char dir[8];
+        if (sscanf(line, "%lu %i %i %7s %d",
+                &event->time,
+                &event->scan_code,
+                &event->virt_code,
+                dir,
+                &event->is_injected) != 5) {
+            return -1;
+        }
+        if (strcmp(dir, "DOWN") == 0) {
+            event->direction = DOWN;
+        } else if (strcmp(dir, "UP") == 0) {
+            event->direction = UP;
+        } else {
+            return -1;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+#endif